@@ -0,0 +1,136 @@
+//Checks that the vector cipher kernels match the scalar kernel bit for bit
+//Runs every kernel this CPU supports over random plaintext and key of many lengths, for encryption and decryption,
+//and checks that decrypting the encrypted text gives back the plaintext. Prints PASS or the first mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "otp.h"
+
+//Longest random message checked, lengths below SWEEP_LENGTH are all checked to cover every tail size
+#define MAX_LENGTH 100000
+#define SWEEP_LENGTH 300
+
+//Prototypes
+void fillRandom(char*, int);
+int checkKernel(const char*, void (*)(const char*, const char*, char*, int, int), const char*, const char*, int);
+
+int main()
+{
+    char *fileMessage, *keyMessage, *cipherText, *plainText;
+    int len, failures;
+
+    srand(time(NULL));
+    fileMessage = malloc(MAX_LENGTH);
+    keyMessage = malloc(MAX_LENGTH);
+    cipherText = malloc(MAX_LENGTH);
+    plainText = malloc(MAX_LENGTH);
+    if(fileMessage == NULL || keyMessage == NULL || cipherText == NULL || plainText == NULL)
+    {
+        fprintf(stderr, "cipher_test error: out of memory\n");
+        exit(1);
+    }
+
+    failures = 0;
+    for(len=0;len<=MAX_LENGTH && failures == 0;len = (len < SWEEP_LENGTH) ? len+1 : len*3/2)
+    {
+        fillRandom(fileMessage, len);
+        fillRandom(keyMessage, len);
+
+        if(cipherHasSSE2())
+        {
+            failures += checkKernel("sse2", cipherSSE2, fileMessage, keyMessage, len);
+        }
+        if(cipherHasAVX2())
+        {
+            failures += checkKernel("avx2", cipherAVX2, fileMessage, keyMessage, len);
+        }
+        failures += checkKernel("dispatch", cipherBuffer, fileMessage, keyMessage, len);
+
+        //Round trip
+        cipherBuffer(fileMessage, keyMessage, cipherText, len, CIPHER_ENCRYPT);
+        cipherBuffer(cipherText, keyMessage, plainText, len, CIPHER_DECRYPT);
+        if(memcmp(fileMessage, plainText, len) != 0)
+        {
+            fprintf(stderr, "cipher_test: round trip failed at length %d\n", len);
+            failures++;
+        }
+    }
+
+    free(fileMessage);
+    free(keyMessage);
+    free(cipherText);
+    free(plainText);
+
+    if(failures > 0)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS (sse2 %s, avx2 %s)\n", cipherHasSSE2() ? "checked" : "not supported", cipherHasAVX2() ? "checked" : "not supported");
+    return 0;
+}
+
+/*************************************************
+ * Function: fillRandom
+ * Description: Fills a buffer with random characters from the 27 character alphabet
+ * Params: buffer, number of characters
+ * Returns: none
+ * Pre-conditions: buffer holds at least len characters
+ * Post-conditions: buffer is filled
+ * **********************************************/
+void fillRandom(char* buffer, int len)
+{
+    int i;
+    char alphabetASCII[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+    for(i=0;i<len;i++)
+    {
+        buffer[i] = alphabetASCII[rand()%27];
+    }
+}
+
+/*************************************************
+ * Function: checkKernel
+ * Description: Runs a kernel and the scalar kernel on the same input for both operations and compares the output
+ * Params: kernel name, kernel, file message, key, number of characters
+ * Returns: number of operations that did not match
+ * Pre-conditions: CPU supports the kernel
+ * Post-conditions: prints the first mismatching position of each failed operation
+ * **********************************************/
+int checkKernel(const char* name, void (*kernel)(const char*, const char*, char*, int, int), const char* fileMessage, const char* keyMessage, int len)
+{
+    char *expected, *actual;
+    int op, i, failures;
+
+    //+1 so a zero length check still has buffers
+    expected = malloc(len + 1);
+    actual = malloc(len + 1);
+    if(expected == NULL || actual == NULL)
+    {
+        fprintf(stderr, "cipher_test error: out of memory\n");
+        exit(1);
+    }
+
+    failures = 0;
+    for(op=CIPHER_ENCRYPT;op<=CIPHER_DECRYPT;op++)
+    {
+        cipherScalar(fileMessage, keyMessage, expected, len, op);
+        kernel(fileMessage, keyMessage, actual, len, op);
+        for(i=0;i<len;i++)
+        {
+            if(expected[i] != actual[i])
+            {
+                fprintf(stderr, "cipher_test: %s %s differs at %d of %d: '%c' and '%c' gave '%c', expected '%c'\n",
+                        name, (op == CIPHER_ENCRYPT) ? "encrypt" : "decrypt", i, len, fileMessage[i], keyMessage[i], actual[i], expected[i]);
+                failures++;
+                break;
+            }
+        }
+    }
+
+    free(expected);
+    free(actual);
+    return failures;
+}
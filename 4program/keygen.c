@@ -1,110 +1,90 @@
 //Program 4 - JONATHAN A JONES
 //This program creates a key of specified length.
-//The characters in the file generated will be any of the 27 allowed characters, generated using the standard UNIX randomization methods.
+//The characters in the file generated will be any of the 27 allowed characters, generated a block at a time with a fast seeded random generator.
+//With -s they come from the kernel's cryptographically secure generator instead, use that for keys that protect real data.
+//With -p port the key is fetched from the otp_keyd key pool on this machine instead of generated.
+//With -j the key is split into blocks made by that many threads, each with its own random stream, the output is still one key.
 //The last character outputted is a newline.
 //Takes in a command line argument for the length of the key and outputs to stdout
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
 #include <time.h>
-
-//Prototypes
-void generateKey();
-int getRandomNumber();
-char convertToChar();
+#include <unistd.h>
+#include "otp.h"
 
 int main(int argc, char* argv[])
 {
+    struct timespec now;
+    int opt, secure, numThreads;
+    char* poolPort;
+    uint64_t seed;
+
+    otpProgramName = "keygen";
+
+    //Check options, -s uses getrandom, -j sets the number of threads, -p fetches from a key pool
+    secure = 0;
+    numThreads = 1;
+    poolPort = NULL;
+    while((opt = getopt(argc, argv, "sj:p:")) != -1)
+    {
+        if(opt == 's')
+        {
+            secure = 1;
+        }
+        else if(opt == 'p')
+        {
+            poolPort = optarg;
+        }
+        else if(opt == 'j')
+        {
+            numThreads = atoi(optarg);
+            if(numThreads < 1 || numThreads > MAX_KEY_THREADS)
+            {
+                fprintf(stderr, "%s error: threads must be between 1 and %d\n", otpProgramName, MAX_KEY_THREADS);
+                exit(1);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "USAGE: %s [-s] [-j threads] [-p port] length\n", argv[0]);
+            exit(1);
+        }
+    }
+
     //Check number of arguments
-    if(argc > 2)
+    if(argc - optind > 1)
     {
         fprintf(stderr, "too many arguments were entered\n");
         exit(1);
     }
-    else if(argc == 1)
+    else if(argc - optind < 1)
     {
         fprintf(stderr, "not enough arguments entered\n");
         exit(1);
     }
 
-    //Get length of key
-    int len;
-    len = atoi(argv[1]);
-
-    srand(time(NULL));
-
-    generateKey(len);
-    return 0;
-}
-
-/*************************************************
- * Function: generateKey
- * Description: Generates a key of the length specified by the user and sends to stdout character by character
- * Params: int length of key 
- * Returns: none
- * Pre-conditions: none
- * Post-conditions: Has printed a key of length len of Capital letters/whitespace to stdout and a newline character
- * **********************************************/
-void generateKey(int len)
-{
-    //For the length specified by the user, get a random capital letter or whitespace and output to stdout
-    int i;
-    for(i=0;i<len;i++)
+    //Get length of key, a pool fetch has to ask for at least one character
+    long len;
+    char* end;
+    len = strtol(argv[optind], &end, 10);
+    if(argv[optind][0] == '\0' || *end != '\0' || len < 0 || (poolPort != NULL && len == 0))
     {
-        //Call convertToChar and getRandom number to get random character
-        printf("%c", convertToChar(getRandomNumber()));
+        fprintf(stderr, "%s error: bad key length %s\n", otpProgramName, argv[optind]);
+        fprintf(stderr, "USAGE: %s [-s] [-j threads] [-p port] length\n", argv[0]);
+        exit(1);
     }
-    //Add a new line at the end
-    printf("\n");
-}
 
-/*************************************************
- * Function: convertToChar
- * Description: Converts an integer to a character
- * Params: integer to be converted to a char
- * Returns: character converted from integer
- * Pre-conditions: none
- * Post-conditions: integer converted to character
- * **********************************************/
-char convertToChar(int n)
-{
-    char result;
-    result = n;
-    return result;
-    
-}
-
-//Whitespace ASCII = 32
-//Charcters 65-90
-/*************************************************
- * Function: getRandomNumber
- * Description: Generates a random number corresponding to ASCII for a capital letter or whitespace
- * Params: none
- * Returns: integer ASCII value
- * Pre-conditions: none
- * Post-conditions: returns an ASCII value between 65-90 or 32
- * **********************************************/
-int getRandomNumber()
-{
-    //Generate a random number corresponding to an ASCII character
-    int result;
-    result = rand()%27;
-    //If random number is 27, convert to ASCII decimal equivalent of whitespace
-    if(result == 26)
+    if(poolPort != NULL)
     {
-        result = 32;
+        poolKey(poolPort, len);
+        return 0;
     }
-    //If random number is not 27 then return ASCII decimal equivalent of a capital letter
-    else
-    {
-        result += 65;
-    }
-    return result;
-}
 
+    //Seed from the clock and process id so keys made in the same second still differ, not used with -s
+    clock_gettime(CLOCK_REALTIME, &now);
+    seed = ((uint64_t)now.tv_sec << 32) ^ now.tv_nsec ^ ((uint64_t)getpid() << 16);
+
+    generateKey(len, numThreads, seed, secure);
+    return 0;
+}
@@ -0,0 +1,217 @@
+//Checks the legacy protocol of the blocking daemon against a daemon started in a child process
+//Sends a key shorter than the plaintext, which has to close the connection without a reply, then a good request on a new
+//connection, which has to come back as cipherBuffer would encrypt it. Prints PASS or what went wrong.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "otp.h"
+
+//Plaintext of both requests, the short key is a few characters of it
+#define TEST_TEXT "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG"
+#define SHORT_KEY "XYZ"
+//How long to wait for the daemon to start listening, in tries 10ms apart
+#define CONNECT_TRIES 500
+
+//Prototypes
+int startDaemon(char*);
+int connectDaemon(struct sockaddr_storage*);
+int sendRequest(int, const char*, const char*, char*, int);
+void pickPort(char*, int);
+
+int main()
+{
+    char port[16], reply[sizeof(TEST_TEXT) + 1], key[sizeof(TEST_TEXT)], expected[sizeof(TEST_TEXT)];
+    int daemonPid, socketFD, portNumber, len, failures;
+    struct sockaddr_storage serverAddress;
+
+    otpProgramName = "legacy_test";
+    pickPort(port, sizeof(port));
+    fillAddrStruct(&serverAddress, &portNumber, port, "localhost");
+    daemonPid = startDaemon(port);
+
+    failures = 0;
+    //Short key, the daemon must not answer with cipher text
+    socketFD = connectDaemon(&serverAddress);
+    if(socketFD < 0)
+    {
+        fprintf(stderr, "legacy_test: could not connect to the daemon on port %s\n", port);
+        failures++;
+    }
+    else
+    {
+        len = sendRequest(socketFD, TEST_TEXT, SHORT_KEY, reply, sizeof(reply));
+        if(len != 0)
+        {
+            fprintf(stderr, "legacy_test: short key got %d characters back, expected the connection to close\n", len);
+            failures++;
+        }
+        close(socketFD);
+    }
+
+    //Good request, the worker has to still be serving and the answer has to be right
+    socketFD = connectDaemon(&serverAddress);
+    if(socketFD < 0)
+    {
+        fprintf(stderr, "legacy_test: could not reconnect to the daemon on port %s\n", port);
+        failures++;
+    }
+    else
+    {
+        memset(key, 'K', sizeof(key) - 1);
+        key[sizeof(key) - 1] = '\0';
+        cipherBuffer(TEST_TEXT, key, expected, sizeof(TEST_TEXT) - 1, CIPHER_ENCRYPT);
+        len = sendRequest(socketFD, TEST_TEXT, key, reply, sizeof(reply));
+        if(len != sizeof(TEST_TEXT) || memcmp(reply, expected, sizeof(TEST_TEXT) - 1) != 0 || reply[len - 1] != '0')
+        {
+            fprintf(stderr, "legacy_test: good request got %d characters back, expected the cipher text of %d\n", len, (int)sizeof(TEST_TEXT) - 1);
+            failures++;
+        }
+        close(socketFD);
+    }
+
+    //Supervisor and workers share the process group
+    kill(-daemonPid, SIGTERM);
+    waitpid(daemonPid, NULL, 0);
+
+    if(failures > 0)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
+
+/*************************************************
+ * Function: startDaemon
+ * Description: Forks a blocking encryption daemon with one worker in a process group of its own
+ * Params: port to listen on
+ * Returns: pid of the daemon, which is also its process group
+ * Pre-conditions: nothing else listens on the port
+ * Post-conditions: daemon is starting, the caller kills the process group when done
+ * **********************************************/
+int startDaemon(char* port)
+{
+    char* daemonArgs[] = {"otp_enc_d", port, "1", NULL};
+    int pid;
+
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "legacy_test error: fork failed\n");
+        exit(1);
+    }
+    else if(pid == 0)
+    {
+        setpgid(0, 0);
+        //The daemon's errors are expected here, the short key is one
+        freopen("/dev/null", "w", stderr);
+        otpProgramName = "otp_enc_d";
+        exit(daemonMain(3, daemonArgs, OTP_OP_ENC));
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+/*************************************************
+ * Function: connectDaemon
+ * Description: Connects to the daemon and exchanges the legacy identifier bit, retrying while it starts
+ * Params: address of the daemon
+ * Returns: connected socket file descriptor, -1 if the daemon never answered
+ * Pre-conditions: address is filled
+ * Post-conditions: socket is ready for a legacy request
+ * **********************************************/
+int connectDaemon(struct sockaddr_storage* serverAddress)
+{
+    int socketFD, tries;
+    char identifier;
+
+    for(tries=0;tries<CONNECT_TRIES;tries++)
+    {
+        socketFD = socket(AF_INET, SOCK_STREAM, 0);
+        if(socketFD < 0)
+        {
+            return -1;
+        }
+        if(connect(socketFD, (struct sockaddr*)serverAddress, addrLength(serverAddress)) == 0)
+        {
+            identifier = legacyIdentifier(OTP_OP_ENC);
+            if(sendAll(socketFD, &identifier, 1) == 0 && recv(socketFD, &identifier, 1, 0) == 1 &&
+               identifier == legacyIdentifier(OTP_OP_ENC))
+            {
+                return socketFD;
+            }
+            close(socketFD);
+            return -1;
+        }
+        close(socketFD);
+        usleep(10000);
+    }
+    return -1;
+}
+
+/*************************************************
+ * Function: sendRequest
+ * Description: Sends plaintext and key each ended with the control character and reads whatever comes back until the daemon
+ * closes or the reply ends with the control character
+ * Params: connected socket file descriptor, plaintext, key, reply buffer, reply buffer size
+ * Returns: number of characters received, control character included, -1 if sending failed
+ * Pre-conditions: identifier bit has been exchanged
+ * Post-conditions: reply holds what the daemon sent
+ * **********************************************/
+int sendRequest(int socketFD, const char* text, const char* key, char* reply, int replySize)
+{
+    int len, charsRead;
+
+    if(sendAll(socketFD, text, strlen(text)) < 0 || sendAll(socketFD, "0", 1) < 0 ||
+       sendAll(socketFD, key, strlen(key)) < 0 || sendAll(socketFD, "0", 1) < 0)
+    {
+        return -1;
+    }
+    len = 0;
+    while(len < replySize && (len == 0 || reply[len - 1] != '0'))
+    {
+        charsRead = recv(socketFD, &reply[len], replySize - len, 0);
+        if(charsRead <= 0)
+        {
+            break;
+        }
+        len += charsRead;
+    }
+    return len;
+}
+
+/*************************************************
+ * Function: pickPort
+ * Description: Picks a port nothing listens on by binding to port 0 and reading back the one the kernel chose
+ * Params: port string buffer, buffer size
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: buffer holds the port number as a string, exits if no socket could be bound
+ * **********************************************/
+void pickPort(char* port, int size)
+{
+    int socketFD;
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+
+    memset(&address, '\0', sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if(socketFD < 0 || bind(socketFD, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+       getsockname(socketFD, (struct sockaddr*)&address, &addressSize) < 0)
+    {
+        fprintf(stderr, "legacy_test error: could not find a free port\n");
+        exit(1);
+    }
+    snprintf(port, size, "%d", ntohs(address.sin_port));
+    close(socketFD);
+}
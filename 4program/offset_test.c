@@ -0,0 +1,316 @@
+//Checks that -O hands out every key character at most once, against an otp_d started in a child process
+//Encrypts the same plaintext twice with -O: the runs have to use back to back slices of the key, and the offset file has
+//to move past each slice by the plaintext line length. Then decrypts the second cipher text with -o at the offset it was
+//encrypted at, which has to give the plaintext back. Prints PASS or what went wrong.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "otp.h"
+
+//Plaintext line, the key has room for three slices of it
+#define TEST_TEXT "ATTACK AT DAWN ON THE EASTERN FRONT"
+#define TEXT_LEN (int)(sizeof(TEST_TEXT) - 1)
+#define KEY_LEN (3*TEXT_LEN)
+//How long to wait for the daemon to start listening, in tries 10ms apart
+#define CONNECT_TRIES 500
+
+//Prototypes
+int startDaemon(char*);
+int waitForDaemon(struct sockaddr_storage*);
+int runClient(char**, int, const char*);
+int readFile(const char*, char*, int);
+void writeFile(const char*, const char*, int);
+void fillRandom(char*, int);
+void pickPort(char*, int);
+
+int main()
+{
+    char dir[] = "/tmp/offset_testXXXXXX", textPath[64], keyPath[64], offsetPath[64], outPath[2][64], plainPath[64];
+    char port[16], offsetArg[32], key[KEY_LEN + 1], expected[TEXT_LEN], out[TEXT_LEN + 2], buffer[64];
+    int daemonPid, portNumber, failures, run, len;
+    struct sockaddr_storage serverAddress;
+
+    otpProgramName = "offset_test";
+    srand(time(NULL));
+    if(mkdtemp(dir) == NULL)
+    {
+        fprintf(stderr, "offset_test error: could not make a directory in /tmp\n");
+        exit(1);
+    }
+    snprintf(textPath, sizeof(textPath), "%s/plaintext", dir);
+    snprintf(keyPath, sizeof(keyPath), "%s/key", dir);
+    snprintf(offsetPath, sizeof(offsetPath), "%s/offset", dir);
+    snprintf(outPath[0], sizeof(outPath[0]), "%s/ciphertext1", dir);
+    snprintf(outPath[1], sizeof(outPath[1]), "%s/ciphertext2", dir);
+    snprintf(plainPath, sizeof(plainPath), "%s/plaintext_a", dir);
+    writeFile(textPath, TEST_TEXT "\n", TEXT_LEN + 1);
+    fillRandom(key, KEY_LEN);
+    key[KEY_LEN] = '\n';
+    writeFile(keyPath, key, KEY_LEN + 1);
+
+    pickPort(port, sizeof(port));
+    fillAddrStruct(&serverAddress, &portNumber, port, "localhost");
+    daemonPid = startDaemon(port);
+    failures = 0;
+    if(waitForDaemon(&serverAddress) < 0)
+    {
+        fprintf(stderr, "offset_test: daemon did not listen on port %s\n", port);
+        failures++;
+    }
+
+    //Two claims from an offset file that does not exist yet, slice 0 then slice 1
+    for(run=0;run<2 && failures == 0;run++)
+    {
+        char* encArgs[] = {"otp_enc", "-O", offsetPath, textPath, keyPath, port, NULL};
+
+        if(runClient(encArgs, OTP_OP_ENC, outPath[run]) != 0)
+        {
+            fprintf(stderr, "offset_test: otp_enc -O run %d failed\n", run + 1);
+            failures++;
+            break;
+        }
+        cipherBuffer(TEST_TEXT, &key[run*TEXT_LEN], expected, TEXT_LEN, CIPHER_ENCRYPT);
+        len = readFile(outPath[run], out, sizeof(out));
+        if(len != TEXT_LEN + 1 || memcmp(out, expected, TEXT_LEN) != 0)
+        {
+            fprintf(stderr, "offset_test: otp_enc -O run %d did not use the key from offset %d\n", run + 1, run*TEXT_LEN);
+            failures++;
+        }
+        len = readFile(offsetPath, buffer, sizeof(buffer) - 1);
+        buffer[(len > 0) ? len : 0] = '\0';
+        if(atol(buffer) != (run + 1)*TEXT_LEN)
+        {
+            fprintf(stderr, "offset_test: offset file holds %s after run %d, expected %d\n", buffer, run + 1, (run + 1)*TEXT_LEN);
+            failures++;
+        }
+    }
+
+    //The second cipher text decrypts with the key from where the second run started
+    if(failures == 0)
+    {
+        char* decArgs[] = {"otp_dec", "-o", offsetArg, outPath[1], keyPath, port, NULL};
+
+        snprintf(offsetArg, sizeof(offsetArg), "%d", TEXT_LEN);
+        len = (runClient(decArgs, OTP_OP_DEC, plainPath) == 0) ? readFile(plainPath, out, sizeof(out)) : -1;
+        if(len != TEXT_LEN + 1 || memcmp(out, TEST_TEXT, TEXT_LEN) != 0)
+        {
+            fprintf(stderr, "offset_test: otp_dec -o %s did not give the plaintext back\n", offsetArg);
+            failures++;
+        }
+    }
+
+    //Supervisor and workers share the process group
+    kill(-daemonPid, SIGTERM);
+    waitpid(daemonPid, NULL, 0);
+    unlink(textPath);
+    unlink(keyPath);
+    unlink(offsetPath);
+    unlink(outPath[0]);
+    unlink(outPath[1]);
+    unlink(plainPath);
+    rmdir(dir);
+
+    if(failures > 0)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
+
+/*************************************************
+ * Function: startDaemon
+ * Description: Forks an otp_d serving both operations with one worker in a process group of its own
+ * Params: port to listen on
+ * Returns: pid of the daemon, which is also its process group
+ * Pre-conditions: nothing else listens on the port
+ * Post-conditions: daemon is starting, the caller kills the process group when done
+ * **********************************************/
+int startDaemon(char* port)
+{
+    char* daemonArgs[] = {"otp_d", port, "1", NULL};
+    int pid;
+
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "offset_test error: fork failed\n");
+        exit(1);
+    }
+    else if(pid == 0)
+    {
+        setpgid(0, 0);
+        //waitForDaemon hangs up without a hello, the daemon's complaint about it is expected
+        freopen("/dev/null", "w", stderr);
+        otpProgramName = "otp_d";
+        exit(daemonMain(3, daemonArgs, OTP_OP_ANY));
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+/*************************************************
+ * Function: waitForDaemon
+ * Description: Waits until the daemon takes connections, so the first client does not find nothing listening
+ * Params: address of the daemon
+ * Returns: 0 once a connection was made, -1 if the daemon never listened
+ * Pre-conditions: address is filled
+ * Post-conditions: the test connection is closed again, the worker sees it end before it sends anything
+ * **********************************************/
+int waitForDaemon(struct sockaddr_storage* serverAddress)
+{
+    int socketFD, tries, connected;
+
+    for(tries=0;tries<CONNECT_TRIES;tries++)
+    {
+        socketFD = socket(AF_INET, SOCK_STREAM, 0);
+        if(socketFD < 0)
+        {
+            return -1;
+        }
+        connected = (connect(socketFD, (struct sockaddr*)serverAddress, addrLength(serverAddress)) == 0);
+        close(socketFD);
+        if(connected)
+        {
+            return 0;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+/*************************************************
+ * Function: runClient
+ * Description: Runs otp_enc or otp_dec in a child process with its output going to a file
+ * Params: NULL terminated arguments, OTP_OP_ENC or OTP_OP_DEC, path of the output file
+ * Returns: exit status of the client, -1 if it did not exit normally
+ * Pre-conditions: none
+ * Post-conditions: output file holds what the client printed
+ * **********************************************/
+int runClient(char** args, int op, const char* outPath)
+{
+    int pid, status, argc, outFD;
+
+    for(argc=0;args[argc]!=NULL;argc++);
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "offset_test error: fork failed\n");
+        exit(1);
+    }
+    else if(pid == 0)
+    {
+        outFD = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(outFD < 0 || dup2(outFD, STDOUT_FILENO) < 0)
+        {
+            exit(1);
+        }
+        otpProgramName = args[0];
+        exit(clientMain(argc, args, op));
+    }
+    if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+/*************************************************
+ * Function: readFile
+ * Description: Reads the start of a file
+ * Params: path, buffer, buffer size
+ * Returns: number of characters read, -1 if the file could not be read
+ * Pre-conditions: none
+ * Post-conditions: buffer holds up to size characters of the file
+ * **********************************************/
+int readFile(const char* path, char* buffer, int size)
+{
+    int fd, len;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    len = read(fd, buffer, size);
+    close(fd);
+    return len;
+}
+
+/*************************************************
+ * Function: writeFile
+ * Description: Creates a file holding the given characters
+ * Params: path, characters, number of characters
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: file is written, exits if it could not be
+ * **********************************************/
+void writeFile(const char* path, const char* data, int len)
+{
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0 || writeAll(fd, data, len) < 0)
+    {
+        fprintf(stderr, "offset_test error: could not write %s\n", path);
+        exit(1);
+    }
+    close(fd);
+}
+
+/*************************************************
+ * Function: fillRandom
+ * Description: Fills a buffer with random characters from the 27 character alphabet
+ * Params: buffer, number of characters
+ * Returns: none
+ * Pre-conditions: buffer holds at least len characters
+ * Post-conditions: buffer is filled
+ * **********************************************/
+void fillRandom(char* buffer, int len)
+{
+    int i;
+    char alphabetASCII[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+    for(i=0;i<len;i++)
+    {
+        buffer[i] = alphabetASCII[rand()%27];
+    }
+}
+
+/*************************************************
+ * Function: pickPort
+ * Description: Picks a port nothing listens on by binding to port 0 and reading back the one the kernel chose
+ * Params: port string buffer, buffer size
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: buffer holds the port number as a string, exits if no socket could be bound
+ * **********************************************/
+void pickPort(char* port, int size)
+{
+    int socketFD;
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+
+    memset(&address, '\0', sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if(socketFD < 0 || bind(socketFD, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+       getsockname(socketFD, (struct sockaddr*)&address, &addressSize) < 0)
+    {
+        fprintf(stderr, "offset_test error: could not find a free port\n");
+        exit(1);
+    }
+    snprintf(port, size, "%d", ntohs(address.sin_port));
+    close(socketFD);
+}
@@ -0,0 +1,215 @@
+//libotp, the one time pad code shared by otp_enc, otp_dec, otp_enc_d, otp_dec_d, otp_d, otp_keyd, otp_bench, otp_load and keygen
+//Each program is a small front-end that names itself and calls clientMain, daemonMain, keyPoolMain, benchMain, loadMain or generateKey with its operation.
+//Characters are the 27 letter alphabet A-Z plus space, the clients reject anything else before it is sent
+//Every port argument may also be the path of a Unix domain socket, anything with a slash in it is taken as one
+
+#ifndef OTP_H
+#define OTP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+//Largest payload accepted in one binary protocol message, checked before anything is read
+//Also the largest legacy protocol plaintext or key, those can not be streamed
+#define MAX_PAYLOAD (16*1024*1024)
+//Bytes asked for per recv call
+#define RECV_CHUNK 65536
+//Characters of plaintext and key per chunk pair in the binary protocol
+#define STREAM_CHUNK 65536
+//Connections the kernel queues on a listening socket before a worker accepts them, past that a TCP client's connect stalls
+//on retransmits and a Unix domain socket client's fails
+#define DEFAULT_BACKLOG 128
+//Most file descriptors taken from one SCM_RIGHTS message, a files message carries two
+#define MAX_PASSED_FDS 4
+
+//Binary protocol, a client opens with a header instead of the legacy identifier bit
+//The magic byte is never '0' or '1' so the first byte tells the two protocols apart
+#define OTP_MAGIC 0xA7
+#define OTP_VERSION 2
+#define OTP_HEADER_SIZE 12
+//Message types
+#define OTP_MSG_HELLO 1
+#define OTP_MSG_TEXT 2
+#define OTP_MSG_KEY 3
+#define OTP_MSG_RESULT 4
+#define OTP_MSG_ERROR 5
+//Asks otp_keyd for key characters, the payload is the count as 4 bytes in network byte order, answered with a key message
+#define OTP_MSG_KEYREQ 6
+//Only over a Unix domain socket, the plaintext and key file descriptors ride along as SCM_RIGHTS and the daemon reads the
+//files itself. The payload is the plaintext length then the key offset, 8 bytes each in network byte order. Answered with
+//result messages like a stream of chunk pairs
+#define OTP_MSG_FILES 7
+#define OTP_FILES_SIZE 16
+//Only over a Unix domain socket, moves the connection's requests to a shared memory ring. The ring's descriptor rides along
+//as SCM_RIGHTS and the daemon answers with a ring message once it has mapped it. From then on nothing more is sent on the
+//socket, it is only kept open to tell either side when the other one is gone
+#define OTP_MSG_RING 8
+//Operation carried in the flags of a hello
+#define OTP_OP_ENC 1
+#define OTP_OP_DEC 2
+//Both operations, what the combined daemon otp_d runs
+#define OTP_OP_ANY (OTP_OP_ENC | OTP_OP_DEC)
+//Set on a text, key or result message when more chunks of the same stream follow
+#define OTP_FLAG_MORE 0x01
+
+//Operation to run, same values as the operation in a binary protocol hello
+#define CIPHER_ENCRYPT OTP_OP_ENC
+#define CIPHER_DECRYPT OTP_OP_DEC
+
+//Spans a daemon traces with -T
+#define TRACE_HANDSHAKE 0
+#define TRACE_ACCEPT 1
+#define TRACE_RECEIVE 2
+#define TRACE_CIPHER 3
+#define TRACE_SEND 4
+
+//Buffered receive, bytes read past the end of one message are kept for the next
+struct recvBuffer
+{
+    int fd;
+    char data[RECV_CHUNK];
+    int start, end;
+};
+
+//Chunk pairs a shared memory ring holds at once
+#define RING_SLOTS 16
+//Slot states, the client fills a free slot, the daemon answers a filled one and the client frees it once it has taken the
+//result. The client closes the ring by posting closed in the slot the daemon looks at next
+#define RING_FREE 0
+#define RING_FILLED 1
+#define RING_DONE 2
+#define RING_CLOSED 3
+
+//One slot of a shared memory ring
+struct ringSlot
+{
+    //Slot state, also the futex word the side waiting on the slot sleeps on
+    uint32_t state;
+    //Chunk pair laid out as it goes over a socket, text header, text, key header and key. The daemon writes the result
+    //message, or an error message, over the text header and text
+    char data[2*OTP_HEADER_SIZE + 2*STREAM_CHUNK];
+};
+
+//Shared memory ring, the client creates it and passes it to the daemon with a ring message. Slots are used in order
+struct otpRing
+{
+    //Set by a side before it sleeps, the other side only makes the system call to wake it when its flag is set
+    uint32_t clientWaiting;
+    uint32_t daemonWaiting;
+    struct ringSlot slot[RING_SLOTS];
+};
+
+//Most threads keygen -j runs
+#define MAX_KEY_THREADS 64
+
+//One random stream for key generation, each key thread has its own
+struct keyStream
+{
+    //xoshiro256** state
+    uint64_t state[4];
+    //Nonzero to read from getrandom instead, the state is then unused
+    int secure;
+};
+
+//Binary protocol header, fields in host byte order once decoded
+struct otpHeader
+{
+    uint8_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t length;
+    //Request a text, key, result or error message belongs to, picked by the client. Results of different requests on one
+    //connection may come back in any order, the results of one request always come in order
+    uint32_t id;
+};
+
+//Name used at the start of every error message, set by each front-end before anything else
+extern const char* otpProgramName;
+
+//Prototypes
+//otp_cipher.c
+void cipherBuffer(const char*, const char*, char*, int, int);
+long cipherFile(int, int, off_t, int, long, int);
+int readFilePair(int, int, off_t, off_t, int, char*, char*);
+void cipherScalar(const char*, const char*, char*, int, int);
+void cipherSSE2(const char*, const char*, char*, int, int);
+void cipherAVX2(const char*, const char*, char*, int, int);
+int cipherHasSSE2();
+int cipherHasAVX2();
+int modulus(int, int);
+//otp_proto.c
+void encodeHeader(unsigned char*, int, int, uint32_t, uint32_t);
+int decodeHeader(const unsigned char*, struct otpHeader*);
+int sendHeader(int, int, int, uint32_t, uint32_t);
+int recvHeader(int, struct otpHeader*);
+int recvHeaderFDs(int, struct otpHeader*, int*, int*);
+int sendFDs(int, const char*, int, const int*, int);
+int recvFDs(int, char*, int, int, int*, int*);
+int sendAll(int, const char*, int);
+int recvAll(int, char*, int);
+int recvUntil(struct recvBuffer*, char**, int*, char);
+char legacyIdentifier(int);
+int legacyOp(char);
+const char* daemonName(int);
+int otherOp(int);
+//otp_net.c
+void error(const char*, int);
+void fillAddrStruct(struct sockaddr_storage*, int*, char*, const char*);
+socklen_t addrLength(const struct sockaddr_storage*);
+void setSocket(int*, struct sockaddr_storage*, int, int);
+void setNonBlocking(int);
+//otp_metrics.c
+void metricsInit();
+void metricsStart(struct timespec*);
+void metricsRecord(int, long, struct timespec*);
+void metricsWorker();
+void metricsThread();
+void metricsWorkerExit(pid_t);
+void metricsReject();
+void metricsAccept();
+void metricsConnection(int);
+void metricsBytes(long, long);
+void metricsCipher(struct timespec*);
+void metricsQueueWait(struct timespec*);
+void metricsReport(FILE*, int);
+void metricsWrite(FILE*, int);
+void metricsServe(int, int);
+//otp_trace.c
+void traceInit(const char*);
+void traceWorker();
+uint64_t traceStart();
+void traceEnd(int, uint64_t, long);
+void traceCheck();
+//otp_ring.c
+struct otpRing* ringCreate(int*);
+struct otpRing* ringMap(int);
+void ringUnmap(struct otpRing*);
+int ringWait(uint32_t*, uint32_t, uint32_t*, int);
+void ringPost(uint32_t*, uint32_t, uint32_t*);
+//otp_daemon.c
+int daemonMain(int, char*[], int);
+//otp_client.c
+int clientMain(int, char*[], int);
+//otp_key.c
+void seedKey(struct keyStream*, uint64_t, int, int);
+uint64_t nextRandom(uint64_t*);
+void secureBytes(unsigned char*, long);
+void randomBytes(struct keyStream*, unsigned char*, long);
+long mapToAlphabet(const unsigned char*, long, char*, long);
+int writeAll(int, const char*, long);
+void generateKey(long, int, uint64_t, int);
+//otp_keypool.c
+int keyPoolMain(int, char*[]);
+void poolKey(char*, long);
+//otp_benchmark.c
+int benchMain(int, char*[]);
+int64_t elapsedNanoseconds(struct timespec*);
+//otp_loadgen.c
+int loadMain(int, char*[]);
+
+#endif
@@ -0,0 +1,10 @@
+//Benchmark for the one time pad programs, starts the daemons and times otp_enc and otp_dec at a range of sizes
+//Everything but the name is in libotp, see otp_benchmark.c
+
+#include "otp.h"
+
+int main(int argc, char* argv[])
+{
+    otpProgramName = "otp_bench";
+    return benchMain(argc, argv);
+}
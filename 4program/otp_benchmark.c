@@ -0,0 +1,578 @@
+//Benchmark driver for otp_bench, starts otp_enc_d and otp_dec_d, makes plaintexts and keys of each size with keygen and runs
+//concurrent otp_enc and otp_dec clients against them. Every request is one run of the real client program, timed from its start
+//to its exit, so the numbers are what a user of the programs sees. Each client runs its requests one after another
+//Results are printed as a table and, with -j, written as one JSON object per operation and size
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "otp.h"
+
+//Sizes measured when -s is not given, -s 1,1K,1M,1G covers the whole range
+#define DEFAULT_SIZES "1,1K,64K,1M,16M"
+#define DEFAULT_CLIENTS 1
+#define DEFAULT_REQUESTS 20
+//Most sizes in one run, most clients and most words in a -D or -C flag string
+#define MAX_SIZES 32
+#define MAX_CLIENTS 256
+#define MAX_FLAGS 16
+//Longest a daemon gets to start listening
+#define START_TIMEOUT_MS 5000
+
+//Results of one operation at one size
+struct benchResult
+{
+    int op;
+    long size;
+    int clients;
+    long requests, errors;
+    double seconds;
+    //Latencies in nanoseconds, of the requests that succeeded
+    int64_t p50, p99, p999;
+};
+
+//Prototypes
+long parseSize(const char*);
+int splitFlags(char*, char**);
+pid_t startProgram(const char*, const char*, char**, int, char**, int, int, const char*);
+int waitForExit(pid_t);
+void makeInput(const char*, const char*, long, const char*);
+int waitForDaemon(const char*);
+void runClients(const char*, int, char**, int, const char*, const char*, const char*, int, long, struct benchResult*);
+int compareLatency(const void*, const void*);
+int64_t percentile(int64_t*, long, double);
+void printResult(FILE*, struct benchResult*);
+void printJSON(FILE*, struct benchResult*);
+
+/*************************************************
+ * Function: benchMain
+ * Description: Runs otp_bench, measures each operation at each size and reports throughput and latency percentiles
+ * Params: argc and argv of the front-end
+ * Returns: exit status, 1 if any request failed
+ * Pre-conditions: otpProgramName is set, keygen and the otp programs are next to otp_bench
+ * Post-conditions: daemons are stopped and the generated files removed
+ * **********************************************/
+int benchMain(int argc, char* argv[])
+{
+    char *sizeList, *jsonPath, *daemonFlags[MAX_FLAGS], *clientFlags[MAX_FLAGS], *token, *slash, dir[] = "/tmp/otp_bench.XXXXXX";
+    char binDir[4096], textPath[4200], keyPath[4200], defaultSizes[] = DEFAULT_SIZES;
+    int opt, numClients, numDaemonFlags, numClientFlags, numSizes, i, op, failed;
+    long requests, sizes[MAX_SIZES];
+    pid_t daemons[2];
+    struct benchResult result;
+    FILE* json;
+
+    //Check options, -c clients, -n requests per client at each size, -s sizes, -D flags for the daemons,
+    //-C flags for the clients, -j where the JSON results go
+    numClients = DEFAULT_CLIENTS;
+    requests = DEFAULT_REQUESTS;
+    sizeList = defaultSizes;
+    jsonPath = NULL;
+    numDaemonFlags = 0;
+    numClientFlags = 0;
+    while((opt = getopt(argc, argv, "c:n:s:D:C:j:")) != -1)
+    {
+        if(opt == 'c')
+        {
+            numClients = atoi(optarg);
+            if(numClients < 1 || numClients > MAX_CLIENTS)
+            {
+                fprintf(stderr, "%s error: clients must be between 1 and %d\n", otpProgramName, MAX_CLIENTS);
+                exit(1);
+            }
+        }
+        else if(opt == 'n')
+        {
+            requests = atol(optarg);
+            if(requests < 1)
+            {
+                fprintf(stderr, "%s error: requests must be at least 1\n", otpProgramName);
+                exit(1);
+            }
+        }
+        else if(opt == 's')
+        {
+            sizeList = optarg;
+        }
+        else if(opt == 'D')
+        {
+            numDaemonFlags = splitFlags(optarg, daemonFlags);
+        }
+        else if(opt == 'C')
+        {
+            numClientFlags = splitFlags(optarg, clientFlags);
+        }
+        else if(opt == 'j')
+        {
+            jsonPath = optarg;
+        }
+        else
+        {
+            fprintf(stderr, "USAGE: %s [-c clients] [-n requests] [-s sizes] [-D daemonflags] [-C clientflags] [-j jsonfile] encport decport\n", argv[0]);
+            exit(0);
+        }
+    }
+    if(argc - optind < 2)
+    {
+        fprintf(stderr, "USAGE: %s [-c clients] [-n requests] [-s sizes] [-D daemonflags] [-C clientflags] [-j jsonfile] encport decport\n", argv[0]);
+        exit(0);
+    }
+
+    //Sizes like 64K or 1G, in powers of 1024
+    numSizes = 0;
+    for(token=strtok(sizeList, ",");token!=NULL;token=strtok(NULL, ","))
+    {
+        if(numSizes == MAX_SIZES || (sizes[numSizes] = parseSize(token)) < 1)
+        {
+            fprintf(stderr, "%s error: bad size list, at most %d sizes like 1, 64K, 16M or 1G\n", otpProgramName, MAX_SIZES);
+            exit(1);
+        }
+        numSizes++;
+    }
+
+    json = NULL;
+    if(jsonPath != NULL)
+    {
+        json = (strcmp(jsonPath, "-") == 0) ? stdout : fopen(jsonPath, "w");
+        if(json == NULL)
+        {
+            fprintf(stderr, "%s error: failed to open %s for writing\n", otpProgramName, jsonPath);
+            exit(1);
+        }
+    }
+
+    //The other programs live next to this one
+    slash = strrchr(argv[0], '/');
+    snprintf(binDir, sizeof(binDir), "%.*s", slash ? (int)(slash - argv[0]) : 1, slash ? argv[0] : ".");
+    if(mkdtemp(dir) == NULL)
+    {
+        error("making a directory for the inputs", 1);
+    }
+    for(i=0;i<numSizes;i++)
+    {
+        snprintf(textPath, sizeof(textPath), "%s/text%ld", dir, sizes[i]);
+        snprintf(keyPath, sizeof(keyPath), "%s/key%ld", dir, sizes[i]);
+        makeInput(binDir, "keygen", sizes[i], textPath);
+        makeInput(binDir, "keygen", sizes[i], keyPath);
+    }
+
+    //Each daemon leads its own process group so its workers go down with it
+    daemons[0] = startProgram(binDir, "otp_enc_d", daemonFlags, numDaemonFlags, &argv[optind], 1, 1, NULL);
+    daemons[1] = startProgram(binDir, "otp_dec_d", daemonFlags, numDaemonFlags, &argv[optind + 1], 1, 1, NULL);
+    if(waitForDaemon(argv[optind]) < 0 || waitForDaemon(argv[optind + 1]) < 0)
+    {
+        fprintf(stderr, "%s error: daemons did not start listening\n", otpProgramName);
+        kill(-daemons[0], SIGTERM);
+        kill(-daemons[1], SIGTERM);
+        exit(1);
+    }
+
+    if(json != stdout)
+    {
+        printf("%-4s %12s %8s %9s %7s %10s %10s %10s %10s %10s\n", "op", "size", "clients", "requests", "errors", "MB/s", "req/s",
+               "p50 ms", "p99 ms", "p999 ms");
+    }
+    failed = 0;
+    for(op=OTP_OP_ENC;op<=OTP_OP_DEC;op++)
+    {
+        for(i=0;i<numSizes;i++)
+        {
+            //Any text of the alphabet decrypts, the same files serve both operations
+            snprintf(textPath, sizeof(textPath), "%s/text%ld", dir, sizes[i]);
+            snprintf(keyPath, sizeof(keyPath), "%s/key%ld", dir, sizes[i]);
+            runClients(binDir, op, clientFlags, numClientFlags, textPath, keyPath, argv[(op == OTP_OP_ENC) ? optind : optind + 1],
+                       numClients, requests, &result);
+            result.size = sizes[i];
+            if(json != stdout)
+            {
+                printResult(stdout, &result);
+            }
+            if(json != NULL)
+            {
+                printJSON(json, &result);
+            }
+            failed |= (result.errors > 0);
+        }
+    }
+    if(json != NULL && json != stdout)
+    {
+        fclose(json);
+    }
+
+    kill(-daemons[0], SIGTERM);
+    kill(-daemons[1], SIGTERM);
+    waitForExit(daemons[0]);
+    waitForExit(daemons[1]);
+    for(i=0;i<numSizes;i++)
+    {
+        snprintf(textPath, sizeof(textPath), "%s/text%ld", dir, sizes[i]);
+        snprintf(keyPath, sizeof(keyPath), "%s/key%ld", dir, sizes[i]);
+        unlink(textPath);
+        unlink(keyPath);
+    }
+    rmdir(dir);
+    return failed;
+}
+
+/*************************************************
+ * Function: parseSize
+ * Description: Reads a size with an optional K, M or G suffix, each a power of 1024
+ * Params: size string
+ * Returns: size in characters, -1 if it is not a size
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+long parseSize(const char* arg)
+{
+    char* end;
+    long size;
+
+    size = strtol(arg, &end, 10);
+    if(end == arg || size < 0)
+    {
+        return -1;
+    }
+    if(*end == 'K' || *end == 'k')
+    {
+        size *= 1024;
+        end++;
+    }
+    else if(*end == 'M' || *end == 'm')
+    {
+        size *= 1024*1024;
+        end++;
+    }
+    else if(*end == 'G' || *end == 'g')
+    {
+        size *= 1024L*1024*1024;
+        end++;
+    }
+    return (*end == '\0') ? size : -1;
+}
+
+/*************************************************
+ * Function: splitFlags
+ * Description: Splits a flag string given with -D or -C into words, like "-e -t 4"
+ * Params: flag string, it is cut up in place, array with room for MAX_FLAGS words
+ * Returns: number of words
+ * Pre-conditions: none
+ * Post-conditions: exits if there are too many words
+ * **********************************************/
+int splitFlags(char* flags, char** words)
+{
+    int numWords;
+    char* word;
+
+    numWords = 0;
+    for(word=strtok(flags, " ");word!=NULL;word=strtok(NULL, " "))
+    {
+        if(numWords == MAX_FLAGS)
+        {
+            fprintf(stderr, "%s error: at most %d flags\n", otpProgramName, MAX_FLAGS);
+            exit(1);
+        }
+        words[numWords++] = word;
+    }
+    return numWords;
+}
+
+/*************************************************
+ * Function: startProgram
+ * Description: Starts one of the otp programs with flags and then its arguments. Its output goes to a file or is thrown away,
+ * its error output is always thrown away
+ * Params: directory of the programs, program name, flags, number of flags, arguments, number of arguments, nonzero to put it
+ * in a process group of its own, path for its output or NULL
+ * Returns: process id
+ * Pre-conditions: none
+ * Post-conditions: program is running, exits if it could not be forked
+ * **********************************************/
+pid_t startProgram(const char* binDir, const char* name, char** flags, int numFlags, char** args, int numArgs, int group, const char* outPath)
+{
+    char path[4200], *programArgs[MAX_FLAGS + 8];
+    int i, outFD, nullFD;
+    pid_t pid;
+
+    snprintf(path, sizeof(path), "%s/%s", binDir, name);
+    programArgs[0] = path;
+    for(i=0;i<numFlags;i++)
+    {
+        programArgs[1 + i] = flags[i];
+    }
+    for(i=0;i<numArgs;i++)
+    {
+        programArgs[1 + numFlags + i] = args[i];
+    }
+    programArgs[1 + numFlags + numArgs] = NULL;
+
+    pid = fork();
+    if(pid < 0)
+    {
+        error("starting a program", 1);
+    }
+    if(pid == 0)
+    {
+        if(group)
+        {
+            setpgid(0, 0);
+        }
+        nullFD = open("/dev/null", O_WRONLY);
+        outFD = (outPath != NULL) ? open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0600) : nullFD;
+        if(nullFD < 0 || outFD < 0)
+        {
+            _exit(127);
+        }
+        dup2(outFD, 1);
+        dup2(nullFD, 2);
+        execv(path, programArgs);
+        _exit(127);
+    }
+    return pid;
+}
+
+/*************************************************
+ * Function: waitForExit
+ * Description: Waits for a program started with startProgram
+ * Params: process id
+ * Returns: 0 if it exited with status 0, -1 otherwise
+ * Pre-conditions: pid is a child of this process
+ * Post-conditions: child is reaped
+ * **********************************************/
+int waitForExit(pid_t pid)
+{
+    int status;
+
+    while(waitpid(pid, &status, 0) < 0)
+    {
+        if(errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+/*************************************************
+ * Function: makeInput
+ * Description: Makes a plaintext or key of a size with keygen, its characters are the alphabet and it ends with a newline
+ * Params: directory of the programs, name of keygen, number of characters, path to write
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: file is written, exits if keygen failed
+ * **********************************************/
+void makeInput(const char* binDir, const char* keygen, long size, const char* path)
+{
+    char sizeArg[32], *args[1];
+
+    snprintf(sizeArg, sizeof(sizeArg), "%ld", size);
+    args[0] = sizeArg;
+    if(waitForExit(startProgram(binDir, keygen, NULL, 0, args, 1, 0, path)) < 0)
+    {
+        fprintf(stderr, "%s error: %s could not make %s\n", otpProgramName, keygen, path);
+        exit(1);
+    }
+}
+
+/*************************************************
+ * Function: waitForDaemon
+ * Description: Tries to connect to a daemon until it is listening, the test connection is closed right away
+ * Params: port number argument
+ * Returns: 0 once a connection was made, -1 if the daemon did not listen within START_TIMEOUT_MS
+ * Pre-conditions: daemon has been started
+ * Post-conditions: none
+ * **********************************************/
+int waitForDaemon(const char* portArg)
+{
+    struct sockaddr_storage address;
+    struct timespec pause;
+    int socketFD, portNumber, waited;
+    char port[4096];
+
+    //fillAddrStruct takes the argument as given on a command line
+    snprintf(port, sizeof(port), "%s", portArg);
+    fillAddrStruct(&address, &portNumber, port, "localhost");
+    pause.tv_sec = 0;
+    pause.tv_nsec = 10000000;
+    for(waited=0;waited<START_TIMEOUT_MS;waited+=10)
+    {
+        setSocket(&socketFD, &address, 0, 0);
+        if(connect(socketFD, (struct sockaddr*)&address, addrLength(&address)) == 0)
+        {
+            close(socketFD);
+            return 0;
+        }
+        close(socketFD);
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+/*************************************************
+ * Function: runClients
+ * Description: Runs concurrent clients, each a process that runs the client program once per request and times every run.
+ * Latencies go into a shared mapping so the clients need no other way to report them
+ * Params: directory of the programs, operation, client flags, number of flags, plaintext path, key path, port argument,
+ * number of clients, requests per client, address of the result to fill
+ * Returns: none
+ * Pre-conditions: the daemon for the operation is listening
+ * Post-conditions: result holds everything but the size
+ * **********************************************/
+void runClients(const char* binDir, int op, char** flags, int numFlags, const char* textPath, const char* keyPath, const char* portArg,
+                int numClients, long requests, struct benchResult* result)
+{
+    char *args[3];
+    int64_t* latencies;
+    long total, done, i, j;
+    int c;
+    pid_t clients[MAX_CLIENTS];
+    struct timespec started, start;
+
+    total = numClients * requests;
+    latencies = mmap(NULL, total * sizeof(int64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(latencies == MAP_FAILED)
+    {
+        error("mapping latencies", 1);
+    }
+    args[0] = (char*)textPath;
+    args[1] = (char*)keyPath;
+    args[2] = (char*)portArg;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for(c=0;c<numClients;c++)
+    {
+        clients[c] = fork();
+        if(clients[c] < 0)
+        {
+            error("starting a client", 1);
+        }
+        if(clients[c] == 0)
+        {
+            //A failed request is marked with -1
+            for(i=0;i<requests;i++)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                j = waitForExit(startProgram(binDir, (op == OTP_OP_ENC) ? "otp_enc" : "otp_dec", flags, numFlags, args, 3, 0, NULL));
+                latencies[c * requests + i] = (j == 0) ? elapsedNanoseconds(&start) : -1;
+            }
+            _exit(0);
+        }
+    }
+    for(c=0;c<numClients;c++)
+    {
+        waitForExit(clients[c]);
+    }
+
+    result->op = op;
+    result->clients = numClients;
+    result->seconds = elapsedNanoseconds(&started) / 1e9;
+    //Failures are sorted to the end and left out of the percentiles
+    qsort(latencies, total, sizeof(int64_t), compareLatency);
+    for(done=0;done<total && latencies[done]>=0;done++);
+    result->requests = done;
+    result->errors = total - done;
+    result->p50 = percentile(latencies, done, 0.5);
+    result->p99 = percentile(latencies, done, 0.99);
+    result->p999 = percentile(latencies, done, 0.999);
+    munmap(latencies, total * sizeof(int64_t));
+}
+
+/*************************************************
+ * Function: compareLatency
+ * Description: qsort order for latencies, shortest first and failed requests last
+ * Params: addresses of two latencies
+ * Returns: negative, zero or positive like strcmp
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int compareLatency(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+    if(x < 0 || y < 0)
+    {
+        return (x < 0) - (y < 0);
+    }
+    return (x > y) - (x < y);
+}
+
+/*************************************************
+ * Function: percentile
+ * Description: Nearest rank percentile of sorted latencies
+ * Params: sorted latencies, number of them, fraction like 0.99
+ * Returns: the latency, 0 if there are none
+ * Pre-conditions: latencies are sorted shortest first
+ * Post-conditions: none
+ * **********************************************/
+int64_t percentile(int64_t* latencies, long count, double fraction)
+{
+    long rank;
+
+    if(count == 0)
+    {
+        return 0;
+    }
+    rank = (long)(fraction * count + 0.999999);
+    if(rank < 1)
+    {
+        rank = 1;
+    }
+    return latencies[(rank > count ? count : rank) - 1];
+}
+
+/*************************************************
+ * Function: printResult
+ * Description: Prints one line of the results table
+ * Params: stream, result
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+void printResult(FILE* out, struct benchResult* r)
+{
+    fprintf(out, "%-4s %12ld %8d %9ld %7ld %10.2f %10.1f %10.3f %10.3f %10.3f\n", (r->op == OTP_OP_ENC) ? "enc" : "dec", r->size,
+            r->clients, r->requests, r->errors, r->requests * (double)r->size / 1e6 / r->seconds, r->requests / r->seconds,
+            r->p50 / 1e6, r->p99 / 1e6, r->p999 / 1e6);
+    fflush(out);
+}
+
+/*************************************************
+ * Function: printJSON
+ * Description: Writes a result as one JSON object on a line of its own, latencies in microseconds
+ * Params: stream, result
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+void printJSON(FILE* out, struct benchResult* r)
+{
+    fprintf(out, "{\"op\":\"%s\",\"size\":%ld,\"clients\":%d,\"requests\":%ld,\"errors\":%ld,\"seconds\":%.6f,"
+            "\"mb_per_s\":%.3f,\"requests_per_s\":%.3f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+            (r->op == OTP_OP_ENC) ? "enc" : "dec", r->size, r->clients, r->requests, r->errors, r->seconds,
+            r->requests * (double)r->size / 1e6 / r->seconds, r->requests / r->seconds, r->p50 / 1e3, r->p99 / 1e3, r->p999 / 1e3);
+    fflush(out);
+}
+
+/*************************************************
+ * Function: elapsedNanoseconds
+ * Description: Time since a monotonic timestamp
+ * Params: timestamp from CLOCK_MONOTONIC
+ * Returns: nanoseconds
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int64_t elapsedNanoseconds(struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - start->tv_sec) * 1000000000 + (now.tv_nsec - start->tv_nsec);
+}
@@ -0,0 +1,346 @@
+//One time pad cipher kernels, part of libotp
+//The scalar kernel is the reference, the SSE2 and AVX2 kernels do 16 or 32 characters per step and fall back to it for the tail.
+//cipherBuffer picks the widest kernel the CPU supports the first time it is called.
+//cipherBuffer and cipherFile are the in-process API, they run the same transform the daemons do without one.
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "otp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CIPHER_X86 1
+#endif
+
+//Kernel picked on first use
+static void (*cipherKernel)(const char*, const char*, char*, int, int) = NULL;
+
+/*************************************************
+ * Function: cipherBuffer
+ * Description: One time pad encryption or decryption of len characters using the fastest kernel this CPU supports
+ * Params: file message characters, key characters, output buffer, number of characters, CIPHER_ENCRYPT or CIPHER_DECRYPT
+ * Returns: none
+ * Pre-conditions: all three buffers hold at least len characters, input is capital letters or spaces
+ * Post-conditions: output buffer holds len transformed characters, it is not null terminated
+ * **********************************************/
+void cipherBuffer(const char* fileMessage, const char* keyMessage, char* cipherText, int len, int op)
+{
+    void (*kernel)(const char*, const char*, char*, int, int);
+
+    //Pick the widest kernel the first time through. Cipher threads can get here at the same time, each picks the same
+    //kernel so whichever store lands last is fine, the atomics only keep the pointer from being read half written
+    kernel = __atomic_load_n(&cipherKernel, __ATOMIC_ACQUIRE);
+    if(kernel == NULL)
+    {
+        if(cipherHasAVX2())
+        {
+            kernel = cipherAVX2;
+        }
+        else if(cipherHasSSE2())
+        {
+            kernel = cipherSSE2;
+        }
+        else
+        {
+            kernel = cipherScalar;
+        }
+        __atomic_store_n(&cipherKernel, kernel, __ATOMIC_RELEASE);
+    }
+    kernel(fileMessage, keyMessage, cipherText, len, op);
+}
+
+/*************************************************
+ * Function: cipherFile
+ * Description: One time pad encryption or decryption between file descriptors, a chunk of text and key at a time so memory
+ * stays the same however large the files are. Both files are read at their own offsets, their file positions are untouched
+ * Params: text file descriptor, key file descriptor, where the key starts in the key file, output file descriptor,
+ * number of characters, CIPHER_ENCRYPT or CIPHER_DECRYPT
+ * Returns: number of characters written, -1 if a file could not be read, is too short or the output could not be written
+ * Pre-conditions: text and key can be read with pread, text holds only capital letters or spaces in its first len characters
+ * Post-conditions: output has len transformed characters written to it unless -1 was returned
+ * **********************************************/
+long cipherFile(int textFD, int keyFD, off_t keyOffset, int outFD, long len, int op)
+{
+    char text[STREAM_CHUNK], key[STREAM_CHUNK];
+    long offset;
+    int chunk;
+
+    for(offset=0;offset<len;offset+=chunk)
+    {
+        chunk = (len - offset > STREAM_CHUNK) ? STREAM_CHUNK : len - offset;
+        if(readFilePair(textFD, keyFD, offset, keyOffset, chunk, text, key) < 0)
+        {
+            return -1;
+        }
+        //Result goes over the text, it is not needed after this
+        cipherBuffer(text, key, text, chunk, op);
+        if(writeAll(outFD, text, chunk) < 0)
+        {
+            return -1;
+        }
+    }
+    return len;
+}
+
+/*************************************************
+ * Function: readFilePair
+ * Description: Reads one chunk of plaintext and the key characters that go with it, each file at its own offset, used by
+ * cipherFile and by the daemon for files a client passed it
+ * Params: plaintext descriptor, key descriptor, offset of the chunk in the plaintext, where the key starts in the key file,
+ * number of characters, destination for the text, destination for the key
+ * Returns: 0 on success, -1 if either file could not be read or is too short
+ * Pre-conditions: destinations have room for len characters, both files can be read with pread
+ * Post-conditions: text and key are filled, the files' own offsets are untouched
+ * **********************************************/
+int readFilePair(int textFD, int keyFD, off_t offset, off_t keyOffset, int len, char* text, char* key)
+{
+    int i, got, charsRead;
+
+    for(i=0;i<2;i++)
+    {
+        for(got=0;got<len;got+=charsRead)
+        {
+            charsRead = (i == 0) ? pread(textFD, &text[got], len - got, offset + got) : pread(keyFD, &key[got], len - got, keyOffset + offset + got);
+            //A signal cut in before anything was read, try again
+            if(charsRead < 0 && errno == EINTR)
+            {
+                charsRead = 0;
+                continue;
+            }
+            if(charsRead <= 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: cipherScalar
+ * Description: One character at a time kernel, encryption adds the plaintext and key positions in the alphabet mod 27,
+ * decryption subtracts the key position from the ciphertext position mod 27
+ * Params: file message characters, key characters, output buffer, number of characters, CIPHER_ENCRYPT or CIPHER_DECRYPT
+ * Returns: none
+ * Pre-conditions: all three buffers hold at least len characters
+ * Post-conditions: output buffer holds len transformed characters, it is not null terminated
+ * **********************************************/
+void cipherScalar(const char* fileMessage, const char* keyMessage, char* cipherText, int len, int op)
+{
+    int i, num, a, b;
+    //Alphabet for quick access
+    char alphabetASCII[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+    //For each character in the file message
+    for(i=0;i<len;i++)
+    {
+        //Is the character not whitespace
+        if(fileMessage[i] != 32)
+        {
+            //Subtract ASCII for A from filemessage character for position in alphabet
+            a = fileMessage[i]-'A';
+        }
+        //If whitespace
+        else
+        {
+            //Position in alphabet string for whitespace
+            a = 26;
+        }
+        //Is the character not whitespace
+        if(keyMessage[i] != 32)
+        {
+            //Subtract ASCII for A from keyMessage character for position in alphabet
+            b = keyMessage[i]-'A';
+        }
+        //If whitespace
+        else
+        {
+            //Position in alphabet string for whitespace
+            b = 26;
+        }
+
+        //Num for modulus operation
+        num = (op == CIPHER_ENCRYPT) ? a+b : a-b;
+        //Set cipher text at position i equal to the modulus result of num and 27
+        cipherText[i] = alphabetASCII[modulus(num,27)];
+    }
+}
+
+#ifdef CIPHER_X86
+
+/*************************************************
+ * Function: cipherSSE2
+ * Description: 16 characters per step. Maps both inputs to 0-26, adds or subtracts, reduces mod 27 with a compare and
+ * subtract done as an unsigned min, since sum-27 wraps above sum whenever sum is below 27, then maps back to characters
+ * Params: file message characters, key characters, output buffer, number of characters, CIPHER_ENCRYPT or CIPHER_DECRYPT
+ * Returns: none
+ * Pre-conditions: all three buffers hold at least len characters, input is capital letters or spaces, CPU has SSE2
+ * Post-conditions: output buffer holds len transformed characters, same as cipherScalar
+ * **********************************************/
+__attribute__((target("sse2")))
+void cipherSSE2(const char* fileMessage, const char* keyMessage, char* cipherText, int len, int op)
+{
+    int i;
+    __m128i space, letterA, twentySix, twentySeven, a, b, mask;
+
+    space = _mm_set1_epi8(' ');
+    letterA = _mm_set1_epi8('A');
+    twentySix = _mm_set1_epi8(26);
+    twentySeven = _mm_set1_epi8(27);
+
+    for(i=0;i+16<=len;i+=16)
+    {
+        a = _mm_loadu_si128((const __m128i*)&fileMessage[i]);
+        b = _mm_loadu_si128((const __m128i*)&keyMessage[i]);
+
+        //Position in alphabet, letters minus 'A' and whitespace 26
+        mask = _mm_cmpeq_epi8(a, space);
+        a = _mm_or_si128(_mm_andnot_si128(mask, _mm_sub_epi8(a, letterA)), _mm_and_si128(mask, twentySix));
+        mask = _mm_cmpeq_epi8(b, space);
+        b = _mm_or_si128(_mm_andnot_si128(mask, _mm_sub_epi8(b, letterA)), _mm_and_si128(mask, twentySix));
+
+        //Encryption sums to 0-52, decryption adds 27 first so it stays positive at 1-53
+        if(op == CIPHER_ENCRYPT)
+        {
+            a = _mm_add_epi8(a, b);
+        }
+        else
+        {
+            a = _mm_sub_epi8(_mm_add_epi8(a, twentySeven), b);
+        }
+        a = _mm_min_epu8(a, _mm_sub_epi8(a, twentySeven));
+
+        //Back to characters, 26 is whitespace
+        mask = _mm_cmpeq_epi8(a, twentySix);
+        a = _mm_or_si128(_mm_andnot_si128(mask, _mm_add_epi8(a, letterA)), _mm_and_si128(mask, space));
+        _mm_storeu_si128((__m128i*)&cipherText[i], a);
+    }
+
+    //Leftover characters
+    cipherScalar(&fileMessage[i], &keyMessage[i], &cipherText[i], len - i, op);
+}
+
+/*************************************************
+ * Function: cipherAVX2
+ * Description: 32 characters per step, same steps as cipherSSE2
+ * Params: file message characters, key characters, output buffer, number of characters, CIPHER_ENCRYPT or CIPHER_DECRYPT
+ * Returns: none
+ * Pre-conditions: all three buffers hold at least len characters, input is capital letters or spaces, CPU has AVX2
+ * Post-conditions: output buffer holds len transformed characters, same as cipherScalar
+ * **********************************************/
+__attribute__((target("avx2")))
+void cipherAVX2(const char* fileMessage, const char* keyMessage, char* cipherText, int len, int op)
+{
+    int i;
+    __m256i space, letterA, twentySix, twentySeven, a, b, mask;
+
+    space = _mm256_set1_epi8(' ');
+    letterA = _mm256_set1_epi8('A');
+    twentySix = _mm256_set1_epi8(26);
+    twentySeven = _mm256_set1_epi8(27);
+
+    for(i=0;i+32<=len;i+=32)
+    {
+        a = _mm256_loadu_si256((const __m256i*)&fileMessage[i]);
+        b = _mm256_loadu_si256((const __m256i*)&keyMessage[i]);
+
+        //Position in alphabet, letters minus 'A' and whitespace 26
+        mask = _mm256_cmpeq_epi8(a, space);
+        a = _mm256_blendv_epi8(_mm256_sub_epi8(a, letterA), twentySix, mask);
+        mask = _mm256_cmpeq_epi8(b, space);
+        b = _mm256_blendv_epi8(_mm256_sub_epi8(b, letterA), twentySix, mask);
+
+        //Encryption sums to 0-52, decryption adds 27 first so it stays positive at 1-53
+        if(op == CIPHER_ENCRYPT)
+        {
+            a = _mm256_add_epi8(a, b);
+        }
+        else
+        {
+            a = _mm256_sub_epi8(_mm256_add_epi8(a, twentySeven), b);
+        }
+        a = _mm256_min_epu8(a, _mm256_sub_epi8(a, twentySeven));
+
+        //Back to characters, 26 is whitespace
+        mask = _mm256_cmpeq_epi8(a, twentySix);
+        a = _mm256_blendv_epi8(_mm256_add_epi8(a, letterA), space, mask);
+        _mm256_storeu_si256((__m256i*)&cipherText[i], a);
+    }
+
+    //Leftover characters, SSE2 is always there when AVX2 is
+    cipherSSE2(&fileMessage[i], &keyMessage[i], &cipherText[i], len - i, op);
+}
+
+/*************************************************
+ * Function: cipherHasSSE2
+ * Description: Checks if the CPU runs the SSE2 kernel
+ * Params: none
+ * Returns: nonzero if it does
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int cipherHasSSE2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+/*************************************************
+ * Function: cipherHasAVX2
+ * Description: Checks if the CPU runs the AVX2 kernel
+ * Params: none
+ * Returns: nonzero if it does
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int cipherHasAVX2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+//No vector kernels off x86, the scalar kernel stands in so callers and the test still link
+void cipherSSE2(const char* fileMessage, const char* keyMessage, char* cipherText, int len, int op)
+{
+    cipherScalar(fileMessage, keyMessage, cipherText, len, op);
+}
+
+void cipherAVX2(const char* fileMessage, const char* keyMessage, char* cipherText, int len, int op)
+{
+    cipherScalar(fileMessage, keyMessage, cipherText, len, op);
+}
+
+int cipherHasSSE2()
+{
+    return 0;
+}
+
+int cipherHasAVX2()
+{
+    return 0;
+}
+
+#endif
+
+/*************************************************
+ * Function: modulus
+ * Description: Handles negative numbers in the modulus operation that % will not handle
+ * Params: Two integers to be operated on
+ * Returns: integer result
+ * Pre-conditions: none
+ * Post-conditions: returns correct operation result
+ * **********************************************/
+int modulus(int num1, int num2)
+{
+    int result;
+    result = num1 % num2;
+    //If number is negative, add num2 to num1
+    if(result < 0)
+    {
+        result += num2;
+    }
+    return result;
+}
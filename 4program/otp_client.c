@@ -0,0 +1,1545 @@
+//Client side of the one time pad, otp_enc and otp_dec only differ in the operation passed to clientMain
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include "otp.h"
+
+//Most jobs whose chunk pairs are sent interleaved at once, a small job does not wait behind a large one
+#define MAX_ACTIVE_JOBS 8
+//Most jobs started and not answered yet, stays under the requests a daemon keeps open per connection
+#define MAX_OUTSTANDING_JOBS 32
+
+//Part of a request still to go out, either bytes in memory or a range of a file that sendfile passes to the socket
+//without it ever being copied into this process. Bytes in memory may carry descriptors to pass with them
+struct outSegment
+{
+    const char* data;
+    int fd;
+    off_t offset;
+    long left;
+    int numFDs;
+    int fds[2];
+};
+
+//One plaintext and key to send and where the result goes. Batch mode has one per manifest line, opened when it is sent,
+//a single run has one that is already open and goes to stdout
+struct clientJob
+{
+    char *textPath, *keyPath, *outPath;
+    FILE *inputFD, *keyFD, *output;
+    long textLen;
+    off_t keyOffset;
+    //Offset of the next chunk to send and characters left after it, textLeft is -1 when pairs are read into a buffer
+    off_t sent;
+    long textLeft;
+    //Set when the job's files could not be opened or failed their check, it is skipped
+    int failed;
+    //Set once its last result is written
+    int finished;
+};
+
+//Reads the results of every job on a connection, each header's id is the index of the job its payload goes to
+struct resultParser
+{
+    unsigned char headerBuffer[OTP_HEADER_SIZE];
+    int headerLen;
+    uint32_t payloadLeft;
+    //Header of the message being read, valid once headerLen is OTP_HEADER_SIZE
+    struct otpHeader header;
+    //Jobs that are finished or failed
+    int numDone;
+};
+
+//Characters allowed in a plaintext, capital letters, space and newline
+static const char plainChars[256] = { ['A' ... 'Z'] = 1, [' '] = 1, ['\n'] = 1 };
+
+//Operation this client asks for, OTP_OP_ENC or OTP_OP_DEC
+static int clientOp;
+//Set once sendfile turns out not to work on these files, pread and send are used from then on
+static int noSendfile = 0;
+//Set when the daemon is reached over a Unix domain socket, jobs with regular files then pass their descriptors instead
+static int passFiles = 0;
+//Set by -m, requests go through a shared memory ring instead of the socket
+static int useRing = 0;
+//Set by --local, the transform runs in this process and no daemon is needed
+static int localMode = 0;
+//Where the key starts in the key file, from -o or claimed from the offset file given with -O
+static off_t keyOffset = 0;
+static const char* offsetPath = NULL;
+
+//Prototypes
+int connectServer(struct sockaddr_storage*, int*);
+void connectLegacy(struct sockaddr_storage*, int*);
+void sendMessage(int*, FILE**, off_t, long);
+void getMessage(int*);
+void streamRequest(int*, struct clientJob*, int);
+void ringRequest(int*, struct clientJob*, int);
+void localRequest(struct clientJob*, int);
+void sendRequests(int*, struct clientJob*, int);
+int runBatch(char*, char*);
+struct clientJob* readManifest(char*, int*);
+int openJob(struct clientJob*);
+int fillChunk(char*, FILE**, FILE**, uint32_t);
+int planChunk(struct outSegment*, char*, int, int, off_t, off_t, long, uint32_t);
+int planFiles(struct outSegment*, char*, struct clientJob*, uint32_t);
+int sendSegments(int, struct outSegment*, int*, int);
+int isRegularFile(int);
+int validText(const char*, long);
+long fileSize(FILE**);
+void readResults(char*, int, struct resultParser*, struct clientJob*, int);
+int openFiles(FILE**, FILE**, char*[]);
+void closeFiles(FILE**, FILE**);
+long checkFiles(FILE**, FILE**, char*[]);
+off_t reserveKey(const char*, off_t, long);
+
+/*************************************************
+ * Function: clientMain
+ * Description: Runs otp_enc or otp_dec, checks the plaintext and key then has the daemon transform them and prints the result.
+ * With -b every plaintext, key and output in a manifest goes over one connection instead, with -m a daemon on a Unix domain
+ * socket gets them through a shared memory ring. With --local there is no daemon, the transform runs in this process
+ * Params: argc and argv of the front-end, OTP_OP_ENC or OTP_OP_DEC
+ * Returns: exit status
+ * Pre-conditions: otpProgramName is set
+ * Post-conditions: result is on stdout or in the manifest's output files, exits with an error message otherwise
+ * **********************************************/
+int clientMain(int argc, char* argv[], int op)
+{
+    //Initialize necessary variables
+    int socketFD, portNumber, protocol, opt;
+    long textLen;
+    char *end, *batchPath;
+    struct sockaddr_storage serverAddress;
+    struct clientJob job;
+    FILE *inputFD, *keyFD;
+    static const struct option longOptions[] = { {"local", no_argument, NULL, 'l'}, {NULL, 0, NULL, 0} };
+
+    clientOp = op;
+
+    //Check options, -o starts the key at a byte offset, -O claims the next slice of the key from an offset file,
+    //-b runs a manifest in batch mode, -m uses shared memory, --local skips the daemon and needs no port
+    batchPath = NULL;
+    while((opt = getopt_long(argc, argv, "o:O:b:m", longOptions, NULL)) != -1)
+    {
+        if(opt == 'o')
+        {
+            keyOffset = strtoll(optarg, &end, 10);
+            if(*optarg == '\0' || *end != '\0' || keyOffset < 0)
+            {
+                fprintf(stderr, "%s error: bad key offset %s\n", otpProgramName, optarg);
+                exit(1);
+            }
+        }
+        else if(opt == 'O')
+        {
+            offsetPath = optarg;
+        }
+        else if(opt == 'b')
+        {
+            batchPath = optarg;
+        }
+        else if(opt == 'm')
+        {
+            useRing = 1;
+        }
+        else if(opt == 'l')
+        {
+            localMode = 1;
+        }
+        else
+        {
+            fprintf(stderr, "USAGE: %s [-m | --local] [-o offset | -O offsetfile] plaintext key port\n", argv[0]);
+            fprintf(stderr, "       %s [-m | --local] [-O offsetfile] -b manifest port\n", argv[0]);
+            exit(0);
+        }
+    }
+    //The file arguments keep their usual places
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    if(batchPath != NULL)
+    {
+        //Every job would start at the same offset, only an offset file makes sense here
+        if((argc < 2 && !localMode) || keyOffset > 0)
+        {
+            fprintf(stderr, "USAGE: %s [-m | --local] [-O offsetfile] -b manifest port\n", argv[0]);
+            exit(0);
+        }
+        return runBatch(batchPath, argv[1]);
+    }
+
+    //Check usage
+    if(argc < (localMode ? 3 : 4))
+    {
+        fprintf(stderr, "USAGE: %s [-m | --local] [-o offset | -O offsetfile] plaintext key port\n", argv[0]);
+        exit(0);
+    }
+    else
+    {
+        //Open plaintext and key file, they stay open from the check to the send
+        if(openFiles(&inputFD, &keyFD, argv) < 0)
+        {
+            exit(1);
+        }
+        //Check validity and get the length of the plaintext line
+        textLen = checkFiles(&inputFD, &keyFD, argv);
+        if(textLen < 0)
+        {
+            exit(1);
+        }
+
+        memset(&job, '\0', sizeof(job));
+        job.inputFD = inputFD;
+        job.keyFD = keyFD;
+        job.textLen = textLen;
+        job.keyOffset = keyOffset;
+        job.output = stdout;
+        if(localMode)
+        {
+            localRequest(&job, 1);
+            closeFiles(&inputFD, &keyFD);
+            return 0;
+        }
+
+        //Set up the server address struct
+        fillAddrStruct(&serverAddress, &portNumber, argv[3], "localhost");
+
+        //Set up socket
+        setSocket(&socketFD, &serverAddress, 0, 0);
+
+        //Connect to server, this settles which protocol it speaks
+        protocol = connectServer(&serverAddress, &socketFD);
+
+        if(protocol == OTP_VERSION)
+        {
+            //Stream chunk pairs out and results back at the same time
+            sendRequests(&socketFD, &job, 1);
+        }
+        else if(useRing)
+        {
+            close(socketFD);
+            fprintf(stderr, "%s error: shared memory needs a daemon that speaks the binary protocol\n", otpProgramName);
+            exit(1);
+        }
+        else
+        {
+            sendMessage(&socketFD, &inputFD, 0, textLen); //Send the plaintext file
+            sendMessage(&socketFD, &keyFD, keyOffset, textLen); //Send as much of the key file as the daemon uses
+
+            //Get message from the server
+            getMessage(&socketFD);
+        }
+
+        //Close socket
+        closeFiles(&inputFD, &keyFD);
+        close(socketFD);
+
+    }
+
+    return 0;
+}
+
+/*************************************************
+ * Function: connectServer
+ * Description: Establishes a connection to a server (otp_enc_d or otp_dec_d) and offers the binary protocol with a hello. A daemon that
+ * answers with a hello speaks it, one that answers with a legacy identifier bit gets a new connection and the old handshake.
+ * Params: address of serverAddress struct, address of socket file descriptor
+ * Returns: protocol to use, OTP_VERSION or 1 for the legacy protocol
+ * Pre-conditions: server address and socket file descriptor are correctly filled
+ * Post-conditions: Client either establishes connection with server or terminates connection due to the wrong daemon answering
+ * **********************************************/
+int connectServer(struct sockaddr_storage* serverAddress, int* socketFD)
+{
+    int charsRead;
+    unsigned char buffer[OTP_HEADER_SIZE];
+    struct otpHeader header;
+
+    //Establish connection, exit with status 2 if there was an error connecting
+    if(connect(*socketFD, (struct sockaddr*)serverAddress, addrLength(serverAddress)) < 0)
+    {
+        error("connecting", 2);
+    }
+    //Send a hello that says which operation we want
+    if(sendHeader(*socketFD, OTP_MSG_HELLO, clientOp, 0, 0) < 0)
+    {
+        close(*socketFD);
+        error("sending hello", 1);
+    }
+    //Recieve the first byte of the answer, it tells the protocols apart
+    charsRead = recv(*socketFD, buffer, 1, 0);
+    if(charsRead < 0)
+    {
+        close(*socketFD);
+        error("recieving hello", 1);
+    }
+    else if(charsRead == 0)
+    {
+        close(*socketFD);
+        error("charsRead 0 when recieving hello", 1);
+    }
+
+    //Daemon answered with a hello of its own
+    if(buffer[0] == OTP_MAGIC)
+    {
+        if(recvAll(*socketFD, (char*)&buffer[1], OTP_HEADER_SIZE - 1) < 0 || decodeHeader(buffer, &header) < 0 || header.type != OTP_MSG_HELLO)
+        {
+            close(*socketFD);
+            fprintf(stderr, "%s error: bad hello from server\n", otpProgramName);
+            exit(1);
+        }
+        //Check if the daemon does our operation, if not state invalid connection attempt and exit with code 1
+        if(header.flags != clientOp)
+        {
+            close(*socketFD);
+            fprintf(stderr, "%s error: %s tried to connect to %s\n", otpProgramName, otpProgramName, daemonName(otherOp(clientOp)));
+            exit(1);
+        }
+        passFiles = (serverAddress->ss_family == AF_UNIX);
+        return OTP_VERSION;
+    }
+
+    //Legacy daemon answered with its identifier bit
+    if(buffer[0] == legacyIdentifier(otherOp(clientOp)))
+    {
+        close(*socketFD);
+        fprintf(stderr, "%s error: %s tried to connect to %s\n", otpProgramName, otpProgramName, daemonName(otherOp(clientOp)));
+        exit(1);
+    }
+    //It took the hello for a bad identifier bit, start over with the legacy handshake
+    close(*socketFD);
+    setSocket(socketFD, serverAddress, 0, 0);
+    connectLegacy(serverAddress, socketFD);
+    return 1;
+}
+
+/*************************************************
+ * Function: connectLegacy
+ * Description: Establishes a connection to a daemon that only knows the legacy protocol and checks if the connection is allowed
+ * via indentification bits communicated between this client and that server.
+ * Params: address of serverAddress struct, address of socket file descriptor
+ * Returns: none
+ * Pre-conditions: server address and socket file descriptor are correctly filled
+ * Post-conditions: Client either establishes connection with server or terminates connection due to invalid identification bits recieved
+ * **********************************************/
+void connectLegacy(struct sockaddr_storage* serverAddress, int* socketFD)
+{
+    int charsWritten, charsRead;
+    char buffer[1], identifier;
+
+    //Establish connection, exit with status 2 if there was an error connecting
+    if(connect(*socketFD, (struct sockaddr*)serverAddress, addrLength(serverAddress)) < 0)
+    {
+        error("connecting", 2);
+    }
+    //Send our indicator bit, 0 says I am encryption and 1 says I am decryption
+    identifier = legacyIdentifier(clientOp);
+    charsWritten = send(*socketFD, &identifier, 1, 0);
+    if(charsWritten < 0)
+    {
+        close(*socketFD);
+        error("sending identifier bit", 1);
+    }
+    else if(charsWritten == 0)
+    {
+        close(*socketFD);
+        error("charsWritten 0 when sending identifier bit", 1);
+    }
+    //Recieve identifier bit from server
+    charsRead = recv(*socketFD, buffer, sizeof(buffer), 0);
+    if(charsRead < 0)
+    {
+        close(*socketFD);
+        error("recieving identifier bit", 1);
+    }
+    else if(charsRead == 0)
+    {
+        close(*socketFD);
+        error("charsRead 0 when recieving identifier bit", 1);
+    }
+
+    //Check if identifier bit recieved is valid or not
+    //If invalid then state invalid connection attempt and exit with code 1
+    if(buffer[0] == legacyIdentifier(otherOp(clientOp)))
+    {
+        close(*socketFD);
+        fprintf(stderr, "%s error: %s tried to connect to %s\n", otpProgramName, otpProgramName, daemonName(otherOp(clientOp)));
+        exit(1);
+    }
+
+}
+
+/*************************************************
+ * Function: sendMessage 
+ * Description: sends content of file given via the socket to the server and adds a control character to the stream of info so the server knows when to stop recieving.
+ * A regular file goes straight from the page cache to the socket with sendfile, anything else is read in and sent with a loop that finishes partial writes
+ * Params: address of socket file descriptor, address of the pointer of the file descriptor for the file given by the user,
+ * where a regular file starts, characters to send from a regular file, the plaintext line length checkFiles found
+ * Returns: none
+ * Pre-conditions: socket file descriptor is valid and the input file descriptor is open for reading where it starts, a regular file has at least start + len characters
+ * Post-conditions: Contents of file are sent or program exits with error message
+ * **********************************************/
+void sendMessage(int* socketFD, FILE** inputFD, off_t start, long len)
+{
+    int pos, current;
+    char* fileContent = NULL;
+    size_t sizeFile;
+    struct outSegment segments[2];
+
+    memset(segments, '\0', sizeof(segments));
+    if(isRegularFile(fileno(*inputFD)))
+    {
+        //The line from the file, then the control character
+        segments[0].data = NULL;
+        segments[0].fd = fileno(*inputFD);
+        segments[0].offset = start;
+        segments[0].left = len;
+        segments[1].data = "0";
+        segments[1].left = 1;
+        current = 0;
+        if(sendSegments(*socketFD, segments, &current, 2) < 0 || current < 2)
+        {
+            error("writing to socket", 1);
+        }
+        return;
+    }
+
+    //Get contents of file and store in file content buffer
+    if(getline(&fileContent, &sizeFile, *inputFD) < 0)
+    {
+        error("reading input", 1);
+    }
+
+    //Remove newline at end of file content and replace it with a control character and null terminator
+    pos = strcspn(fileContent, "\n");
+    strcpy(&fileContent[pos], "0\0");
+
+    //Send file contents, sendAll picks up after partial writes
+    if(sendAll(*socketFD, fileContent, strlen(fileContent)) < 0)
+    {
+        error("writing to socket", 1);
+    }
+    free(fileContent);
+}
+
+/*************************************************
+ * Function: getMessage
+ * Description: Recieves encrypted text from the server and outputs it to stdout
+ * Params: address of socket file descriptor
+ * Returns: none
+ * Pre-conditions: socket file descriptor is open and correct
+ * Post-conditions: message has been fully recieved and sent to stdout
+ * **********************************************/
+void getMessage(int *socketFD)
+{
+    //Buffer grows as the message arrives
+    char* fileMessage = NULL;
+    int fileLen, fileSize = 0;
+    struct recvBuffer rb;
+
+    rb.fd = *socketFD;
+    rb.start = 0;
+    rb.end = 0;
+
+    //Receive until the control character '0' in as few recv calls as possible
+    fileLen = recvUntil(&rb, &fileMessage, &fileSize, '0');
+    if(fileLen < 0)
+    {
+        error("reading from socket", 1);
+    }
+
+    //Replace the 0 character with a newline
+    fileMessage[fileLen] = '\n';
+    fwrite(fileMessage, 1, fileLen + 1, stdout);
+    free(fileMessage);
+}
+
+/*************************************************
+ * Function: sendRequests
+ * Description: Sends the jobs over the socket with streamRequest, or through a shared memory ring with ringRequest when -m
+ * asked for one
+ * Params: address of socket file descriptor, array of jobs, number of jobs
+ * Returns: none
+ * Pre-conditions: hello has been exchanged
+ * Post-conditions: every job that was not skipped has its result written, exits with an error message if -m was given
+ * and the daemon is not on a Unix domain socket
+ * **********************************************/
+void sendRequests(int* socketFD, struct clientJob* jobs, int numJobs)
+{
+    if(!useRing)
+    {
+        streamRequest(socketFD, jobs, numJobs);
+        return;
+    }
+    //The ring's descriptor can only be passed over a Unix domain socket
+    if(!passFiles)
+    {
+        close(*socketFD);
+        fprintf(stderr, "%s error: shared memory needs a daemon on a Unix domain socket\n", otpProgramName);
+        exit(1);
+    }
+    ringRequest(socketFD, jobs, numJobs);
+}
+
+/*************************************************
+ * Function: streamRequest
+ * Description: Binary protocol requests, sends the file content and the key of each job as a stream of chunk pairs while writing
+ * results out as they come back. Sending and receiving are interleaved with poll so neither side blocks on a full socket, and memory
+ * stays at one chunk however large the files are. When both files are regular files the text and key of each pair go out with
+ * sendfile and only the headers pass through this process, otherwise the pair is read into a buffer first. Over a Unix domain
+ * socket such a job is one files message that passes the descriptors, the daemon reads the files itself. Up to
+ * MAX_ACTIVE_JOBS jobs are sent at once, one pair of each in turn, tagged with the job's index as the request id. Results are
+ * matched to their job by that id, whatever order the daemon finishes them in
+ * Params: address of socket file descriptor, array of jobs, number of jobs
+ * Returns: none, jobs that could not be opened or failed their check are marked failed and skipped
+ * Pre-conditions: hello has been exchanged, jobs that are already open have been checked, with the plaintext at its start and
+ * the key at the job's key offset
+ * Post-conditions: every result has been written followed by a newline, or program exits with error message
+ * **********************************************/
+void streamRequest(int* socketFD, struct clientJob* jobs, int numJobs)
+{
+    char *out, in[RECV_CHUNK];
+    int numSegments, current, charsRead, sendJob, sentLast, noDelay, active[MAX_ACTIVE_JOBS], numActive, nextJob, turn;
+    struct pollfd pfd;
+    struct outSegment segments[4];
+    struct resultParser parser;
+    struct clientJob* job;
+
+    //Room for one chunk pair with its headers
+    out = malloc(2*OTP_HEADER_SIZE + 2*STREAM_CHUNK);
+    if(out == NULL)
+    {
+        fprintf(stderr, "%s error: out of memory\n", otpProgramName);
+        exit(1);
+    }
+    memset(&parser, '\0', sizeof(parser));
+    memset(segments, '\0', sizeof(segments));
+    numSegments = 0;
+    current = 0;
+    sendJob = -1;
+    sentLast = 0;
+    numActive = 0;
+    nextJob = 0;
+    turn = 0;
+
+    //sendfile blocks on a blocking socket, poll says when there is room
+    setNonBlocking(*socketFD);
+    //A batch keeps the socket busy, Nagle packs its jobs into full packets and replies come back in fewer wakeups.
+    //Turned off again once the last job is queued so its tail is not held back
+    noDelay = (numJobs == 1);
+    setsockopt(*socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    pfd.fd = *socketFD;
+    while(parser.numDone < numJobs)
+    {
+        //Pair is out, a job whose last pair it was closes its files right away and leaves room for the next one
+        if(current == numSegments && sendJob >= 0)
+        {
+            if(sentLast)
+            {
+                if(jobs[sendJob].textPath != NULL)
+                {
+                    closeFiles(&jobs[sendJob].inputFD, &jobs[sendJob].keyFD);
+                }
+                //The last active job takes its place and its turn
+                active[turn] = active[--numActive];
+            }
+            else
+            {
+                turn++;
+            }
+            sendJob = -1;
+        }
+
+        //Keep the window full
+        while(numActive < MAX_ACTIVE_JOBS && nextJob < numJobs && nextJob - parser.numDone < MAX_OUTSTANDING_JOBS)
+        {
+            job = &jobs[nextJob];
+            if(job->inputFD == NULL && openJob(job) < 0)
+            {
+                //The check printed why, go on with the next job
+                job->failed = 1;
+                parser.numDone++;
+            }
+            else
+            {
+                //Zero copy needs both files to be regular files, checkFiles made sure the key covers the line
+                job->textLeft = (isRegularFile(fileno(job->inputFD)) && isRegularFile(fileno(job->keyFD))) ? job->textLen : -1;
+                job->sent = 0;
+                active[numActive++] = nextJob;
+            }
+            nextJob++;
+        }
+        if(!noDelay && numActive == 0 && current == numSegments)
+        {
+            noDelay = 1;
+            setsockopt(*socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        }
+        //Every job failed its check
+        if(parser.numDone == numJobs)
+        {
+            break;
+        }
+
+        //Previous pair is out, queue the next pair of the job whose turn it is
+        if(current == numSegments && numActive > 0)
+        {
+            turn %= numActive;
+            sendJob = active[turn];
+            job = &jobs[sendJob];
+            if(job->textLeft >= 0 && passFiles)
+            {
+                numSegments = planFiles(segments, out, job, sendJob);
+            }
+            else if(job->textLeft >= 0)
+            {
+                numSegments = planChunk(segments, out, fileno(job->inputFD), fileno(job->keyFD), job->sent, job->keyOffset, job->textLeft, sendJob);
+                job->sent += segments[1].left;
+                job->textLeft -= segments[1].left;
+            }
+            else
+            {
+                segments[0].data = out;
+                segments[0].left = fillChunk(out, &job->inputFD, &job->keyFD, sendJob);
+                segments[0].numFDs = 0;
+                numSegments = 1;
+            }
+            current = 0;
+            //Byte 3 is the flags of the text header
+            sentLast = !(out[3] & OTP_FLAG_MORE);
+        }
+
+        pfd.events = POLLIN;
+        if(current < numSegments)
+        {
+            pfd.events |= POLLOUT;
+        }
+        if(poll(&pfd, 1, -1) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            error("waiting on socket", 1);
+        }
+
+        if(pfd.revents & POLLOUT)
+        {
+            if(sendSegments(*socketFD, segments, &current, numSegments) < 0)
+            {
+                error("writing to socket", 1);
+            }
+        }
+
+        if(pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            charsRead = recv(*socketFD, in, sizeof(in), MSG_DONTWAIT);
+            if(charsRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                error("reading from socket", 1);
+            }
+            if(charsRead == 0)
+            {
+                fprintf(stderr, "%s error: server closed the connection early\n", otpProgramName);
+                exit(1);
+            }
+            if(charsRead > 0)
+            {
+                readResults(in, charsRead, &parser, jobs, numJobs);
+            }
+        }
+    }
+
+    free(out);
+}
+
+/*************************************************
+ * Function: ringRequest
+ * Description: Shared memory version of streamRequest, creates a ring, passes it to the daemon and from then on fills its
+ * slots with chunk pairs and takes the results out of them, without touching the socket. One job is filled at a time, the
+ * ring keeps up to RING_SLOTS pairs with the daemon so it never has to wait for us while there is work. The result of the
+ * oldest slot is taken as soon as it is done, so output is written while later pairs are still being transformed
+ * Params: address of socket file descriptor, array of jobs, number of jobs
+ * Returns: none, jobs that could not be opened or failed their check are marked failed and skipped
+ * Pre-conditions: hello has been exchanged over a Unix domain socket, jobs that are already open have been checked, with the
+ * plaintext at its start and the key at the job's key offset
+ * Post-conditions: every result has been written followed by a newline and the ring is closed, or program exits with error message
+ * **********************************************/
+void ringRequest(int* socketFD, struct clientJob* jobs, int numJobs)
+{
+    char header[OTP_HEADER_SIZE], problem[256];
+    int ringFD, sendJob, nextJob, state;
+    unsigned long filled, taken;
+    struct otpRing* ring;
+    struct ringSlot* slot;
+    struct otpHeader reply;
+    struct resultParser parser;
+    struct clientJob* job;
+
+    ring = ringCreate(&ringFD);
+    if(ring == NULL)
+    {
+        error("creating shared memory ring", 1);
+    }
+    encodeHeader((unsigned char*)header, OTP_MSG_RING, 0, 0, 0);
+    if(sendFDs(*socketFD, header, OTP_HEADER_SIZE, &ringFD, 1) != OTP_HEADER_SIZE)
+    {
+        error("writing to socket", 1);
+    }
+    //The daemon has its own reference now
+    close(ringFD);
+
+    //Wait for the daemon to map it, or to say why not
+    if(recvHeader(*socketFD, &reply) < 0)
+    {
+        fprintf(stderr, "%s error: server closed the connection early\n", otpProgramName);
+        exit(1);
+    }
+    if(reply.type == OTP_MSG_ERROR && reply.length < sizeof(problem) && recvAll(*socketFD, problem, reply.length) == 0)
+    {
+        fprintf(stderr, "%s error: server: %.*s\n", otpProgramName, (int)reply.length, problem);
+        exit(1);
+    }
+    if(reply.type != OTP_MSG_RING)
+    {
+        fprintf(stderr, "%s error: unexpected reply from server\n", otpProgramName);
+        exit(1);
+    }
+
+    memset(&parser, '\0', sizeof(parser));
+    filled = 0;
+    taken = 0;
+    sendJob = -1;
+    nextJob = 0;
+    while(parser.numDone < numJobs)
+    {
+        //Take the oldest result if it is done, without waiting
+        slot = &ring->slot[taken % RING_SLOTS];
+        if(taken < filled && __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == RING_DONE)
+        {
+            decodeHeader((unsigned char*)slot->data, &reply);
+            if(reply.length > STREAM_CHUNK)
+            {
+                fprintf(stderr, "%s error: unexpected reply from server\n", otpProgramName);
+                exit(1);
+            }
+            readResults(slot->data, OTP_HEADER_SIZE + reply.length, &parser, jobs, numJobs);
+            ringPost(&slot->state, RING_FREE, &ring->daemonWaiting);
+            taken++;
+            continue;
+        }
+
+        //Start the next job once the last one is all in the ring
+        if(sendJob < 0 && nextJob < numJobs && filled - taken < RING_SLOTS)
+        {
+            job = &jobs[nextJob];
+            if(job->inputFD == NULL && openJob(job) < 0)
+            {
+                //The check printed why, go on with the next job
+                job->failed = 1;
+                parser.numDone++;
+            }
+            else
+            {
+                sendJob = nextJob;
+            }
+            nextJob++;
+            continue;
+        }
+
+        //Fill the next slot, it is free once its last result has been taken
+        if(sendJob >= 0 && filled - taken < RING_SLOTS)
+        {
+            slot = &ring->slot[filled % RING_SLOTS];
+            job = &jobs[sendJob];
+            fillChunk(slot->data, &job->inputFD, &job->keyFD, sendJob);
+            //Byte 3 is the flags of the text header
+            if(!(slot->data[3] & OTP_FLAG_MORE))
+            {
+                if(job->textPath != NULL)
+                {
+                    closeFiles(&job->inputFD, &job->keyFD);
+                }
+                sendJob = -1;
+            }
+            ringPost(&slot->state, RING_FILLED, &ring->daemonWaiting);
+            filled++;
+            continue;
+        }
+
+        //Every job failed its check
+        if(taken == filled)
+        {
+            break;
+        }
+        //Nothing to fill, wait for the oldest result
+        state = ringWait(&slot->state, RING_FILLED, &ring->clientWaiting, *socketFD);
+        if(state < 0)
+        {
+            fprintf(stderr, "%s error: server closed the connection early\n", otpProgramName);
+            exit(1);
+        }
+    }
+
+    //Every slot is free again, the daemon looks at the next one
+    ringPost(&ring->slot[filled % RING_SLOTS].state, RING_CLOSED, &ring->daemonWaiting);
+    ringUnmap(ring);
+}
+
+/*************************************************
+ * Function: localRequest
+ * Description: Runs the jobs in this process with cipherFile instead of sending them to a daemon, the same checks and the same
+ * output as sending them. The result goes straight to the output's descriptor a chunk at a time
+ * Params: array of jobs, number of jobs
+ * Returns: none, jobs that could not be opened or failed their check are marked failed and skipped
+ * Pre-conditions: jobs that are already open have been checked, nothing has been written to their output yet
+ * Post-conditions: every job that was not skipped has its result written followed by a newline, or program exits with error message
+ * **********************************************/
+void localRequest(struct clientJob* jobs, int numJobs)
+{
+    struct clientJob* job;
+    int i;
+
+    for(i=0;i<numJobs;i++)
+    {
+        job = &jobs[i];
+        if(job->inputFD == NULL && openJob(job) < 0)
+        {
+            //The check printed why, go on with the next job
+            job->failed = 1;
+            continue;
+        }
+        if(job->output == NULL)
+        {
+            job->output = fopen(job->outPath, "w");
+            if(job->output == NULL)
+            {
+                fprintf(stderr, "%s error: failed to open %s for writing\n", otpProgramName, job->outPath);
+                exit(1);
+            }
+        }
+
+        //Nothing went through the output's stdio buffer, so writing to its descriptor keeps everything in order
+        if(cipherFile(fileno(job->inputFD), fileno(job->keyFD), job->keyOffset, fileno(job->output), job->textLen, clientOp) < 0 ||
+           writeAll(fileno(job->output), "\n", 1) < 0)
+        {
+            fprintf(stderr, "%s error: could not read the plaintext and key or write the result\n", otpProgramName);
+            exit(1);
+        }
+        if(job->textPath != NULL)
+        {
+            closeFiles(&job->inputFD, &job->keyFD);
+            if(fclose(job->output) != 0)
+            {
+                fprintf(stderr, "%s error: writing %s\n", otpProgramName, job->outPath);
+                exit(1);
+            }
+        }
+        job->finished = 1;
+    }
+}
+
+/*************************************************
+ * Function: runBatch
+ * Description: Batch mode, sends every job in a manifest over one connection with one handshake. Jobs are pipelined, each is
+ * opened, checked and sent while the results of earlier ones are still coming back. A job with a missing file, bad plaintext
+ * or short key gets the same error a single run gives and is skipped, the rest of the batch goes on. With --local the jobs
+ * run in this process one after another and no connection is made
+ * Params: path of the manifest, port number argument, unused with --local
+ * Returns: exit status, 1 if any job was skipped
+ * Pre-conditions: otpProgramName and clientOp are set
+ * Post-conditions: every job that was not skipped has its result in its output file
+ * **********************************************/
+int runBatch(char* manifestPath, char* portArg)
+{
+    int socketFD, portNumber, numJobs, numFailed, i;
+    struct sockaddr_storage serverAddress;
+    struct clientJob* jobs;
+
+    jobs = readManifest(manifestPath, &numJobs);
+
+    if(localMode)
+    {
+        localRequest(jobs, numJobs);
+    }
+    else
+    {
+        fillAddrStruct(&serverAddress, &portNumber, portArg, "localhost");
+        setSocket(&socketFD, &serverAddress, 0, 0);
+        //The legacy protocol ends every message by closing the connection
+        if(connectServer(&serverAddress, &socketFD) != OTP_VERSION)
+        {
+            close(socketFD);
+            fprintf(stderr, "%s error: batch mode needs a daemon that speaks the binary protocol\n", otpProgramName);
+            exit(1);
+        }
+
+        if(numJobs > 0)
+        {
+            sendRequests(&socketFD, jobs, numJobs);
+        }
+        close(socketFD);
+    }
+
+    numFailed = 0;
+    for(i=0;i<numJobs;i++)
+    {
+        numFailed += jobs[i].failed;
+        free(jobs[i].textPath);
+    }
+    free(jobs);
+    return (numFailed > 0) ? 1 : 0;
+}
+
+/*************************************************
+ * Function: readManifest
+ * Description: Reads a batch manifest, one job per line as plaintext, key and output paths separated by white space.
+ * Blank lines and lines starting with # are skipped
+ * Params: path of the manifest, address to store the number of jobs
+ * Returns: array of jobs with no files opened yet, the three paths of a job share one allocation starting at textPath
+ * Pre-conditions: none
+ * Post-conditions: exits with an error message if the manifest can not be read or a line is incomplete
+ * **********************************************/
+struct clientJob* readManifest(char* path, int* numJobs)
+{
+    FILE* manifest;
+    char *line = NULL, *fields[3];
+    size_t lineSize = 0;
+    int lineNum, numFields, size;
+    struct clientJob *jobs = NULL, *newJobs;
+
+    manifest = fopen(path, "r");
+    if(manifest == NULL)
+    {
+        fprintf(stderr, "%s error: failed to open %s for reading\n", otpProgramName, path);
+        exit(1);
+    }
+
+    *numJobs = 0;
+    size = 0;
+    for(lineNum=1;getline(&line, &lineSize, manifest) >= 0;lineNum++)
+    {
+        numFields = 0;
+        fields[0] = strtok(line, " \t\r\n");
+        while(fields[numFields] != NULL && ++numFields < 3)
+        {
+            fields[numFields] = strtok(NULL, " \t\r\n");
+        }
+        if(numFields == 0 || fields[0][0] == '#')
+        {
+            continue;
+        }
+        if(numFields < 3 || strtok(NULL, " \t\r\n") != NULL)
+        {
+            fprintf(stderr, "%s error: %s line %d should be plaintext key output\n", otpProgramName, path, lineNum);
+            exit(1);
+        }
+
+        if(*numJobs == size)
+        {
+            size = size ? 2*size : 64;
+            newJobs = realloc(jobs, size * sizeof(struct clientJob));
+            if(newJobs == NULL)
+            {
+                fprintf(stderr, "%s error: out of memory\n", otpProgramName);
+                exit(1);
+            }
+            jobs = newJobs;
+        }
+        memset(&jobs[*numJobs], '\0', sizeof(struct clientJob));
+        //strtok ended each field with a null, copy them together
+        jobs[*numJobs].textPath = malloc(fields[2] + strlen(fields[2]) + 1 - fields[0]);
+        if(jobs[*numJobs].textPath == NULL)
+        {
+            fprintf(stderr, "%s error: out of memory\n", otpProgramName);
+            exit(1);
+        }
+        memcpy(jobs[*numJobs].textPath, fields[0], fields[2] + strlen(fields[2]) + 1 - fields[0]);
+        jobs[*numJobs].keyPath = jobs[*numJobs].textPath + (fields[1] - fields[0]);
+        jobs[*numJobs].outPath = jobs[*numJobs].textPath + (fields[2] - fields[0]);
+        (*numJobs)++;
+    }
+
+    free(line);
+    fclose(manifest);
+    return jobs;
+}
+
+/*************************************************
+ * Function: openJob
+ * Description: Opens and checks the plaintext and key of a batch job, the same way a single run does. An offset file given
+ * with -O hands each job its own slice of the key
+ * Params: address of job
+ * Returns: 0 on success, -1 if a file could not be opened or failed its check
+ * Pre-conditions: job's paths are set
+ * Post-conditions: files are open and checked, text length and key offset are set, or an error message is printed
+ * **********************************************/
+int openJob(struct clientJob* job)
+{
+    char* args[3];
+
+    //openFiles and checkFiles take the paths where a single run has them in argv
+    args[0] = NULL;
+    args[1] = job->textPath;
+    args[2] = job->keyPath;
+    if(openFiles(&job->inputFD, &job->keyFD, args) < 0)
+    {
+        return -1;
+    }
+    job->textLen = checkFiles(&job->inputFD, &job->keyFD, args);
+    if(job->textLen < 0)
+    {
+        return -1;
+    }
+    job->keyOffset = keyOffset;
+    return 0;
+}
+
+/*************************************************
+ * Function: fillChunk
+ * Description: Reads the next chunk of plaintext and the same number of key characters and packs them behind their headers.
+ * The newline ending the plaintext ends the stream, the last pair goes out without the more flag.
+ * Params: buffer with room for a chunk pair, address of plaintext file pointer, address of key file pointer, request id
+ * Returns: number of bytes in the buffer
+ * Pre-conditions: files are open and the key is at least as long as the plaintext
+ * Post-conditions: buffer holds a text header, text, key header and key
+ * **********************************************/
+int fillChunk(char* out, FILE** inputFD, FILE** keyFD, uint32_t id)
+{
+    int len, more;
+    char* newline;
+
+    len = fread(&out[OTP_HEADER_SIZE], 1, STREAM_CHUNK, *inputFD);
+    more = (len == STREAM_CHUNK);
+    //The plaintext is one line, stop at its newline
+    newline = memchr(&out[OTP_HEADER_SIZE], '\n', len);
+    if(newline != NULL)
+    {
+        len = newline - &out[OTP_HEADER_SIZE];
+        more = 0;
+    }
+
+    //Only as much key as there is text
+    if(fread(&out[2*OTP_HEADER_SIZE + len], 1, len, *keyFD) != (size_t)len)
+    {
+        fprintf(stderr, "%s error: key is too short\n", otpProgramName);
+        exit(1);
+    }
+
+    encodeHeader((unsigned char*)out, OTP_MSG_TEXT, more ? OTP_FLAG_MORE : 0, len, id);
+    encodeHeader((unsigned char*)&out[OTP_HEADER_SIZE + len], OTP_MSG_KEY, more ? OTP_FLAG_MORE : 0, len, id);
+    return 2*OTP_HEADER_SIZE + 2*len;
+}
+
+/*************************************************
+ * Function: planChunk
+ * Description: Zero copy version of fillChunk, lays out the next chunk pair as a text header, a range of the plaintext file,
+ * a key header and the same range of the key file. Nothing is read, the headers are the only bytes written to memory
+ * Params: array of 4 segments, buffer for the two headers, plaintext file descriptor, key file descriptor, offset of the
+ * chunk in the plaintext, where the key starts in the key file, characters of plaintext left before its newline, request id
+ * Returns: number of segments, always 4
+ * Pre-conditions: key file has at least keyStart + offset + textLeft characters
+ * Post-conditions: segments describe the pair, segment 1 holds its length, the last pair goes out without the more flag
+ * **********************************************/
+int planChunk(struct outSegment* segments, char* headers, int textFD, int keyFD, off_t offset, off_t keyStart, long textLeft, uint32_t id)
+{
+    int len, more, i;
+
+    len = (textLeft > STREAM_CHUNK) ? STREAM_CHUNK : textLeft;
+    more = (textLeft > len);
+    encodeHeader((unsigned char*)headers, OTP_MSG_TEXT, more ? OTP_FLAG_MORE : 0, len, id);
+    encodeHeader((unsigned char*)&headers[OTP_HEADER_SIZE], OTP_MSG_KEY, more ? OTP_FLAG_MORE : 0, len, id);
+
+    for(i=0;i<4;i++)
+    {
+        //Even segments are headers, odd ones are file ranges
+        segments[i].data = (i % 2 == 0) ? &headers[(i / 2) * OTP_HEADER_SIZE] : NULL;
+        segments[i].fd = (i == 1) ? textFD : keyFD;
+        segments[i].offset = (i == 3) ? keyStart + offset : offset;
+        segments[i].left = (i % 2 == 0) ? OTP_HEADER_SIZE : len;
+        segments[i].numFDs = 0;
+    }
+    return 4;
+}
+
+/*************************************************
+ * Function: planFiles
+ * Description: Lays out a whole job as one files message for a daemon on a Unix domain socket. The plaintext and key
+ * descriptors go with it and the daemon reads the files itself, none of the text or key passes through the socket
+ * Params: array of segments, buffer for the message, job, request id
+ * Returns: number of segments, always 1
+ * Pre-conditions: job's files are regular files and have been checked
+ * Post-conditions: segment 0 holds the message with its descriptors, it goes out without the more flag
+ * **********************************************/
+int planFiles(struct outSegment* segments, char* message, struct clientJob* job, uint32_t id)
+{
+    int i;
+    int64_t values[2];
+
+    encodeHeader((unsigned char*)message, OTP_MSG_FILES, 0, OTP_FILES_SIZE, id);
+    values[0] = job->textLen;
+    values[1] = job->keyOffset;
+    for(i=0;i<OTP_FILES_SIZE;i++)
+    {
+        message[OTP_HEADER_SIZE + i] = values[i / 8] >> (8 * (7 - i % 8));
+    }
+
+    segments[0].data = message;
+    segments[0].left = OTP_HEADER_SIZE + OTP_FILES_SIZE;
+    segments[0].numFDs = 2;
+    segments[0].fds[0] = fileno(job->inputFD);
+    segments[0].fds[1] = fileno(job->keyFD);
+    return 1;
+}
+
+/*************************************************
+ * Function: sendSegments
+ * Description: Sends queued segments in order until they are all out or the socket is full. File ranges go with sendfile,
+ * if the kernel will not do sendfile for these files they are read with pread and sent from a buffer instead
+ * Params: socket file descriptor, array of segments, address of the index of the first segment not fully sent, number of segments
+ * Returns: 0 if everything went out or the socket is full, -1 on a socket or file error
+ * Pre-conditions: socket is connected
+ * Post-conditions: segments are advanced past what was sent, current is numSegments once they are all out
+ * **********************************************/
+int sendSegments(int socketFD, struct outSegment* segments, int* current, int numSegments)
+{
+    long charsWritten, charsRead;
+    char buffer[RECV_CHUNK];
+    struct outSegment* seg;
+
+    while(*current < numSegments)
+    {
+        seg = &segments[*current];
+        if(seg->left == 0)
+        {
+            (*current)++;
+            continue;
+        }
+
+        if(seg->data != NULL && seg->numFDs > 0)
+        {
+            charsWritten = sendFDs(socketFD, seg->data, seg->left, seg->fds, seg->numFDs);
+            //Descriptors went with the first byte
+            if(charsWritten > 0)
+            {
+                seg->numFDs = 0;
+            }
+        }
+        else if(seg->data != NULL)
+        {
+            //A header is held back to go out in one packet with the payload after it
+            charsWritten = send(socketFD, seg->data, seg->left, MSG_NOSIGNAL | ((*current < numSegments - 1) ? MSG_MORE : 0));
+        }
+        else if(!noSendfile)
+        {
+            charsWritten = sendfile(socketFD, seg->fd, &seg->offset, seg->left);
+            if(charsWritten < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                //Not supported for this file, retry the same range with pread
+                noSendfile = 1;
+                continue;
+            }
+            //File got shorter since it was measured
+            if(charsWritten == 0)
+            {
+                return -1;
+            }
+            if(charsWritten > 0)
+            {
+                seg->left -= charsWritten;
+            }
+        }
+        else
+        {
+            //Only what the socket took counts, the rest is read again next time
+            charsRead = pread(seg->fd, buffer, (seg->left < (long)sizeof(buffer)) ? seg->left : (long)sizeof(buffer), seg->offset);
+            if(charsRead <= 0)
+            {
+                return -1;
+            }
+            charsWritten = send(socketFD, buffer, charsRead, MSG_NOSIGNAL);
+            if(charsWritten > 0)
+            {
+                seg->offset += charsWritten;
+                seg->left -= charsWritten;
+            }
+        }
+
+        if(charsWritten < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        //sendfile already moved the offset and the count
+        if(seg->data != NULL)
+        {
+            seg->data += charsWritten;
+            seg->left -= charsWritten;
+        }
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: isRegularFile
+ * Description: Checks if a file descriptor is a regular file, those can be mapped, measured with fstat and sent with sendfile
+ * Params: file descriptor
+ * Returns: nonzero if it is
+ * Pre-conditions: file descriptor is open
+ * Post-conditions: none
+ * **********************************************/
+int isRegularFile(int fd)
+{
+    struct stat info;
+
+    return fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+}
+
+/*************************************************
+ * Function: validText
+ * Description: Checks a block of plaintext against the plainChars table. The loop has no branches on the data so it runs
+ * as fast as the bytes can be loaded
+ * Params: characters, number of characters
+ * Returns: 1 if every character is a capital letter, space or newline, 0 otherwise
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int validText(const char* data, long len)
+{
+    long i;
+    int valid;
+
+    valid = 1;
+    for(i=0;i<len;i++)
+    {
+        valid &= plainChars[(unsigned char)data[i]];
+    }
+    return valid;
+}
+
+/*************************************************
+ * Function: fileSize
+ * Description: Gets the number of bytes in a file, from fstat for a regular file or by reading it in large blocks otherwise
+ * Params: address of file pointer
+ * Returns: number of bytes
+ * Pre-conditions: file is open for reading at its start
+ * Post-conditions: file is back at its start if it can be rewound
+ * **********************************************/
+long fileSize(FILE** file)
+{
+    struct stat info;
+    char buffer[RECV_CHUNK];
+    long size, charsRead;
+
+    if(fstat(fileno(*file), &info) == 0 && S_ISREG(info.st_mode))
+    {
+        return info.st_size;
+    }
+    size = 0;
+    while((charsRead = fread(buffer, 1, sizeof(buffer), *file)) > 0)
+    {
+        size += charsRead;
+    }
+    rewind(*file);
+    return size;
+}
+
+/*************************************************
+ * Function: readResults
+ * Description: Runs received bytes through the result parser, headers are collected and payloads go straight to the output
+ * of the job named by the header's id. A job's output is opened with its first result and closed after its last
+ * Params: received bytes, number of bytes, result parser, array of jobs, number of jobs
+ * Returns: none
+ * Pre-conditions: parser starts zeroed
+ * Post-conditions: parser is updated and counts finished jobs, exits with an error message if the daemon sent one
+ * **********************************************/
+void readResults(char* in, int len, struct resultParser* parser, struct clientJob* jobs, int numJobs)
+{
+    struct otpHeader* header = &parser->header;
+    struct clientJob* job;
+    int n;
+
+    //A whole header with nothing left to read still has to finish its message, it may be an empty one
+    while(len > 0 || parser->headerLen == OTP_HEADER_SIZE)
+    {
+        //Between messages, collect the next header
+        if(parser->headerLen < OTP_HEADER_SIZE)
+        {
+            n = OTP_HEADER_SIZE - parser->headerLen;
+            if(n > len)
+            {
+                n = len;
+            }
+            memcpy(&parser->headerBuffer[parser->headerLen], in, n);
+            parser->headerLen += n;
+            in += n;
+            len -= n;
+            if(parser->headerLen < OTP_HEADER_SIZE)
+            {
+                return;
+            }
+
+            if(decodeHeader(parser->headerBuffer, header) < 0 || (header->type != OTP_MSG_RESULT && header->type != OTP_MSG_ERROR) ||
+               header->id >= (uint32_t)numJobs || jobs[header->id].failed || jobs[header->id].finished)
+            {
+                fprintf(stderr, "%s error: unexpected reply from server\n", otpProgramName);
+                exit(1);
+            }
+            parser->payloadLeft = header->length;
+            job = &jobs[header->id];
+            if(header->type == OTP_MSG_ERROR)
+            {
+                fprintf(stderr, "%s error: server: ", otpProgramName);
+            }
+            else if(job->output == NULL)
+            {
+                job->output = fopen(job->outPath, "w");
+                if(job->output == NULL)
+                {
+                    fprintf(stderr, "%s error: failed to open %s for writing\n", otpProgramName, job->outPath);
+                    exit(1);
+                }
+            }
+        }
+        job = &jobs[header->id];
+
+        //Payload goes straight out
+        n = (parser->payloadLeft < (uint32_t)len) ? (int)parser->payloadLeft : len;
+        fwrite(in, 1, n, (header->type == OTP_MSG_ERROR) ? stderr : job->output);
+        in += n;
+        len -= n;
+        parser->payloadLeft -= n;
+        if(parser->payloadLeft > 0)
+        {
+            return;
+        }
+
+        //End of a message
+        parser->headerLen = 0;
+        if(header->type == OTP_MSG_ERROR)
+        {
+            fprintf(stderr, "\n");
+            exit(1);
+        }
+        if(!(header->flags & OTP_FLAG_MORE))
+        {
+            //Last result of the job
+            fwrite("\n", 1, 1, job->output);
+            if(job->outPath != NULL && fclose(job->output) != 0)
+            {
+                fprintf(stderr, "%s error: writing %s\n", otpProgramName, job->outPath);
+                exit(1);
+            }
+            job->finished = 1;
+            parser->numDone++;
+        }
+    }
+}
+
+/*************************************************
+ * Function: openFiles
+ * Description: Opens the plaintext and key file for reading and fills the file descriptors
+ * Params: address of plaintext file descriptor, address of key file descriptor, command line args
+ * Returns: 0 on success, -1 if a file could not be opened
+ * Pre-conditions: proper command line args are given
+ * Post-conditions: File descriptors are opened for reading, or neither is open and an error message is printed
+ * **********************************************/
+int openFiles(FILE **inputFD, FILE **keyFD, char* argv[])
+{
+    //Open plaintext file descriptor for reading
+    *inputFD = fopen(argv[1], "r"); 
+    if(*inputFD == NULL)
+    {
+        fprintf(stderr, "%s error: failed to open %s for reading\n", otpProgramName, argv[1]);
+        return -1;
+    }
+    //Open key file descriptor for reading
+    *keyFD = fopen(argv[2], "r");
+    if(*keyFD == NULL)
+    {
+        fclose(*inputFD);
+        fprintf(stderr, "%s error: failed to open %s for reading\n", otpProgramName, argv[2]);
+        return -1;
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: closeFiles
+ * Description: closes plaintext and key file descriptors
+ * Params: address of plaintext file descriptor, address of key file descriptor
+ * Returns: none
+ * Pre-conditions: file descriptors passed are already open
+ * Post-conditions: file descriptors passed are closed
+ * **********************************************/
+void closeFiles(FILE **inputFD, FILE **keyFD)
+{ 
+    fclose(*inputFD); 
+    fclose(*keyFD);
+}
+
+/*************************************************
+ * Function: checkFiles
+ * Description: Checks the plaintext file sent for bad characters and compares the size of the plaintext and key files to see if there is a size error.
+ * The plaintext is checked in one pass over a mapping of the file, or over large blocks if it can not be mapped, and the key is measured with fstat.
+ * With -o or -O only the key from keyOffset on counts, -O claims that slice from the offset file here
+ * Params: Address of plaintext file descriptor, address of key file descriptor, command line args
+ * Returns: number of characters in the first line of the plaintext, -1 if bad characters are found or keyfile is shorter than plaintext
+ * Pre-conditions: file descriptors passed are open for reading, command line args are valid
+ * Post-conditions: the plaintext is back at its start and the key is at keyOffset, on a failed check both files are closed and an
+ * error message is printed
+ * **********************************************/
+long checkFiles(FILE **inputFD, FILE **keyFD, char* argv[])
+{
+    struct stat info;
+    char *map, *newline, buffer[RECV_CHUNK];
+    long textSize, lineLen, charsRead, keySize;
+    int valid;
+
+    valid = 1;
+    lineLen = -1;
+    map = MAP_FAILED;
+    if(fstat(fileno(*inputFD), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno(*inputFD), 0);
+    }
+
+    if(map != MAP_FAILED)
+    {
+        //Whole file at once, the kernel reads ahead since it is one sequential pass
+        madvise(map, info.st_size, MADV_SEQUENTIAL);
+        textSize = info.st_size;
+        valid = validText(map, textSize);
+        newline = memchr(map, '\n', textSize);
+        lineLen = (newline != NULL) ? newline - map : textSize;
+        munmap(map, info.st_size);
+    }
+    else
+    {
+        //Same check a block at a time
+        textSize = 0;
+        while((charsRead = fread(buffer, 1, sizeof(buffer), *inputFD)) > 0)
+        {
+            valid &= validText(buffer, charsRead);
+            newline = (lineLen < 0) ? memchr(buffer, '\n', charsRead) : NULL;
+            if(newline != NULL)
+            {
+                lineLen = textSize + (newline - buffer);
+            }
+            textSize += charsRead;
+        }
+        if(lineLen < 0)
+        {
+            lineLen = textSize;
+        }
+        rewind(*inputFD);
+    }
+
+    //Check for bad characters
+    if(!valid)
+    {
+        closeFiles(inputFD, keyFD);
+        fprintf(stderr, "%s error: input contains bad characters\n", otpProgramName);
+        return -1;
+    }
+
+    //A slice of the key needs a key file that can be seeked
+    if((keyOffset > 0 || offsetPath != NULL) && !isRegularFile(fileno(*keyFD)))
+    {
+        closeFiles(inputFD, keyFD);
+        fprintf(stderr, "%s error: key offsets need a regular key file\n", otpProgramName);
+        return -1;
+    }
+    keySize = fileSize(keyFD);
+    if(offsetPath != NULL)
+    {
+        keyOffset = reserveKey(offsetPath, keySize - textSize, lineLen);
+    }
+
+    //Check if key is shorter than file
+    if(keySize - keyOffset < textSize)
+    {
+        closeFiles(inputFD, keyFD);
+        fprintf(stderr, "Error: key \'%s\' is too short\n", argv[2]);
+        return -1;
+    }
+    if(keyOffset > 0 && fseeko(*keyFD, keyOffset, SEEK_SET) < 0)
+    {
+        error("seeking in key", 1);
+    }
+    return lineLen;
+}
+
+/*************************************************
+ * Function: reserveKey
+ * Description: Claims the next slice of a key file from its offset file. The offset file holds the byte offset of the first
+ * unused key character as a decimal number, no file or an empty one means 0. It is locked while it is read and moved past
+ * the slice, so clients running at the same time each get their own slice and no key character is used twice
+ * Params: path of the offset file, largest offset the slice can start at for the key to be long enough, characters to claim
+ * Returns: offset the slice starts at, if it is past the largest start the slice was not claimed
+ * Pre-conditions: none
+ * Post-conditions: offset file holds the offset after the slice, exits on error
+ * **********************************************/
+off_t reserveKey(const char* path, off_t lastStart, long len)
+{
+    int fd;
+    long charsRead;
+    char buffer[32];
+    off_t offset;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd < 0)
+    {
+        error("opening offset file", 1);
+    }
+    //Blocks until no other client is claiming
+    if(flock(fd, LOCK_EX) < 0)
+    {
+        error("locking offset file", 1);
+    }
+    charsRead = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if(charsRead < 0)
+    {
+        error("reading offset file", 1);
+    }
+    buffer[charsRead] = '\0';
+    offset = strtoll(buffer, NULL, 10);
+    if(offset < 0)
+    {
+        fprintf(stderr, "%s error: bad offset in %s\n", otpProgramName, path);
+        exit(1);
+    }
+
+    //Only claimed if the key is long enough, the caller reports it otherwise
+    if(offset <= lastStart)
+    {
+        charsRead = snprintf(buffer, sizeof(buffer), "%lld\n", (long long)(offset + len));
+        if(pwrite(fd, buffer, charsRead, 0) != charsRead || ftruncate(fd, charsRead) < 0 || fsync(fd) < 0)
+        {
+            error("writing offset file", 1);
+        }
+    }
+    //Closing drops the lock
+    close(fd);
+    return offset;
+}
@@ -0,0 +1,10 @@
+//Combined daemon, runs encryption for otp_enc and decryption for otp_dec on one port
+//otp_enc_d and otp_dec_d still work on their own, everything but the name and the operations is in libotp, see otp.h
+
+#include "otp.h"
+
+int main(int argc, char* argv[])
+{
+    otpProgramName = "otp_d";
+    return daemonMain(argc, argv, OTP_OP_ANY);
+}
@@ -0,0 +1,2325 @@
+//Daemon side of the one time pad, otp_enc_d and otp_dec_d only differ in the operation passed to daemonMain
+//otp_d passes both and serves whichever operation each client asks for
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "otp.h"
+
+//Default number of pre-forked worker processes, the most clients served at once
+#define DEFAULT_WORKERS 5
+//Upper limit for the worker count given on the command line
+#define MAX_WORKERS 256
+//Event mode, most epoll events handled per wakeup and initial read buffer size
+#define MAX_EVENTS 64
+#define READ_CHUNK 4096
+//Binary protocol, most requests one connection may have open at once and most of its chunk pairs the cipher threads may hold
+#define MAX_OPEN_REQUESTS 64
+#define MAX_PENDING 16
+//Upper limit for the cipher thread count given with -t
+#define MAX_CIPHER_THREADS 64
+//Upper limit for the listen backlog given with -b
+#define MAX_BACKLOG 65535
+//Blocking mode, longest a worker waits on a quiet client before it hangs up and goes back to accept
+#define IDLE_TIMEOUT_SECONDS 30
+
+//Event mode connection states
+#define CONN_HANDSHAKE 0
+#define CONN_READ_TEXT 1
+#define CONN_READ_KEY 2
+#define CONN_WRITING 3
+#define CONN_CLOSING 4
+#define CONN_READ_REQUEST 5
+
+//Files message being answered, its pairs are read from the passed descriptors one at a time
+struct fileRequest
+{
+    int active;
+    uint32_t id;
+    int textFD, keyFD;
+    long textLen;
+    off_t offset, keyOffset;
+};
+
+//A binary protocol request whose last chunk pair has not been answered yet
+struct openRequest
+{
+    uint32_t id;
+    long characters;
+    struct timespec started;
+};
+
+//Requests open on one connection, a client may interleave the chunk pairs of several
+struct requestTable
+{
+    struct openRequest req[MAX_OPEN_REQUESTS];
+    int count;
+};
+
+//Event mode per client state, the handshake and framing run as a state machine over whatever bytes have arrived
+struct connection
+{
+    int fd;
+    int state;
+    //Received bytes, plaintext then key each ending in the '0' control character, or headers and payloads
+    char* in;
+    int inLen, inSize;
+    //Most bytes the in buffer may grow to
+    int inLimit;
+    //Everything before scanPos has been searched for the control character already
+    int scanPos;
+    //Position of the control character ending the plaintext
+    int textEnd;
+    //Reply queued for the client
+    char* out;
+    int outLen, outSent;
+    //Events epoll currently reports for this client
+    uint32_t interest;
+    //Operation the client asked for, 0 until the handshake is done, and metrics for a legacy request
+    int op;
+    long characters;
+    int completed;
+    struct timespec started;
+    //Binary protocol connections carry any number of requests, with their own metrics
+    int persistent;
+    struct requestTable requests;
+    //Chunk pairs with the cipher threads, a closed connection is only freed once they have all come back
+    int pending;
+    int closed;
+    //Descriptors passed over a Unix domain socket that no files message has claimed yet, and the files being answered
+    int passed[MAX_PASSED_FDS];
+    int numPassed;
+    struct fileRequest file;
+};
+
+//Chunk pair handed to a cipher thread, data holds the text header, text, key header and key as received. The text is
+//transformed in place and its header rewritten as the result header, so the result goes out straight from data
+struct cipherTask
+{
+    struct cipherTask* next;
+    struct connection* conn;
+    int op;
+    uint32_t len;
+    //When it was queued, for the queue wait metrics
+    struct timespec queued;
+    char data[];
+};
+
+//Shared memory ring handed from the event loop to a thread of its own, with its own copy of the client's socket
+struct ringSession
+{
+    int socketFD, ringFD, op;
+    uint32_t id;
+};
+
+//Tasks waiting for a cipher thread, or finished ones waiting for the event loop
+struct taskQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct cipherTask *head, *tail;
+};
+
+//Operations this daemon runs, OTP_OP_ENC, OTP_OP_DEC or both, same values as CIPHER_ENCRYPT and CIPHER_DECRYPT
+static int daemonOps;
+//Set by SIGUSR1, the supervisor prints the metrics when it sees it
+static volatile sig_atomic_t reportRequested = 0;
+//Event mode cipher threads per worker, 0 to transform every pair on the event loop itself. Each thread has its own queue
+//and every pair of a request goes to the same one, so the results of a request stay in order
+static int cipherThreads = 0;
+static struct taskQueue* cipherQueues;
+//Finished tasks, the eventfd wakes the event loop when one is added
+static struct taskQueue doneQueue;
+static int doneEventFD;
+//Listen backlog, and with -r the address every worker binds a listening socket of its own to with SO_REUSEPORT
+static int listenBacklog = DEFAULT_BACKLOG;
+static int reusePort = 0;
+static struct sockaddr_storage listenAddress;
+//Listening socket of the metrics server started with -M, -1 without one
+static int metricsSocketFD = -1;
+
+//Prototypes
+int getWorkerCount(char*);
+void spawnWorker(int*, int);
+void serveConnections(int*);
+void requestReport(int);
+int answerOp(int);
+struct openRequest* findRequest(struct requestTable*, uint32_t);
+void finishPair(struct requestTable*, uint32_t, long, int, int);
+void failRequests(struct requestTable*, int);
+void eventLoop(int*);
+void startCipherThreads(int);
+void* cipherThread(void*);
+int startThread(pthread_t*, pthread_attr_t*, void* (*)(void*), void*);
+struct cipherTask* newTask(struct connection*, int);
+void queueTask(struct cipherTask*);
+void runTask(struct cipherTask*);
+int queueResult(struct connection*, struct cipherTask*);
+void deliverResults(int);
+void acceptClients(int*, int);
+void handleConnection(int, struct connection*, uint32_t);
+int parseConnection(struct connection*);
+int parseRequest(struct connection*);
+int parseFiles(struct connection*, struct otpHeader*);
+int nextFilePair(struct connection*);
+int startRing(struct connection*, struct otpHeader*);
+void* ringThread(void*);
+int wantsInput(struct connection*);
+int queueError(struct connection*, uint32_t, const char*);
+char* reserveOutput(struct connection*, int);
+int flushConnection(int, struct connection*);
+void updateInterest(int, struct connection*);
+void closeConnection(int, struct connection*);
+void acceptConnection(socklen_t*, struct sockaddr_storage*, int*, int*, int*, int*);
+int acceptHello(int);
+long getClientMessage(int*, int);
+int getClientPair(int*, int, struct requestTable*, char**, uint32_t*);
+int getClientFiles(int*, int, struct requestTable*, char**, uint32_t*, struct otpHeader*, int*, int);
+int decodeFiles(const unsigned char*, long*, off_t*);
+void closeFDs(int*, int);
+int serveRing(int, int, int, uint32_t);
+void sendError(int, uint32_t, const char*);
+int cipherMessage(char[], char[], int*, int);
+void timedCipher(const char*, const char*, char*, int, int);
+void spawnMetricsServer(int*, pid_t*);
+
+/*************************************************
+ * Function: daemonMain
+ * Description: Runs otp_enc_d, otp_dec_d or otp_d, pre-forks a pool of workers on the listening port and keeps it full.
+ * SIGUSR1 prints the per-operation metrics of all workers to stderr. With -t each event mode worker also runs cipher threads.
+ * With -r the workers do not share one listening socket, each listens on its own and the kernel balances connections
+ * across them. With -M a process of its own serves the metrics over HTTP on a second port. With -T the workers trace
+ * their requests and write the traces out on SIGUSR2
+ * Params: argc and argv of the front-end, OTP_OP_ENC, OTP_OP_DEC or OTP_OP_ANY
+ * Returns: exit status
+ * Pre-conditions: otpProgramName is set
+ * Post-conditions: only returns if waiting on the workers fails, exits on bad usage
+ * **********************************************/
+int daemonMain(int argc, char* argv[], int op)
+{
+    //Initialize necessary variables
+    int listenSocketFD, portNumber, numWorkers, childExitMethod, i, opt, eventMode;
+    char *metricsPort = NULL, *tracePrefix = NULL;
+    struct sockaddr_storage metricsAddress;
+    struct sigaction reportAction;
+    pid_t workerPid, metricsPid = -1;
+
+    daemonOps = op;
+
+    //Check options, -e runs each worker as an epoll event loop instead of one client at a time,
+    //-t gives every event loop threads that transform chunk pairs and implies -e, -b sets the listen backlog,
+    //-r gives every worker a listening socket of its own on the same port, -M serves the metrics over HTTP on another port,
+    //-T traces requests and SIGUSR2 makes every worker write its trace to a file starting with the prefix
+    eventMode = 0;
+    while((opt = getopt(argc, argv, "et:b:rM:T:")) != -1)
+    {
+        if(opt == 'e')
+        {
+            eventMode = 1;
+        }
+        else if(opt == 't')
+        {
+            cipherThreads = atoi(optarg);
+            if(cipherThreads < 1 || cipherThreads > MAX_CIPHER_THREADS)
+            {
+                fprintf(stderr, "%s error: thread count must be between 1 and %d\n", otpProgramName, MAX_CIPHER_THREADS);
+                exit(1);
+            }
+            eventMode = 1;
+        }
+        else if(opt == 'b')
+        {
+            listenBacklog = atoi(optarg);
+            if(listenBacklog < 1 || listenBacklog > MAX_BACKLOG)
+            {
+                fprintf(stderr, "%s error: backlog must be between 1 and %d\n", otpProgramName, MAX_BACKLOG);
+                exit(1);
+            }
+        }
+        else if(opt == 'r')
+        {
+            reusePort = 1;
+        }
+        else if(opt == 'M')
+        {
+            metricsPort = optarg;
+        }
+        else if(opt == 'T')
+        {
+            tracePrefix = optarg;
+        }
+        else
+        {
+            fprintf(stderr, "USAGE: %s [-e] [-t threads] [-b backlog] [-r] [-M metricsport] [-T traceprefix] port [workers]\n", argv[0]);
+            exit(0);
+        }
+    }
+
+    //Check usage
+    if(argc - optind < 1)
+    {
+        fprintf(stderr, "USAGE: %s [-e] [-t threads] [-b backlog] [-r] [-M metricsport] [-T traceprefix] port [workers]\n", argv[0]);
+        exit(0);
+    }
+    else
+    {
+        //Fill server address struct
+        fillAddrStruct(&listenAddress, &portNumber, argv[optind], NULL);
+        if(reusePort && listenAddress.ss_family != AF_INET)
+        {
+            fprintf(stderr, "%s error: -r needs a TCP port\n", otpProgramName);
+            exit(1);
+        }
+
+        //Set up socket for listening from. With -r the supervisor's socket only holds the port, so a port in use is found
+        //here and not in every worker, and the workers bind their own
+        setSocket(&listenSocketFD, &listenAddress, reusePort ? 0 : listenBacklog, reusePort);
+
+        //Counters have to be mapped and tracing turned on before the fork so every worker has them
+        metricsInit();
+        if(tracePrefix != NULL)
+        {
+            traceInit(tracePrefix);
+        }
+        if(metricsPort != NULL)
+        {
+            fillAddrStruct(&metricsAddress, &portNumber, metricsPort, NULL);
+            setSocket(&metricsSocketFD, &metricsAddress, DEFAULT_BACKLOG, 0);
+            spawnMetricsServer(&listenSocketFD, &metricsPid);
+        }
+        //No SA_RESTART, the report is printed when it interrupts the wait below
+        memset(&reportAction, '\0', sizeof(reportAction));
+        reportAction.sa_handler = requestReport;
+        sigemptyset(&reportAction.sa_mask);
+        sigaction(SIGUSR1, &reportAction, NULL);
+
+        //Pre-fork the worker pool, every worker accepts on the same listening socket unless it has its own
+        numWorkers = getWorkerCount((argc - optind > 1) ? argv[optind + 1] : NULL);
+        for(i=0;i<numWorkers;i++)
+        {
+            spawnWorker(&listenSocketFD, eventMode);
+        }
+
+        //Infinite loop so the pool stays full, replace any worker that terminates
+        while(1)
+        {
+            workerPid = wait(&childExitMethod);
+            if(reportRequested)
+            {
+                reportRequested = 0;
+                metricsReport(stderr, daemonOps);
+            }
+            if(workerPid == -1)
+            {
+                //Interrupted wait is not an error, just wait again
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            //The metrics server is replaced by another one, not by a worker
+            if(workerPid == metricsPid)
+            {
+                spawnMetricsServer(&listenSocketFD, &metricsPid);
+                continue;
+            }
+            metricsWorkerExit(workerPid);
+            spawnWorker(&listenSocketFD, eventMode);
+        }
+        //Close the listening socket
+        close(listenSocketFD);
+
+    }
+
+    return 0;
+}
+
+/*************************************************
+ * Function: getWorkerCount
+ * Description: Reads the optional worker count from the command line, this is the most connections served at once
+ * Params: worker count argument or NULL if none was given
+ * Returns: number of worker processes to pre-fork
+ * Pre-conditions: none
+ * Post-conditions: returns DEFAULT_WORKERS if no count was given, exits on a bad count
+ * **********************************************/
+int getWorkerCount(char* countArg)
+{
+    int numWorkers;
+
+    //No count given, use the default
+    if(countArg == NULL)
+    {
+        return DEFAULT_WORKERS;
+    }
+
+    numWorkers = atoi(countArg);
+    if(numWorkers < 1 || numWorkers > MAX_WORKERS)
+    {
+        fprintf(stderr, "%s error: worker count must be between 1 and %d\n", otpProgramName, MAX_WORKERS);
+        exit(1);
+    }
+    return numWorkers;
+}
+
+/*************************************************
+ * Function: spawnWorker
+ * Description: Forks a worker process that serves connections from the shared listening socket, or with -r from a listening
+ * socket of its own. Connections still queued on a worker's own socket when it exits are reset
+ * Params: address of listening socket file descriptor, nonzero to run the worker as an event loop
+ * Returns: none
+ * Pre-conditions: listening socket is bound and listening
+ * Post-conditions: a new worker is running, or an error is printed if fork failed
+ * **********************************************/
+void spawnWorker(int* listenSocketFD, int eventMode)
+{
+    pid_t spawnPid;
+
+    spawnPid = fork();
+    //If a bad process was spawned
+    if(spawnPid == -1)
+    {
+        fprintf(stderr, "BAD PROCESS\n");
+        //Back off so a failing fork does not spin the supervisor
+        sleep(1);
+    }
+    //Child process
+    else if(spawnPid == 0)
+    {
+        //Reports come from the supervisor, a stray SIGUSR1 must not kill or interrupt a worker
+        signal(SIGUSR1, SIG_IGN);
+        metricsWorker();
+        traceWorker();
+        if(metricsSocketFD >= 0)
+        {
+            close(metricsSocketFD);
+        }
+        if(reusePort)
+        {
+            close(*listenSocketFD);
+            setSocket(listenSocketFD, &listenAddress, listenBacklog, 1);
+        }
+        if(eventMode)
+        {
+            eventLoop(listenSocketFD);
+        }
+        else
+        {
+            serveConnections(listenSocketFD);
+        }
+        exit(0);
+    }
+}
+
+/*************************************************
+ * Function: spawnMetricsServer
+ * Description: Forks the process that answers HTTP requests on the metrics port, it only reads the shared counters
+ * Params: address of the client listening socket file descriptor, closed in the child, address to store the child's pid
+ * Returns: none
+ * Pre-conditions: metricsInit has run and the metrics socket is listening
+ * Post-conditions: the metrics server is running, or an error is printed if fork failed
+ * **********************************************/
+void spawnMetricsServer(int* listenSocketFD, pid_t* metricsPid)
+{
+    *metricsPid = fork();
+    if(*metricsPid == -1)
+    {
+        fprintf(stderr, "%s error: forking the metrics server\n", otpProgramName);
+        //Back off so a failing fork does not spin the supervisor
+        sleep(1);
+    }
+    else if(*metricsPid == 0)
+    {
+        signal(SIGUSR1, SIG_IGN);
+        close(*listenSocketFD);
+        metricsServe(metricsSocketFD, daemonOps);
+        exit(0);
+    }
+}
+
+/*************************************************
+ * Function: serveConnections
+ * Description: Worker loop, accepts a client, handles its message and goes back for the next one. A binary protocol client
+ * may send more requests on the same connection, even with their chunk pairs interleaved, each pair is answered as it comes
+ * until the client closes or sends nothing for IDLE_TIMEOUT_SECONDS
+ * Params: address of listening socket file descriptor
+ * Returns: none, loops forever
+ * Pre-conditions: called in a worker process, listening socket is bound and listening
+ * Post-conditions: none
+ * **********************************************/
+void serveConnections(int* listenSocketFD)
+{
+    int establishedConnectionFD, protocol, op, charsRead;
+    long characters;
+    char peek, *buffer = NULL;
+    uint32_t bufferSize = 0;
+    socklen_t sizeOfClientInfo;
+    struct sockaddr_storage clientAddress;
+    struct timespec started;
+    struct requestTable requests;
+
+    while(1)
+    {
+        //Accept a connection, blocking if one is not available until one connects
+        traceCheck();
+        acceptConnection(&sizeOfClientInfo, &clientAddress, listenSocketFD, &establishedConnectionFD, &protocol, &op);
+        metricsStart(&started);
+        metricsConnection(1);
+
+        //Get message from client and send back the result, framed the way the client asked for
+        if(protocol == OTP_VERSION)
+        {
+            requests.count = 0;
+            //Next pair until the client closes or one fails, each request is counted once its last pair is answered
+            while(getClientPair(&establishedConnectionFD, op, &requests, &buffer, &bufferSize) == 0)
+            {
+                do
+                {
+                    charsRead = recv(establishedConnectionFD, &peek, 1, MSG_PEEK);
+                } while(charsRead < 0 && errno == EINTR);
+                if(charsRead <= 0)
+                {
+                    break;
+                }
+            }
+            //Whatever is still open was cut short
+            failRequests(&requests, op);
+        }
+        else
+        {
+            characters = getClientMessage(&establishedConnectionFD, op);
+            metricsRecord(op, characters, &started);
+        }
+
+        //Close existing socket which is connected to the client
+        close(establishedConnectionFD);
+        metricsConnection(-1);
+    }
+}
+
+/*************************************************
+ * Function: requestReport
+ * Description: SIGUSR1 handler, asks the supervisor to print the metrics once it is out of wait
+ * Params: signal number
+ * Returns: none
+ * Pre-conditions: installed without SA_RESTART
+ * Post-conditions: reportRequested is set
+ * **********************************************/
+void requestReport(int signo)
+{
+    (void)signo;
+    reportRequested = 1;
+}
+
+/*************************************************
+ * Function: answerOp
+ * Description: Picks the operation to answer a handshake with. A client asking for an operation we run gets it echoed back,
+ * anything else gets the operation of this daemon so the client can report which daemon it reached
+ * Params: operation the client asked for, 0 if it was not a valid one
+ * Returns: OTP_OP_ENC or OTP_OP_DEC
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int answerOp(int requested)
+{
+    if((requested == OTP_OP_ENC || requested == OTP_OP_DEC) && (daemonOps & requested))
+    {
+        return requested;
+    }
+    return (daemonOps == OTP_OP_DEC) ? OTP_OP_DEC : OTP_OP_ENC;
+}
+
+/*************************************************
+ * Function: findRequest
+ * Description: Looks up the open request a chunk pair belongs to, the first pair of a request opens it and starts its metrics
+ * Params: request table of the connection, request id from the text header
+ * Returns: address of the request, NULL if it is new and the table is full
+ * Pre-conditions: none
+ * Post-conditions: the request is in the table unless NULL was returned
+ * **********************************************/
+struct openRequest* findRequest(struct requestTable* requests, uint32_t id)
+{
+    int i;
+
+    for(i=0;i<requests->count;i++)
+    {
+        if(requests->req[i].id == id)
+        {
+            return &requests->req[i];
+        }
+    }
+    if(requests->count == MAX_OPEN_REQUESTS)
+    {
+        return NULL;
+    }
+    requests->req[i].id = id;
+    requests->req[i].characters = 0;
+    metricsStart(&requests->req[i].started);
+    requests->count++;
+    return &requests->req[i];
+}
+
+/*************************************************
+ * Function: finishPair
+ * Description: Counts an answered chunk pair towards its request, the last pair of a request is recorded in the metrics and
+ * closes it so its id can be used again
+ * Params: request table of the connection, request id, characters in the pair, nonzero if more pairs follow, operation
+ * Returns: none
+ * Pre-conditions: findRequest opened the request
+ * Post-conditions: request is updated or removed from the table
+ * **********************************************/
+void finishPair(struct requestTable* requests, uint32_t id, long characters, int more, int op)
+{
+    struct openRequest* request;
+
+    request = findRequest(requests, id);
+    if(request == NULL)
+    {
+        return;
+    }
+    request->characters += characters;
+    if(!more)
+    {
+        metricsRecord(op, request->characters, &request->started);
+        //Order of the table does not matter, the last entry fills the gap
+        *request = requests->req[--requests->count];
+    }
+}
+
+/*************************************************
+ * Function: failRequests
+ * Description: Records every request still open on a connection as an error, for when the connection ends
+ * Params: request table of the connection, operation
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: table is empty
+ * **********************************************/
+void failRequests(struct requestTable* requests, int op)
+{
+    int i;
+
+    for(i=0;i<requests->count;i++)
+    {
+        metricsRecord(op, -1, &requests->req[i].started);
+    }
+    requests->count = 0;
+}
+
+/*************************************************
+ * Function: eventLoop
+ * Description: Event mode worker loop, multiplexes every client of this worker over one epoll instance with non-blocking sockets
+ * Params: address of listening socket file descriptor
+ * Returns: none, loops forever
+ * Pre-conditions: called in a worker process, listening socket is bound and listening
+ * Post-conditions: exits with an error if epoll can not be set up
+ * **********************************************/
+void eventLoop(int* listenSocketFD)
+{
+    int epollFD, numEvents, i, resultsReady;
+    struct epoll_event event, events[MAX_EVENTS];
+
+    epollFD = epoll_create1(0);
+    if(epollFD < 0)
+    {
+        error("creating epoll instance", 1);
+    }
+    if(cipherThreads > 0)
+    {
+        startCipherThreads(epollFD);
+    }
+
+    //Listening socket is shared with the other workers, only wake one of them per new client
+    setNonBlocking(*listenSocketFD);
+    memset(&event, '\0', sizeof(event));
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if(epoll_ctl(epollFD, EPOLL_CTL_ADD, *listenSocketFD, &event) < 0)
+    {
+        error("adding listening socket to epoll", 1);
+    }
+
+    while(1)
+    {
+        numEvents = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+        if(numEvents < 0)
+        {
+            //SIGUSR2 asking for the trace is the only signal a worker handles
+            if(errno == EINTR)
+            {
+                traceCheck();
+                continue;
+            }
+            error("waiting for events", 1);
+        }
+
+        resultsReady = 0;
+        for(i=0;i<numEvents;i++)
+        {
+            //No connection attached means the listening socket is ready
+            if(events[i].data.ptr == NULL)
+            {
+                acceptClients(listenSocketFD, epollFD);
+            }
+            else if(events[i].data.ptr == &doneQueue)
+            {
+                resultsReady = 1;
+            }
+            else
+            {
+                handleConnection(epollFD, events[i].data.ptr, events[i].events);
+            }
+        }
+        //Results may close connections, which must not happen while later events still point at them
+        if(resultsReady)
+        {
+            deliverResults(epollFD);
+        }
+    }
+}
+
+/*************************************************
+ * Function: startCipherThreads
+ * Description: Starts the cipher threads of an event mode worker and registers the eventfd they signal finished tasks on
+ * Params: epoll file descriptor
+ * Returns: none
+ * Pre-conditions: cipherThreads is set, called in the worker process
+ * Post-conditions: threads are waiting for tasks, exits with an error if they can not be started
+ * **********************************************/
+void startCipherThreads(int epollFD)
+{
+    int i;
+    pthread_t thread;
+    struct epoll_event event;
+
+    cipherQueues = calloc(cipherThreads, sizeof(struct taskQueue));
+    if(cipherQueues == NULL)
+    {
+        error("allocating cipher queues", 1);
+    }
+    pthread_mutex_init(&doneQueue.lock, NULL);
+    doneEventFD = eventfd(0, EFD_NONBLOCK);
+    if(doneEventFD < 0)
+    {
+        error("creating eventfd", 1);
+    }
+    memset(&event, '\0', sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &doneQueue;
+    if(epoll_ctl(epollFD, EPOLL_CTL_ADD, doneEventFD, &event) < 0)
+    {
+        error("adding eventfd to epoll", 1);
+    }
+
+    for(i=0;i<cipherThreads;i++)
+    {
+        pthread_mutex_init(&cipherQueues[i].lock, NULL);
+        pthread_cond_init(&cipherQueues[i].ready, NULL);
+        if(startThread(&thread, NULL, cipherThread, &cipherQueues[i]) != 0)
+        {
+            error("starting cipher thread", 1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+/*************************************************
+ * Function: startThread
+ * Description: pthread_create for the worker's helper threads, the new thread starts with SIGUSR2 blocked so the signal
+ * always goes to the worker's own thread and wakes it from accept or epoll to dump its trace
+ * Params: same as pthread_create
+ * Returns: same as pthread_create
+ * Pre-conditions: called in a worker
+ * Post-conditions: the calling thread's signal mask is unchanged
+ * **********************************************/
+int startThread(pthread_t* thread, pthread_attr_t* attr, void* (*start)(void*), void* arg)
+{
+    sigset_t blocked, previous;
+    int result;
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    result = pthread_create(thread, attr, start, arg);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return result;
+}
+
+/*************************************************
+ * Function: cipherThread
+ * Description: Cipher thread, transforms the chunk pairs on its queue in order and passes them back to the event loop
+ * Params: address of the thread's task queue
+ * Returns: none, loops forever
+ * Pre-conditions: queue and doneQueue are initialized
+ * Post-conditions: none
+ * **********************************************/
+void* cipherThread(void* arg)
+{
+    struct taskQueue* queue = arg;
+    struct cipherTask* task;
+    uint64_t one = 1;
+
+    metricsThread();
+    while(1)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while(queue->head == NULL)
+        {
+            pthread_cond_wait(&queue->ready, &queue->lock);
+        }
+        task = queue->head;
+        queue->head = task->next;
+        pthread_mutex_unlock(&queue->lock);
+
+        metricsQueueWait(&task->queued);
+        runTask(task);
+
+        task->next = NULL;
+        pthread_mutex_lock(&doneQueue.lock);
+        if(doneQueue.head == NULL)
+        {
+            doneQueue.head = task;
+        }
+        else
+        {
+            doneQueue.tail->next = task;
+        }
+        doneQueue.tail = task;
+        pthread_mutex_unlock(&doneQueue.lock);
+        write(doneEventFD, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+/*************************************************
+ * Function: newTask
+ * Description: Allocates a task for a chunk pair of a connection, the caller fills in the pair
+ * Params: connection struct, size of the pair with both headers
+ * Returns: address of the task, NULL if out of memory
+ * Pre-conditions: none
+ * Post-conditions: task data has room for size bytes
+ * **********************************************/
+struct cipherTask* newTask(struct connection* conn, int size)
+{
+    struct cipherTask* task;
+
+    task = malloc(sizeof(struct cipherTask) + size);
+    if(task == NULL)
+    {
+        fprintf(stderr, "%s error: out of memory for cipher task\n", otpProgramName);
+        return NULL;
+    }
+    task->next = NULL;
+    task->conn = conn;
+    task->op = conn->op;
+    task->len = (size - 2*OTP_HEADER_SIZE) / 2;
+    return task;
+}
+
+/*************************************************
+ * Function: queueTask
+ * Description: Hands a filled task to the cipher thread of its request
+ * Params: task
+ * Returns: none
+ * Pre-conditions: task data starts with the text header of the pair, cipher threads are running
+ * Post-conditions: task is queued and counted as pending on its connection
+ * **********************************************/
+void queueTask(struct cipherTask* task)
+{
+    struct taskQueue* queue;
+    struct otpHeader header;
+
+    decodeHeader((unsigned char*)task->data, &header);
+    queue = &cipherQueues[header.id % cipherThreads];
+    metricsStart(&task->queued);
+    pthread_mutex_lock(&queue->lock);
+    if(queue->head == NULL)
+    {
+        queue->head = task;
+    }
+    else
+    {
+        queue->tail->next = task;
+    }
+    queue->tail = task;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+    task->conn->pending++;
+}
+
+/*************************************************
+ * Function: runTask
+ * Description: Transforms a task's pair, the result replaces the text under a result header for the same request
+ * Params: task
+ * Returns: none
+ * Pre-conditions: task data holds a text header, text and key at their places
+ * Post-conditions: task data starts with the result message
+ * **********************************************/
+void runTask(struct cipherTask* task)
+{
+    struct otpHeader header;
+
+    decodeHeader((unsigned char*)task->data, &header);
+    timedCipher(&task->data[OTP_HEADER_SIZE], &task->data[2*OTP_HEADER_SIZE + task->len], &task->data[OTP_HEADER_SIZE], task->len, task->op);
+    encodeHeader((unsigned char*)task->data, OTP_MSG_RESULT, header.flags & OTP_FLAG_MORE, task->len, header.id);
+}
+
+/*************************************************
+ * Function: queueResult
+ * Description: Queues the result of a finished task on its connection and counts it towards its request
+ * Params: connection struct, task
+ * Returns: 0 on success, -1 if out of memory
+ * Pre-conditions: runTask has run on the task
+ * Post-conditions: result is at the end of the out buffer
+ * **********************************************/
+int queueResult(struct connection* conn, struct cipherTask* task)
+{
+    struct otpHeader header;
+    char* reply;
+
+    decodeHeader((unsigned char*)task->data, &header);
+    reply = reserveOutput(conn, OTP_HEADER_SIZE + task->len);
+    if(reply == NULL)
+    {
+        return -1;
+    }
+    memcpy(reply, task->data, OTP_HEADER_SIZE + task->len);
+    finishPair(&conn->requests, header.id, task->len, header.flags & OTP_FLAG_MORE, conn->op);
+    return 0;
+}
+
+/*************************************************
+ * Function: deliverResults
+ * Description: Takes every task the cipher threads finished, queues each result on its connection and lets the connection
+ * go on, it may have stopped reading while the threads held too many of its pairs
+ * Params: epoll file descriptor
+ * Returns: none
+ * Pre-conditions: eventfd was reported readable
+ * Post-conditions: tasks are freed, connections closed while their tasks were out are freed once none are left
+ * **********************************************/
+void deliverResults(int epollFD)
+{
+    struct cipherTask *task, *next;
+    struct connection* conn;
+    uint64_t count;
+
+    read(doneEventFD, &count, sizeof(count));
+    pthread_mutex_lock(&doneQueue.lock);
+    task = doneQueue.head;
+    doneQueue.head = NULL;
+    pthread_mutex_unlock(&doneQueue.lock);
+
+    for(;task!=NULL;task=next)
+    {
+        next = task->next;
+        conn = task->conn;
+        conn->pending--;
+        if(conn->closed)
+        {
+            if(conn->pending == 0)
+            {
+                free(conn);
+            }
+        }
+        else if(queueResult(conn, task) < 0)
+        {
+            closeConnection(epollFD, conn);
+        }
+        else
+        {
+            handleConnection(epollFD, conn, 0);
+        }
+        free(task);
+    }
+}
+
+/*************************************************
+ * Function: acceptClients
+ * Description: Accepts every pending client on the listening socket and registers each one with epoll
+ * Params: address of listening socket file descriptor, epoll file descriptor
+ * Returns: none
+ * Pre-conditions: listening socket is non-blocking and reported readable
+ * Post-conditions: each new client has a connection struct waiting for its identifier bit
+ * **********************************************/
+void acceptClients(int* listenSocketFD, int epollFD)
+{
+    int establishedConnectionFD;
+    uint64_t traced;
+    struct connection* conn;
+    struct epoll_event event;
+
+    while(1)
+    {
+        traced = traceStart();
+        establishedConnectionFD = accept(*listenSocketFD, NULL, NULL);
+        if(establishedConnectionFD < 0)
+        {
+            //Another worker took it or the queue is drained
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                fprintf(stderr, "%s error: on accept\n", otpProgramName);
+            }
+            return;
+        }
+        setNonBlocking(establishedConnectionFD);
+        metricsAccept();
+
+        conn = calloc(1, sizeof(struct connection));
+        if(conn == NULL)
+        {
+            fprintf(stderr, "%s error: out of memory for connection\n", otpProgramName);
+            close(establishedConnectionFD);
+            continue;
+        }
+        conn->fd = establishedConnectionFD;
+        conn->state = CONN_HANDSHAKE;
+        conn->inLimit = 2*MAX_PAYLOAD + 2;
+        conn->interest = EPOLLIN;
+        conn->file.textFD = -1;
+        conn->file.keyFD = -1;
+        metricsConnection(1);
+
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if(epoll_ctl(epollFD, EPOLL_CTL_ADD, establishedConnectionFD, &event) < 0)
+        {
+            fprintf(stderr, "%s error: adding client to epoll\n", otpProgramName);
+            closeConnection(epollFD, conn);
+        }
+        traceEnd(TRACE_ACCEPT, traced, 0);
+    }
+}
+
+/*************************************************
+ * Function: handleConnection
+ * Description: Drives one client's state machine after epoll reports it ready or its results come back from the cipher
+ * threads. Parses what is buffered, flushes any reply and only reads more once the reply is out and the threads are not
+ * holding too many of its pairs, so a client that does not read its results can not make us buffer without limit
+ * Params: epoll file descriptor, connection struct, epoll event flags, 0 when called for results
+ * Returns: none
+ * Pre-conditions: connection is registered with epoll
+ * Post-conditions: connection has made as much progress as possible without blocking, or it has been closed
+ * **********************************************/
+void handleConnection(int epollFD, struct connection* conn, uint32_t events)
+{
+    int charsRead;
+    char* newBuffer;
+    uint64_t traced;
+
+    //Socket failed or the client is gone both ways, nothing more can be sent
+    if(events & (EPOLLERR | EPOLLHUP))
+    {
+        closeConnection(epollFD, conn);
+        return;
+    }
+
+    while(1)
+    {
+        //Work through whatever has been received, the parser picks up wherever it left off
+        if(parseConnection(conn) < 0)
+        {
+            closeConnection(epollFD, conn);
+            return;
+        }
+
+        //Send whatever reply the parser queued up
+        if(conn->outLen > conn->outSent)
+        {
+            if(flushConnection(epollFD, conn) < 0)
+            {
+                return;
+            }
+        }
+
+        //Done reading, or waiting for the client to take the reply or the threads to catch up first
+        if(!wantsInput(conn))
+        {
+            //Files being answered go on as soon as their last results are out
+            if(conn->file.active && conn->state == CONN_READ_REQUEST && conn->outLen == conn->outSent && conn->pending < MAX_PENDING)
+            {
+                continue;
+            }
+            updateInterest(epollFD, conn);
+            return;
+        }
+
+        //Make room for the next chunk, up to the limit the parser set for this client
+        if(conn->inLen == conn->inSize)
+        {
+            if(conn->inSize >= conn->inLimit)
+            {
+                fprintf(stderr, "%s error: client message too large\n", otpProgramName);
+                closeConnection(epollFD, conn);
+                return;
+            }
+            conn->inSize = conn->inSize ? 2*conn->inSize : READ_CHUNK;
+            if(conn->inSize > conn->inLimit)
+            {
+                conn->inSize = conn->inLimit;
+            }
+            newBuffer = realloc(conn->in, conn->inSize);
+            if(newBuffer == NULL)
+            {
+                fprintf(stderr, "%s error: out of memory for client message\n", otpProgramName);
+                closeConnection(epollFD, conn);
+                return;
+            }
+            conn->in = newBuffer;
+        }
+
+        //Over a Unix domain socket descriptors may come along, they wait for the files message that claims them
+        traced = traceStart();
+        charsRead = recvFDs(conn->fd, &conn->in[conn->inLen], conn->inSize - conn->inLen, 0, conn->passed, &conn->numPassed);
+        //Only reads that brought something, not the last one of every wakeup that finds the socket empty
+        if(charsRead > 0)
+        {
+            traceEnd(TRACE_RECEIVE, traced, charsRead);
+        }
+        if(charsRead < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                updateInterest(epollFD, conn);
+                return;
+            }
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            closeConnection(epollFD, conn);
+            return;
+        }
+        //Client hung up before sending a whole message
+        if(charsRead == 0)
+        {
+            closeConnection(epollFD, conn);
+            return;
+        }
+        conn->inLen += charsRead;
+    }
+}
+
+/*************************************************
+ * Function: parseConnection
+ * Description: Advances the connection state machine over newly received bytes. Handles the identifier bit, then finds the
+ * '0' control character ending the plaintext and the key, scanning each byte only once, and queues the cipher text reply
+ * Params: connection struct
+ * Returns: 0 on success, -1 if the connection should be dropped
+ * Pre-conditions: in buffer holds inLen bytes received from the client
+ * Post-conditions: state, scan position and out buffer are updated
+ * **********************************************/
+int parseConnection(struct connection* conn)
+{
+    char *marker, *reply;
+    int textLen;
+    struct otpHeader header;
+
+    //Binary protocol hello, answer with our own and only keep talking if the operations match
+    if(conn->state == CONN_HANDSHAKE && conn->inLen > 0 && (unsigned char)conn->in[0] == OTP_MAGIC)
+    {
+        if(conn->inLen < OTP_HEADER_SIZE)
+        {
+            return 0;
+        }
+        reply = reserveOutput(conn, OTP_HEADER_SIZE);
+        if(reply == NULL)
+        {
+            return -1;
+        }
+        if(decodeHeader((unsigned char*)conn->in, &header) == 0 && header.type == OTP_MSG_HELLO)
+        {
+            encodeHeader((unsigned char*)reply, OTP_MSG_HELLO, answerOp(header.flags), 0, 0);
+            if(answerOp(header.flags) == header.flags)
+            {
+                conn->op = header.flags;
+                conn->state = CONN_READ_REQUEST;
+                conn->persistent = 1;
+            }
+        }
+        else
+        {
+            encodeHeader((unsigned char*)reply, OTP_MSG_HELLO, answerOp(0), 0, 0);
+        }
+        if(conn->op == 0)
+        {
+            metricsReject();
+            conn->state = CONN_CLOSING;
+        }
+        metricsStart(&conn->started);
+
+        //Bytes after the hello belong to the request
+        conn->inLen -= OTP_HEADER_SIZE;
+        memmove(conn->in, &conn->in[OTP_HEADER_SIZE], conn->inLen);
+    }
+
+    //Identifier bit, reply with ours and only keep talking to the right client
+    if(conn->state == CONN_HANDSHAKE)
+    {
+        if(conn->inLen < 1)
+        {
+            return 0;
+        }
+        reply = reserveOutput(conn, 1);
+        if(reply == NULL)
+        {
+            return -1;
+        }
+        reply[0] = legacyIdentifier(answerOp(legacyOp(conn->in[0])));
+        if(answerOp(legacyOp(conn->in[0])) == legacyOp(conn->in[0]))
+        {
+            conn->op = legacyOp(conn->in[0]);
+            conn->state = CONN_READ_TEXT;
+        }
+        else
+        {
+            metricsReject();
+            conn->state = CONN_CLOSING;
+        }
+        metricsStart(&conn->started);
+
+        //Bytes after the identifier bit belong to the plaintext
+        conn->inLen--;
+        memmove(conn->in, &conn->in[1], conn->inLen);
+        conn->scanPos = 0;
+    }
+
+    if(conn->state == CONN_READ_REQUEST)
+    {
+        return parseRequest(conn);
+    }
+
+    //Look for the control character that ends the plaintext, only in bytes not scanned yet
+    if(conn->state == CONN_READ_TEXT)
+    {
+        marker = memchr(&conn->in[conn->scanPos], '0', conn->inLen - conn->scanPos);
+        if(marker == NULL)
+        {
+            conn->scanPos = conn->inLen;
+            return (conn->inLen > MAX_PAYLOAD) ? -1 : 0;
+        }
+        conn->textEnd = marker - conn->in;
+        conn->scanPos = conn->textEnd + 1;
+        conn->state = CONN_READ_KEY;
+    }
+
+    //Same for the key which starts right after the plaintext control character
+    if(conn->state == CONN_READ_KEY)
+    {
+        marker = memchr(&conn->in[conn->scanPos], '0', conn->inLen - conn->scanPos);
+        if(marker == NULL)
+        {
+            conn->scanPos = conn->inLen;
+            return (conn->inLen - conn->textEnd - 1 > MAX_PAYLOAD) ? -1 : 0;
+        }
+
+        //Key must cover the whole plaintext
+        textLen = conn->textEnd;
+        if((marker - conn->in) - (conn->textEnd + 1) < textLen)
+        {
+            fprintf(stderr, "%s error: key shorter than plaintext\n", otpProgramName);
+            return -1;
+        }
+
+        //Cipher text plus its control character
+        reply = reserveOutput(conn, textLen + 1);
+        if(reply == NULL)
+        {
+            return -1;
+        }
+        timedCipher(conn->in, &conn->in[conn->textEnd + 1], reply, textLen, conn->op);
+        reply[textLen] = '0';
+        conn->characters = textLen;
+        conn->state = CONN_WRITING;
+    }
+
+    return 0;
+}
+
+/*************************************************
+ * Function: parseRequest
+ * Description: Binary protocol requests, streams of text and key chunk pairs tagged with their request's id. Waits for the
+ * text header, its payload, the key header and its payload. The text header gives the exact size of the pair so the in buffer
+ * is sized once and oversized chunks are turned away unread. Each finished pair goes to the cipher threads, or is transformed
+ * and queued right away when there are none, then dropped from the buffer. A files message instead has its pairs read from
+ * the passed files, one at a time while the client keeps up. Pairs of different requests may be interleaved, a request is
+ * counted in the metrics once its last pair is answered
+ * Params: connection struct
+ * Returns: 0 on success, -1 if the connection should be dropped
+ * Pre-conditions: hello has been handled, in buffer starts at a text header
+ * Post-conditions: results, tasks or an error message are queued for every whole pair received
+ * **********************************************/
+int parseRequest(struct connection* conn)
+{
+    struct otpHeader header;
+    char* reply;
+    uint32_t textLen, id;
+    int needed, more;
+    char* newBuffer;
+
+    struct cipherTask* task;
+
+    while(conn->state == CONN_READ_REQUEST && conn->pending < MAX_PENDING)
+    {
+        //Files are answered before anything after them is read, and only while their results do not pile up
+        if(conn->file.active)
+        {
+            if(conn->outLen > conn->outSent)
+            {
+                return 0;
+            }
+            if(nextFilePair(conn) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if(conn->inLen < OTP_HEADER_SIZE)
+        {
+            return 0;
+        }
+        if(decodeHeader((unsigned char*)conn->in, &header) < 0 ||
+           (header.type != OTP_MSG_TEXT && header.type != OTP_MSG_FILES && header.type != OTP_MSG_RING))
+        {
+            return -1;
+        }
+        if(header.type == OTP_MSG_RING)
+        {
+            return startRing(conn, &header);
+        }
+        textLen = header.length;
+        more = header.flags & OTP_FLAG_MORE;
+        id = header.id;
+        //Reject before reading any of it
+        if(findRequest(&conn->requests, id) == NULL)
+        {
+            conn->state = CONN_CLOSING;
+            return queueError(conn, id, "too many open requests");
+        }
+        if(header.type == OTP_MSG_FILES)
+        {
+            if(parseFiles(conn, &header) < 0)
+            {
+                return -1;
+            }
+            //Still waiting for the rest of it
+            if(!conn->file.active)
+            {
+                return 0;
+            }
+            continue;
+        }
+        if(textLen > MAX_PAYLOAD)
+        {
+            conn->state = CONN_CLOSING;
+            return queueError(conn, id, "message too large");
+        }
+
+        //Now the size of this pair is known, grow the buffer to fit it
+        needed = 2*OTP_HEADER_SIZE + 2*textLen;
+        if(conn->inLimit < needed)
+        {
+            conn->inLimit = needed;
+        }
+        if(conn->inSize < needed)
+        {
+            newBuffer = realloc(conn->in, needed);
+            if(newBuffer == NULL)
+            {
+                return -1;
+            }
+            conn->in = newBuffer;
+            conn->inSize = needed;
+        }
+
+        //Key header follows the plaintext and must cover exactly as many characters of the same request
+        if((uint32_t)conn->inLen < OTP_HEADER_SIZE + textLen + OTP_HEADER_SIZE)
+        {
+            return 0;
+        }
+        if(decodeHeader((unsigned char*)&conn->in[OTP_HEADER_SIZE + textLen], &header) < 0 || header.type != OTP_MSG_KEY ||
+           header.length != textLen || header.id != id)
+        {
+            return -1;
+        }
+        if(conn->inLen < needed)
+        {
+            return 0;
+        }
+
+        if(cipherThreads > 0)
+        {
+            task = newTask(conn, needed);
+            if(task == NULL)
+            {
+                return -1;
+            }
+            memcpy(task->data, conn->in, needed);
+            queueTask(task);
+        }
+        else
+        {
+            reply = reserveOutput(conn, OTP_HEADER_SIZE + textLen);
+            if(reply == NULL)
+            {
+                return -1;
+            }
+            encodeHeader((unsigned char*)reply, OTP_MSG_RESULT, more, textLen, id);
+            timedCipher(&conn->in[OTP_HEADER_SIZE], &conn->in[2*OTP_HEADER_SIZE + textLen], &reply[OTP_HEADER_SIZE], textLen, conn->op);
+            finishPair(&conn->requests, id, textLen, more, conn->op);
+        }
+
+        //Drop the pair, anything after it is the start of the next one
+        conn->inLen -= needed;
+        memmove(conn->in, &conn->in[needed], conn->inLen);
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: parseFiles
+ * Description: Starts answering a files message once all of it has arrived, it claims the first two descriptors passed
+ * on the connection as its plaintext and key
+ * Params: connection struct, its text header
+ * Returns: 0 on success, -1 if the connection should be dropped
+ * Pre-conditions: in buffer starts with the files message, its request is open
+ * Post-conditions: files are being answered and the message is dropped from the buffer, or an error is queued
+ * **********************************************/
+int parseFiles(struct connection* conn, struct otpHeader* header)
+{
+    if(header->length != OTP_FILES_SIZE)
+    {
+        return -1;
+    }
+    if(conn->inLen < OTP_HEADER_SIZE + OTP_FILES_SIZE)
+    {
+        return 0;
+    }
+    if(conn->numPassed < 2 || decodeFiles((unsigned char*)&conn->in[OTP_HEADER_SIZE], &conn->file.textLen, &conn->file.keyOffset) < 0)
+    {
+        conn->state = CONN_CLOSING;
+        return queueError(conn, header->id, "files message without its plaintext and key");
+    }
+    conn->file.active = 1;
+    conn->file.id = header->id;
+    conn->file.textFD = conn->passed[0];
+    conn->file.keyFD = conn->passed[1];
+    conn->file.offset = 0;
+    conn->numPassed -= 2;
+    memmove(conn->passed, &conn->passed[2], conn->numPassed * sizeof(int));
+
+    conn->inLen -= OTP_HEADER_SIZE + OTP_FILES_SIZE;
+    memmove(conn->in, &conn->in[OTP_HEADER_SIZE + OTP_FILES_SIZE], conn->inLen);
+    return 0;
+}
+
+/*************************************************
+ * Function: startRing
+ * Description: Hands a connection that asked for a shared memory ring to a thread that serves the ring, waiting on the ring
+ * would hold up every other client of the event loop. The thread gets its own copy of the socket and the ring's descriptor
+ * Params: connection struct, header of the ring message
+ * Returns: -1 once the thread has the ring, the event loop drops the connection then, or 0 if an error was queued
+ * Pre-conditions: in buffer starts with the ring message
+ * Post-conditions: the passed descriptor belongs to the thread or an error is queued
+ * **********************************************/
+int startRing(struct connection* conn, struct otpHeader* header)
+{
+    struct ringSession* session;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int started;
+
+    //The ring takes over the whole connection, nothing else may be on its way
+    if(header->length != 0 || conn->numPassed != 1 || conn->inLen != OTP_HEADER_SIZE || conn->pending > 0 ||
+       conn->requests.count > 0 || conn->file.active)
+    {
+        conn->state = CONN_CLOSING;
+        return queueError(conn, header->id, "ring message without its ring");
+    }
+    session = malloc(sizeof(struct ringSession));
+    if(session == NULL)
+    {
+        return -1;
+    }
+    session->socketFD = dup(conn->fd);
+    session->ringFD = conn->passed[0];
+    session->op = conn->op;
+    session->id = header->id;
+    conn->numPassed = 0;
+
+    started = 0;
+    if(session->socketFD >= 0 && pthread_attr_init(&attr) == 0)
+    {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = (startThread(&thread, &attr, ringThread, session) == 0);
+        pthread_attr_destroy(&attr);
+    }
+    if(!started)
+    {
+        fprintf(stderr, "%s error: starting ring thread\n", otpProgramName);
+        closeFDs(&session->socketFD, 1);
+        closeFDs(&session->ringFD, 1);
+        free(session);
+    }
+    return -1;
+}
+
+/*************************************************
+ * Function: ringThread
+ * Description: Serves one shared memory ring, then closes its copy of the client's socket
+ * Params: ring session, freed here
+ * Returns: NULL
+ * Pre-conditions: started detached by startRing
+ * Post-conditions: the thread is done with the client
+ * **********************************************/
+void* ringThread(void* arg)
+{
+    struct ringSession* session = arg;
+
+    serveRing(session->socketFD, session->op, session->ringFD, session->id);
+    close(session->socketFD);
+    free(session);
+    return NULL;
+}
+
+/*************************************************
+ * Function: nextFilePair
+ * Description: Reads the next chunk pair of the files being answered into a task, then hands it to the cipher threads or
+ * transforms and queues it right away when there are none
+ * Params: connection struct
+ * Returns: 0 on success, -1 if the connection should be dropped
+ * Pre-conditions: a files message is active
+ * Post-conditions: the pair is on its way, the files are closed after the last one
+ * **********************************************/
+int nextFilePair(struct connection* conn)
+{
+    struct fileRequest* file = &conn->file;
+    struct cipherTask* task;
+    int len, more;
+
+    len = (file->textLen - file->offset > STREAM_CHUNK) ? STREAM_CHUNK : file->textLen - file->offset;
+    more = (file->offset + len < file->textLen);
+    task = newTask(conn, 2*OTP_HEADER_SIZE + 2*len);
+    if(task == NULL)
+    {
+        return -1;
+    }
+    encodeHeader((unsigned char*)task->data, OTP_MSG_TEXT, more ? OTP_FLAG_MORE : 0, len, file->id);
+    if(readFilePair(file->textFD, file->keyFD, file->offset, file->keyOffset, len, &task->data[OTP_HEADER_SIZE],
+                    &task->data[2*OTP_HEADER_SIZE + len]) < 0)
+    {
+        free(task);
+        conn->state = CONN_CLOSING;
+        return queueError(conn, file->id, "could not read the plaintext and key");
+    }
+    file->offset += len;
+    if(!more)
+    {
+        closeFDs(&file->textFD, 1);
+        closeFDs(&file->keyFD, 1);
+        file->active = 0;
+    }
+
+    if(cipherThreads > 0)
+    {
+        queueTask(task);
+        return 0;
+    }
+    runTask(task);
+    more = queueResult(conn, task);
+    free(task);
+    return more;
+}
+
+/*************************************************
+ * Function: queueError
+ * Description: Queues a binary protocol error message for a client
+ * Params: connection struct, id of the request that failed, error text
+ * Returns: 0 on success, -1 if out of memory
+ * Pre-conditions: none
+ * Post-conditions: error message is at the end of the out buffer
+ * **********************************************/
+int queueError(struct connection* conn, uint32_t id, const char* msg)
+{
+    char* reply;
+
+    reply = reserveOutput(conn, OTP_HEADER_SIZE + strlen(msg));
+    if(reply == NULL)
+    {
+        return -1;
+    }
+    encodeHeader((unsigned char*)reply, OTP_MSG_ERROR, 0, strlen(msg), id);
+    memcpy(&reply[OTP_HEADER_SIZE], msg, strlen(msg));
+    return 0;
+}
+
+/*************************************************
+ * Function: reserveOutput
+ * Description: Makes room for len more bytes at the end of the reply queued for a client
+ * Params: connection struct, number of bytes
+ * Returns: address to write the bytes to, NULL if out of memory
+ * Pre-conditions: none
+ * Post-conditions: out buffer has grown by len bytes that the caller must fill
+ * **********************************************/
+char* reserveOutput(struct connection* conn, int len)
+{
+    char* newBuffer;
+
+    newBuffer = realloc(conn->out, conn->outLen + len);
+    if(newBuffer == NULL)
+    {
+        return NULL;
+    }
+    conn->out = newBuffer;
+    conn->outLen += len;
+    return &conn->out[conn->outLen - len];
+}
+
+/*************************************************
+ * Function: flushConnection
+ * Description: Sends as much of the queued reply as the socket takes, stops early if the socket fills up
+ * Params: epoll file descriptor, connection struct
+ * Returns: 0 if the connection is still open, -1 if it was closed
+ * Pre-conditions: out buffer holds a reply that is not fully sent
+ * Post-conditions: reply is sent and the connection is closed when it is done, or part of the reply is still queued
+ * **********************************************/
+int flushConnection(int epollFD, struct connection* conn)
+{
+    int charsWritten;
+    uint64_t traced;
+
+    while(conn->outSent < conn->outLen)
+    {
+        traced = traceStart();
+        charsWritten = send(conn->fd, &conn->out[conn->outSent], conn->outLen - conn->outSent, MSG_NOSIGNAL);
+        //A send that failed or found the socket full moved nothing, it is not a span
+        if(charsWritten > 0)
+        {
+            traceEnd(TRACE_SEND, traced, charsWritten);
+        }
+        metricsBytes(0, charsWritten);
+        if(charsWritten < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                //Socket is full, the caller waits for it to drain
+                return 0;
+            }
+            fprintf(stderr, "%s error: writing to socket\n", otpProgramName);
+            closeConnection(epollFD, conn);
+            return -1;
+        }
+        conn->outSent += charsWritten;
+    }
+
+    //Reply is out, either the transfer is done or there is more to read
+    if(conn->state == CONN_WRITING || conn->state == CONN_CLOSING)
+    {
+        conn->completed = (conn->state == CONN_WRITING);
+        closeConnection(epollFD, conn);
+        return -1;
+    }
+    conn->outLen = 0;
+    conn->outSent = 0;
+    return 0;
+}
+
+/*************************************************
+ * Function: updateInterest
+ * Description: Asks epoll for the events a client is waiting on, writable while part of a reply is queued and readable
+ * only while the client may send more. Left readable with nothing to read, level triggered epoll would wake us over and over
+ * Params: epoll file descriptor, connection struct
+ * Returns: none
+ * Pre-conditions: connection is registered with epoll
+ * Post-conditions: epoll reports the events the connection waits for
+ * **********************************************/
+void updateInterest(int epollFD, struct connection* conn)
+{
+    uint32_t wanted;
+    struct epoll_event event;
+
+    wanted = 0;
+    if(conn->outLen > conn->outSent)
+    {
+        wanted = EPOLLOUT;
+    }
+    else if(wantsInput(conn))
+    {
+        wanted = EPOLLIN;
+    }
+    if(wanted != conn->interest)
+    {
+        memset(&event, '\0', sizeof(event));
+        event.events = wanted;
+        event.data.ptr = conn;
+        epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->interest = wanted;
+    }
+}
+
+/*************************************************
+ * Function: wantsInput
+ * Description: Checks if more bytes should be read from a client. Not while a reply is queued, the threads hold too many of
+ * its pairs or files are being answered, so a client can not make us buffer without limit
+ * Params: connection struct
+ * Returns: nonzero if the client may send more
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int wantsInput(struct connection* conn)
+{
+    return conn->state != CONN_WRITING && conn->state != CONN_CLOSING && conn->outLen == conn->outSent &&
+           conn->pending < MAX_PENDING && !conn->file.active;
+}
+
+/*************************************************
+ * Function: closeConnection
+ * Description: Removes a client from epoll, closes its socket and frees its buffers. A legacy client that got past the handshake
+ * is counted as a request if its whole answer went out and as an error otherwise, a binary protocol client counts an error
+ * for every request it was in the middle of
+ * Params: epoll file descriptor, connection struct
+ * Returns: none
+ * Pre-conditions: connection was allocated by acceptClients
+ * Post-conditions: connection must not be used again, the struct is freed now or when its last task comes back
+ * **********************************************/
+void closeConnection(int epollFD, struct connection* conn)
+{
+    if(conn->persistent)
+    {
+        failRequests(&conn->requests, conn->op);
+    }
+    else if(conn->op != 0)
+    {
+        metricsRecord(conn->op, conn->completed ? conn->characters : -1, &conn->started);
+    }
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    metricsConnection(-1);
+    closeFDs(conn->passed, conn->numPassed);
+    closeFDs(&conn->file.textFD, 1);
+    closeFDs(&conn->file.keyFD, 1);
+    free(conn->in);
+    free(conn->out);
+    conn->closed = 1;
+    if(conn->pending == 0)
+    {
+        free(conn);
+    }
+}
+
+/*************************************************
+ * Function: acceptConnection
+ * Description: Checks to see if the client is actually the correct client trying to connect by communicating identification bits to it
+ * Params: address of struct that holds size of client info, address for clientaddress struct, 
+ * address to listening file descriptor address to established connection file descriptor, address of protocol version,
+ * address of the operation the client asked for
+ * Returns: none
+ * Pre-conditions: Server has a listening socket
+ * Post-conditions: Valid connection has been made and the file descriptors and structs passed in have been changed accordingly,
+ * protocol is OTP_VERSION if the client opened with a binary protocol hello or 1 for the legacy identifier bit
+ * **********************************************/
+void acceptConnection(socklen_t* sizeOfClientInfo, struct sockaddr_storage* clientAddress, int* listenSocketFD, int* establishedConnectionFD, int* protocol, int* op)
+{
+    int charsWritten, charsRead;
+    char buffer[1], identifier;
+    uint64_t traced = 0;
+    struct timeval timeout;
+    memset(buffer, '\0', 1);
+
+    //Infinite loop until a valid connection has been made
+    while(1)
+    {
+        //Get size of client info
+        *sizeOfClientInfo = sizeof(*clientAddress);
+        //Accept a connection and fill the established connection file descriptor
+        *establishedConnectionFD = accept(*listenSocketFD, (struct sockaddr *)clientAddress, sizeOfClientInfo);
+        //Interrupted by SIGUSR2, write the trace while nobody is waiting on us
+        if(*establishedConnectionFD < 0 && errno == EINTR)
+        {
+            traceCheck();
+        }
+        //Check for basic errors on accept
+        else if(*establishedConnectionFD < 0)
+        {
+            close(*establishedConnectionFD);
+            fprintf(stderr, "%s error: on accept\n", otpProgramName);
+        }
+        //If no errors
+        else
+        {
+            metricsAccept();
+            traced = traceStart();
+            //A client that stops sending or stops reading its results, or keeps a binary protocol connection open and
+            //idle, would hold this worker for good, a receive or send that waits longer than this fails so the worker
+            //can move on
+            timeout.tv_sec = IDLE_TIMEOUT_SECONDS;
+            timeout.tv_usec = 0;
+            setsockopt(*establishedConnectionFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(*establishedConnectionFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            //Recieve message of indicator bit from client, again if the trace signal cut in
+            do
+            {
+                charsRead = recv(*establishedConnectionFD, buffer, sizeof(buffer), 0);
+            } while(charsRead < 0 && errno == EINTR);
+            metricsBytes(charsRead, 0);
+            //Check for basic recv errors
+            if(charsRead < 0)
+            {
+                close(*establishedConnectionFD);
+                fprintf(stderr, "%s error: recieving identifier bit from client\n", otpProgramName);
+            }
+            else if(charsRead == 0)
+            {
+                close(*establishedConnectionFD);
+                fprintf(stderr, "%s error: charsRead 0 when recieving identifier bit from client", otpProgramName);
+            }
+            //A header instead of an identifier bit means the client speaks the binary protocol
+            else if((unsigned char)buffer[0] == OTP_MAGIC)
+            {
+                *op = acceptHello(*establishedConnectionFD);
+                if(*op > 0)
+                {
+                    *protocol = OTP_VERSION;
+                    break;
+                }
+                close(*establishedConnectionFD);
+            }
+            //If no errors
+            else
+            {
+                //Send the server indicator bit to the client, the same one if we run what it asked for
+                identifier = legacyIdentifier(answerOp(legacyOp(buffer[0])));
+                do
+                {
+                    charsWritten = send(*establishedConnectionFD, &identifier, 1, 0);
+                } while(charsWritten < 0 && errno == EINTR);
+                metricsBytes(0, charsWritten);
+                //Check for basic send errors
+                //The descriptor is closed, go back to accept instead of handing it to the caller
+                if(charsWritten < 0)
+                {
+                    close(*establishedConnectionFD);
+                    fprintf(stderr, "%s error: sending identifier bit to client\n", otpProgramName);
+                    continue;
+                }
+                else if(charsWritten == 0)
+                {
+                    close(*establishedConnectionFD);
+                    fprintf(stderr, "%s error: charsWritten 0 when sending identifier bit to client\n", otpProgramName);
+                    continue;
+                }
+        
+                //Check identifier bit recieved
+                if(buffer[0] == identifier)
+                {
+                    //If a good bit was recieved, get out of the infinite loop
+                    *op = legacyOp(buffer[0]);
+                    *protocol = 1;
+                    break;
+                }
+                //Wrong client, hang up so the worker does not leak the descriptor
+                metricsReject();
+                close(*establishedConnectionFD);
+          }
+        }
+        
+    }
+    traceEnd(TRACE_HANDSHAKE, traced, 0);
+
+}
+
+/*************************************************
+ * Function: acceptHello
+ * Description: Finishes reading a binary protocol hello whose magic byte was already read and answers with our own hello
+ * Params: established connection file descriptor
+ * Returns: operation the client asked for if this daemon runs it, -1 otherwise
+ * Pre-conditions: first byte of the hello has been received
+ * Post-conditions: our hello has been sent
+ * **********************************************/
+int acceptHello(int establishedConnectionFD)
+{
+    unsigned char buffer[OTP_HEADER_SIZE];
+    struct otpHeader header;
+
+    buffer[0] = OTP_MAGIC;
+    if(recvAll(establishedConnectionFD, (char*)&buffer[1], OTP_HEADER_SIZE - 1) < 0 || decodeHeader(buffer, &header) < 0)
+    {
+        fprintf(stderr, "%s error: recieving hello from client\n", otpProgramName);
+        return -1;
+    }
+    //Tell the client what we are, it reports the mismatch if there is one
+    if(sendHeader(establishedConnectionFD, OTP_MSG_HELLO, answerOp(header.flags), 0, 0) < 0)
+    {
+        fprintf(stderr, "%s error: sending hello to client\n", otpProgramName);
+        return -1;
+    }
+    if(header.type != OTP_MSG_HELLO || header.flags != answerOp(header.flags))
+    {
+        metricsReject();
+        return -1;
+    }
+    return header.flags;
+}
+
+/*************************************************
+ * Function: getClientMessage
+ * Description: Gets the plaintext file string and the key string from the client and puts it into buffers then calls an encrypt message function
+ * Params: address of established connection file descriptor, operation to run
+ * Returns: number of characters transformed, -1 on error
+ * Pre-conditions: established connection file descriptor is open and valid
+ * Post-conditions: plaintext file string and key file string have been stored into buffers and put into the encryption function
+ * **********************************************/
+long getClientMessage(int* establishedConnectionFD, int op)
+{
+    //Buffers grow as the message arrives
+    char *fileMessage = NULL, *keyMessage = NULL;
+    int fileLen, keyLen, fileSize = 0, keySize = 0;
+    long characters = -1;
+    uint64_t traced;
+    struct recvBuffer rb;
+
+    rb.fd = *establishedConnectionFD;
+    rb.start = 0;
+    rb.end = 0;
+
+    //Get the plaintext string then the key string, each ends with the control character '0'
+    traced = traceStart();
+    fileLen = recvUntil(&rb, &fileMessage, &fileSize, '0');
+    //No key is coming once the plaintext failed, waiting for one would only sit out the idle timeout again
+    keyLen = (fileLen < 0) ? -1 : recvUntil(&rb, &keyMessage, &keySize, '0');
+    traceEnd(TRACE_RECEIVE, traced, (fileLen < 0 || keyLen < 0) ? 0 : fileLen + keyLen);
+    if(fileLen < 0 || keyLen < 0)
+    {
+        fprintf(stderr, "%s error: reading message from client\n", otpProgramName);
+    }
+    //Key must cover the whole plaintext, the legacy protocol has no error message so the client just sees the connection close
+    else if(keyLen < fileLen)
+    {
+        fprintf(stderr, "%s error: key shorter than plaintext\n", otpProgramName);
+    }
+    else
+    {
+        //Null terminate in place of the 0
+        fileMessage[fileLen] = '\0';
+        keyMessage[keyLen] = '\0';
+        if(cipherMessage(fileMessage, keyMessage, establishedConnectionFD, op) == 0)
+        {
+            characters = fileLen;
+        }
+    }
+
+    free(fileMessage);
+    free(keyMessage);
+    return characters;
+}
+
+/*************************************************
+ * Function: getClientPair
+ * Description: Binary protocol version of getClientMessage. Requests are streams of text and key chunk pairs, each pair is
+ * received straight into place, transformed and sent back under its request's id before the next one is read, so memory use
+ * stays at one chunk no matter how large the messages are. Pairs of different requests may come in any order, a files
+ * message is handed to getClientFiles and a ring message to serveRing
+ * Params: address of established connection file descriptor, operation to run, request table of the connection,
+ * address of the buffer pairs are received into and of its size, both kept between calls
+ * Returns: 0 if the pair was answered, -1 otherwise
+ * Pre-conditions: hello has been exchanged on the established connection
+ * Post-conditions: the result or an error message has been sent to the client, its request is updated
+ * **********************************************/
+int getClientPair(int* establishedConnectionFD, int op, struct requestTable* requests, char** buffer, uint32_t* bufferSize)
+{
+    struct otpHeader header;
+    char *fileMessage, *keyMessage, *cipherText, *newBuffer;
+    uint32_t len, id;
+    uint64_t traced;
+    int more, fds[MAX_PASSED_FDS], numFDs = 0;
+
+    if(recvHeaderFDs(*establishedConnectionFD, &header, fds, &numFDs) < 0 ||
+       (header.type != OTP_MSG_TEXT && header.type != OTP_MSG_FILES && header.type != OTP_MSG_RING))
+    {
+        closeFDs(fds, numFDs);
+        fprintf(stderr, "%s error: bad request from client\n", otpProgramName);
+        return -1;
+    }
+    id = header.id;
+    //Every request after it goes through the ring, the connection ends with the ring
+    if(header.type == OTP_MSG_RING)
+    {
+        if(header.length != 0 || numFDs != 1 || requests->count > 0)
+        {
+            closeFDs(fds, numFDs);
+            sendError(*establishedConnectionFD, id, "ring message without its ring");
+            return -1;
+        }
+        serveRing(*establishedConnectionFD, op, fds[0], id);
+        return -1;
+    }
+    if(findRequest(requests, id) == NULL)
+    {
+        closeFDs(fds, numFDs);
+        sendError(*establishedConnectionFD, id, "too many open requests");
+        return -1;
+    }
+    if(header.type == OTP_MSG_FILES)
+    {
+        return getClientFiles(establishedConnectionFD, op, requests, buffer, bufferSize, &header, fds, numFDs);
+    }
+    //Only a files message brings descriptors
+    closeFDs(fds, numFDs);
+
+    //Turn away oversized chunks before reading any of them
+    if(header.length > MAX_PAYLOAD)
+    {
+        sendError(*establishedConnectionFD, id, "message too large");
+        return -1;
+    }
+    len = header.length;
+    more = header.flags & OTP_FLAG_MORE;
+
+    //One allocation for the plaintext, key and the result behind its header, only grown when a bigger chunk comes in
+    if(*buffer == NULL || 3*len > *bufferSize)
+    {
+        newBuffer = realloc(*buffer, 3*len + OTP_HEADER_SIZE + 1);
+        if(newBuffer == NULL)
+        {
+            sendError(*establishedConnectionFD, id, "out of memory");
+            return -1;
+        }
+        *buffer = newBuffer;
+        *bufferSize = 3*len;
+    }
+    fileMessage = *buffer;
+    keyMessage = &fileMessage[len];
+    cipherText = &fileMessage[2*len + OTP_HEADER_SIZE];
+
+    //The header came in when the client sent it, the span is the rest of the pair
+    traced = traceStart();
+    if(recvAll(*establishedConnectionFD, fileMessage, len) < 0 || recvHeader(*establishedConnectionFD, &header) < 0 ||
+       header.type != OTP_MSG_KEY || header.length != len || header.id != id || recvAll(*establishedConnectionFD, keyMessage, len) < 0)
+    {
+        fprintf(stderr, "%s error: bad request from client\n", otpProgramName);
+        return -1;
+    }
+
+    traceEnd(TRACE_RECEIVE, traced, 2*len + OTP_HEADER_SIZE);
+
+    //Header and result go out in one write so they share a packet
+    timedCipher(fileMessage, keyMessage, cipherText, len, op);
+    encodeHeader((unsigned char*)&cipherText[-OTP_HEADER_SIZE], OTP_MSG_RESULT, more, len, id);
+    traced = traceStart();
+    if(sendAll(*establishedConnectionFD, &cipherText[-OTP_HEADER_SIZE], OTP_HEADER_SIZE + len) < 0)
+    {
+        fprintf(stderr, "%s error: writing to socket\n", otpProgramName);
+        return -1;
+    }
+    traceEnd(TRACE_SEND, traced, OTP_HEADER_SIZE + len);
+    finishPair(requests, id, len, more, op);
+    return 0;
+}
+
+/*************************************************
+ * Function: getClientFiles
+ * Description: Answers a files message, the plaintext and key are read straight from the files the client passed instead of
+ * coming through the socket. Results go back in chunks like for a stream of pairs
+ * Params: address of established connection file descriptor, operation to run, request table of the connection,
+ * address of the pair buffer and of its size, header of the files message, passed descriptors and their count
+ * Returns: 0 if every result was sent, -1 otherwise
+ * Pre-conditions: the header has been received and its request is open
+ * Post-conditions: results or an error message have been sent, the passed descriptors are closed
+ * **********************************************/
+int getClientFiles(int* establishedConnectionFD, int op, struct requestTable* requests, char** buffer, uint32_t* bufferSize,
+                   struct otpHeader* header, int* fds, int numFDs)
+{
+    unsigned char payload[OTP_FILES_SIZE];
+    char *fileMessage, *cipherText, *newBuffer;
+    long textLen;
+    off_t offset, keyOffset;
+    int len, more, result;
+
+    result = -1;
+    if(header->length != OTP_FILES_SIZE || recvAll(*establishedConnectionFD, (char*)payload, OTP_FILES_SIZE) < 0)
+    {
+        fprintf(stderr, "%s error: bad request from client\n", otpProgramName);
+    }
+    else if(numFDs != 2 || decodeFiles(payload, &textLen, &keyOffset) < 0)
+    {
+        sendError(*establishedConnectionFD, header->id, "files message without its plaintext and key");
+    }
+    else if(*buffer == NULL || 3*STREAM_CHUNK > *bufferSize)
+    {
+        newBuffer = realloc(*buffer, 3*STREAM_CHUNK + OTP_HEADER_SIZE + 1);
+        if(newBuffer == NULL)
+        {
+            sendError(*establishedConnectionFD, header->id, "out of memory");
+        }
+        else
+        {
+            *buffer = newBuffer;
+            *bufferSize = 3*STREAM_CHUNK;
+            result = 0;
+        }
+    }
+    else
+    {
+        result = 0;
+    }
+
+    //Same layout as a pair from the socket, plaintext, key, then the result behind its header
+    for(offset=0;result==0;offset+=len)
+    {
+        len = (textLen - offset > STREAM_CHUNK) ? STREAM_CHUNK : textLen - offset;
+        more = (offset + len < textLen);
+        fileMessage = *buffer;
+        cipherText = &fileMessage[2*len + OTP_HEADER_SIZE];
+        if(readFilePair(fds[0], fds[1], offset, keyOffset, len, fileMessage, &fileMessage[len]) < 0)
+        {
+            sendError(*establishedConnectionFD, header->id, "could not read the plaintext and key");
+            result = -1;
+            break;
+        }
+        timedCipher(fileMessage, &fileMessage[len], cipherText, len, op);
+        encodeHeader((unsigned char*)&cipherText[-OTP_HEADER_SIZE], OTP_MSG_RESULT, more, len, header->id);
+        if(sendAll(*establishedConnectionFD, &cipherText[-OTP_HEADER_SIZE], OTP_HEADER_SIZE + len) < 0)
+        {
+            fprintf(stderr, "%s error: writing to socket\n", otpProgramName);
+            result = -1;
+            break;
+        }
+        finishPair(requests, header->id, len, more, op);
+        if(!more)
+        {
+            break;
+        }
+    }
+
+    closeFDs(fds, numFDs);
+    return result;
+}
+
+/*************************************************
+ * Function: decodeFiles
+ * Description: Unpacks the payload of a files message
+ * Params: payload of OTP_FILES_SIZE bytes, address of the plaintext length, address of the key offset
+ * Returns: 0 on success, -1 if either is negative
+ * Pre-conditions: none
+ * Post-conditions: length and offset are filled
+ * **********************************************/
+int decodeFiles(const unsigned char* payload, long* textLen, off_t* keyOffset)
+{
+    int64_t values[2];
+    int i, j;
+
+    for(i=0;i<2;i++)
+    {
+        values[i] = 0;
+        for(j=0;j<8;j++)
+        {
+            values[i] = (values[i] << 8) | payload[8*i + j];
+        }
+    }
+    *textLen = values[0];
+    *keyOffset = values[1];
+    return (values[0] < 0 || values[1] < 0) ? -1 : 0;
+}
+
+/*************************************************
+ * Function: closeFDs
+ * Description: Closes passed descriptors that are still open and marks them closed
+ * Params: array of descriptors, number of them
+ * Returns: none
+ * Pre-conditions: closed entries are -1
+ * Post-conditions: every entry is -1
+ * **********************************************/
+void closeFDs(int* fds, int numFDs)
+{
+    int i;
+
+    for(i=0;i<numFDs;i++)
+    {
+        if(fds[i] >= 0)
+        {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+/*************************************************
+ * Function: serveRing
+ * Description: Answers chunk pairs from a shared memory ring until the client closes it. Each filled slot is checked like a
+ * pair from the socket, transformed in place and handed back, while both sides keep up neither makes a system call
+ * Params: socket the ring came over, operation to run, descriptor of the ring, id of the ring message
+ * Returns: 0 if the client closed the ring, -1 if it was bad or the client went away
+ * Pre-conditions: the ring message has been received, its descriptor is the only one that came with it
+ * Post-conditions: ring descriptor is closed and the ring unmapped, requests still open are recorded as errors
+ * **********************************************/
+int serveRing(int socketFD, int op, int ringFD, uint32_t id)
+{
+    struct otpRing* ring;
+    struct ringSlot* slot;
+    struct otpHeader header;
+    struct requestTable requests;
+    const char* problem;
+    uint32_t len;
+    int i, state, more;
+
+    ring = ringMap(ringFD);
+    close(ringFD);
+    if(ring == NULL)
+    {
+        sendError(socketFD, id, "bad shared memory ring");
+        return -1;
+    }
+    if(sendHeader(socketFD, OTP_MSG_RING, 0, 0, id) < 0)
+    {
+        ringUnmap(ring);
+        return -1;
+    }
+
+    requests.count = 0;
+    problem = NULL;
+    state = RING_FREE;
+    for(i=0;problem==NULL;i=(i+1)%RING_SLOTS)
+    {
+        slot = &ring->slot[i];
+        //The client may not have taken the result left here last time round yet
+        state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        while(state == RING_FREE || state == RING_DONE)
+        {
+            state = ringWait(&slot->state, state, &ring->daemonWaiting, socketFD);
+        }
+        if(state != RING_FILLED)
+        {
+            break;
+        }
+
+        //The client can still write to the slot, lengths are read once and checked before anything is used
+        id = 0;
+        if(decodeHeader((unsigned char*)slot->data, &header) < 0 || header.type != OTP_MSG_TEXT || header.length > STREAM_CHUNK)
+        {
+            problem = "bad request in shared memory ring";
+        }
+        else
+        {
+            len = header.length;
+            more = header.flags & OTP_FLAG_MORE;
+            id = header.id;
+            if(decodeHeader((unsigned char*)&slot->data[OTP_HEADER_SIZE + len], &header) < 0 || header.type != OTP_MSG_KEY ||
+               header.length != len || header.id != id)
+            {
+                problem = "bad request in shared memory ring";
+            }
+            else if(findRequest(&requests, id) == NULL)
+            {
+                problem = "too many open requests";
+            }
+        }
+
+        //The result or the error goes where the text was
+        if(problem == NULL)
+        {
+            timedCipher(&slot->data[OTP_HEADER_SIZE], &slot->data[2*OTP_HEADER_SIZE + len], &slot->data[OTP_HEADER_SIZE], len, op);
+            encodeHeader((unsigned char*)slot->data, OTP_MSG_RESULT, more, len, id);
+            metricsBytes(2*OTP_HEADER_SIZE + 2*len, OTP_HEADER_SIZE + len);
+            finishPair(&requests, id, len, more, op);
+        }
+        else
+        {
+            encodeHeader((unsigned char*)slot->data, OTP_MSG_ERROR, 0, strlen(problem), id);
+            memcpy(&slot->data[OTP_HEADER_SIZE], problem, strlen(problem));
+        }
+        ringPost(&slot->state, RING_DONE, &ring->clientWaiting);
+    }
+
+    failRequests(&requests, op);
+    ringUnmap(ring);
+    return (state == RING_CLOSED) ? 0 : -1;
+}
+
+/*************************************************
+ * Function: sendError
+ * Description: Sends a binary protocol error message to the client
+ * Params: socket file descriptor, id of the request that failed, error text
+ * Returns: none
+ * Pre-conditions: socket is connected
+ * Post-conditions: error message has been sent if the socket allowed it
+ * **********************************************/
+void sendError(int socketFD, uint32_t id, const char* msg)
+{
+    if(sendHeader(socketFD, OTP_MSG_ERROR, 0, strlen(msg), id) < 0 || sendAll(socketFD, msg, strlen(msg)) < 0)
+    {
+        fprintf(stderr, "%s error: sending error to client\n", otpProgramName);
+    }
+}
+
+/*************************************************
+ * Function: cipherMessage
+ * Description: Uses the key to do a one time pad type encryption or decryption on the file message received
+ * Params: string file message, string key message, address of established connection file descriptor, operation to run
+ * Returns: 0 if the result was sent, -1 otherwise
+ * Pre-conditions: file message contains data, key message contains data, established connection file descriptor is open and valid
+ * Post-conditions: message is transformed and sent to the client
+ * **********************************************/
+int cipherMessage(char fileMessage[], char keyMessage[], int* establishedConnectionFD, int op)
+{
+    int len, result;
+    char* cipherText;
+    uint64_t traced;
+
+    //Cipher text buffer is the same size as the file message plus the control character
+    len = strlen(fileMessage);
+    cipherText = malloc(len + 1);
+    if(cipherText == NULL)
+    {
+        fprintf(stderr, "%s error: out of memory for cipher text\n", otpProgramName);
+        return -1;
+    }
+
+    timedCipher(fileMessage, keyMessage, cipherText, len, op);
+    //Add control character so the client knows where the message ends
+    cipherText[len] = '0';
+
+    //Send cipher text
+    traced = traceStart();
+    result = sendAll(*establishedConnectionFD, cipherText, len + 1);
+    traceEnd(TRACE_SEND, traced, len + 1);
+    if(result < 0)
+    {
+        fprintf(stderr, "%s error: writing to socket", otpProgramName);
+    }
+    free(cipherText);
+    return (result < 0) ? -1 : 0;
+}
+
+/*************************************************
+ * Function: timedCipher
+ * Description: cipherBuffer that adds the time it took to the cipher histogram of the metrics and to the trace
+ * Params: same as cipherBuffer
+ * Returns: none
+ * Pre-conditions: same as cipherBuffer
+ * Post-conditions: output holds the transformed characters
+ * **********************************************/
+void timedCipher(const char* text, const char* key, char* out, int len, int op)
+{
+    struct timespec started;
+    uint64_t traced;
+
+    traced = traceStart();
+    metricsStart(&started);
+    cipherBuffer(text, key, out, len, op);
+    metricsCipher(&started);
+    traceEnd(TRACE_CIPHER, traced, len);
+}
@@ -0,0 +1,427 @@
+//Key generation for keygen, characters are any of the 27 allowed characters
+//Random bytes are made a block at a time and mapped to the alphabet with rejection sampling, each block goes out with one write.
+//Blocks can be spread over several threads, each with its own random stream, and still come out in order
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include "otp.h"
+
+//Key characters produced and written per block
+#define KEY_BLOCK (1024*1024)
+//Random bytes drawn at most per block, enough for a whole block in one draw almost every time
+#define RANDOM_BLOCK (KEY_BLOCK + KEY_BLOCK/16 + 16)
+//Random bytes at or above this are thrown away, 243 is the largest multiple of 27 that fits in a byte so what is left is uniform
+#define KEY_REJECT 243
+
+//Key character for every byte value, the alphabet over and over, only the first KEY_REJECT entries are ever used
+#define KEY_ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
+static const char keyChars[257] = KEY_ALPHABET KEY_ALPHABET KEY_ALPHABET KEY_ALPHABET KEY_ALPHABET KEY_ALPHABET
+                                  KEY_ALPHABET KEY_ALPHABET KEY_ALPHABET "ABCDEFGHIJKLM";
+
+//One key being generated, shared by all of its threads
+struct keyJob
+{
+    long len;
+    long numBlocks;
+    int numThreads;
+    //Nonzero when stdout is a regular file, each block is then written at base + its number * KEY_BLOCK
+    int positioned;
+    off_t base;
+    //Otherwise blocks take turns, nextBlock is the one allowed to write
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    long nextBlock;
+    int failed;
+};
+
+//One thread of a key, it makes blocks index, index + numThreads and so on
+struct keyWorker
+{
+    struct keyJob* job;
+    int index;
+    struct keyStream stream;
+    pthread_t thread;
+};
+
+//Prototypes
+void* keyThread(void*);
+int writeBlock(struct keyJob*, long, const char*, long);
+
+/*************************************************
+ * Function: seedKey
+ * Description: Seeds a random stream, the seed is spread over the whole state with splitmix64 so nearby seeds give
+ * unrelated keys. Stream number n is then jumped 2^128 steps ahead n times, so streams from the same seed never overlap
+ * Params: address of stream, seed, stream number, nonzero to read from getrandom instead
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: stream is ready for randomBytes
+ * **********************************************/
+void seedKey(struct keyStream* stream, uint64_t seed, int number, int secure)
+{
+    static const uint64_t jump[4] = { 0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL };
+    int i, j, b;
+    uint64_t z, jumped[4];
+
+    stream->secure = secure;
+    for(i=0;i<4;i++)
+    {
+        seed += 0x9E3779B97F4A7C15ULL;
+        z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        stream->state[i] = z ^ (z >> 31);
+    }
+
+    //xoshiro256** jump polynomial
+    for(;number>0;number--)
+    {
+        memset(jumped, '\0', sizeof(jumped));
+        for(i=0;i<4;i++)
+        {
+            for(b=0;b<64;b++)
+            {
+                if(jump[i] & (1ULL << b))
+                {
+                    for(j=0;j<4;j++)
+                    {
+                        jumped[j] ^= stream->state[j];
+                    }
+                }
+                nextRandom(stream->state);
+            }
+        }
+        memcpy(stream->state, jumped, sizeof(jumped));
+    }
+}
+
+/*************************************************
+ * Function: nextRandom
+ * Description: One step of xoshiro256**
+ * Params: generator state
+ * Returns: 8 random bytes
+ * Pre-conditions: state is not all zero
+ * Post-conditions: state has moved one step
+ * **********************************************/
+uint64_t nextRandom(uint64_t* s)
+{
+    uint64_t result, t;
+
+    result = s[1] * 5;
+    result = ((result << 7) | (result >> 57)) * 9;
+    t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+/*************************************************
+ * Function: secureBytes
+ * Description: Fills a buffer from getrandom. Called with a whole block so there is one system call per block, getrandom
+ * hands out at most 32 MB per call and can be interrupted, so it loops until the buffer is full
+ * Params: buffer, number of bytes
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: buffer holds len random bytes, exits if the kernel generator fails
+ * **********************************************/
+void secureBytes(unsigned char* buffer, long len)
+{
+    long charsRead;
+
+    while(len > 0)
+    {
+        charsRead = getrandom(buffer, len, 0);
+        if(charsRead < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            error("reading random bytes", 1);
+        }
+        buffer += charsRead;
+        len -= charsRead;
+    }
+}
+
+/*************************************************
+ * Function: randomBytes
+ * Description: Fills a buffer with random bytes, 8 per step of the stream's generator, or from secureBytes for a secure stream
+ * Params: address of stream, buffer, number of bytes
+ * Returns: none
+ * Pre-conditions: seedKey has run on the stream
+ * Post-conditions: buffer holds len random bytes
+ * **********************************************/
+void randomBytes(struct keyStream* stream, unsigned char* buffer, long len)
+{
+    long i;
+    int j;
+    uint64_t result, s[4];
+
+    if(stream->secure)
+    {
+        secureBytes(buffer, len);
+        return;
+    }
+
+    //Local copy so the state stays in registers
+    memcpy(s, stream->state, sizeof(s));
+    for(i=0;i<len;i+=8)
+    {
+        result = nextRandom(s);
+        if(i + 8 <= len)
+        {
+            memcpy(&buffer[i], &result, 8);
+        }
+        else
+        {
+            for(j=0;i+j<len;j++)
+            {
+                buffer[i+j] = result >> (8*j);
+            }
+        }
+    }
+    memcpy(stream->state, s, sizeof(s));
+}
+
+/*************************************************
+ * Function: mapToAlphabet
+ * Description: Rejection sampling, turns random bytes into key characters. Bytes below KEY_REJECT map to a character through
+ * a table, the rest are dropped. The output position only moves for kept bytes, so there is no branch on the random data
+ * Params: random bytes, number of random bytes, output buffer, most characters wanted
+ * Returns: number of characters written
+ * Pre-conditions: output buffer has room for wanted + 8 characters
+ * Post-conditions: output holds the characters, bytes after them may have been overwritten
+ * **********************************************/
+long mapToAlphabet(const unsigned char* random, long len, char* out, long wanted)
+{
+    long i, n;
+    unsigned char b;
+
+    n = 0;
+    for(i=0;i<len && n<wanted;i++)
+    {
+        //Read once, out may alias random as far as the compiler knows
+        b = random[i];
+        out[n] = keyChars[b];
+        n += (b < KEY_REJECT);
+    }
+    return n;
+}
+
+/*************************************************
+ * Function: writeAll
+ * Description: Writes a whole buffer to a file descriptor, picking up after partial writes
+ * Params: file descriptor, buffer, number of bytes
+ * Returns: 0 on success, -1 on error
+ * Pre-conditions: file descriptor is open for writing
+ * Post-conditions: all len bytes are written unless there was an error
+ * **********************************************/
+int writeAll(int fd, const char* data, long len)
+{
+    long charsWritten;
+
+    while(len > 0)
+    {
+        charsWritten = write(fd, data, len);
+        if(charsWritten < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += charsWritten;
+        len -= charsWritten;
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: generateKey
+ * Description: Generates a key of the length specified by the user and sends it to stdout a block at a time. Blocks are dealt
+ * out round robin to the threads, each with its own stream. A regular file gets every block with pwrite at its own offset as
+ * soon as it is made, anything else gets them in order with each thread waiting for its turn
+ * Params: length of key, number of threads, seed, nonzero to use getrandom instead of the seeded generator
+ * Returns: none
+ * Pre-conditions: numThreads is between 1 and MAX_KEY_THREADS
+ * Post-conditions: Has printed a key of length len of Capital letters/whitespace to stdout and a newline character, exits on a write error
+ * **********************************************/
+void generateKey(long len, int numThreads, uint64_t seed, int secure)
+{
+    struct keyJob job;
+    struct keyWorker workers[MAX_KEY_THREADS];
+    struct stat info;
+    int i, flags;
+
+    memset(&job, '\0', sizeof(job));
+    job.len = (len < 0) ? 0 : len;
+    //An empty key is still one block, the newline
+    job.numBlocks = (job.len + KEY_BLOCK - 1) / KEY_BLOCK;
+    if(job.numBlocks == 0)
+    {
+        job.numBlocks = 1;
+    }
+    job.numThreads = (numThreads > job.numBlocks) ? job.numBlocks : numThreads;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.turn, NULL);
+
+    //Offsets only work on a regular file that is not opened for appending
+    flags = fcntl(STDOUT_FILENO, F_GETFL);
+    job.base = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    job.positioned = job.numThreads > 1 && fstat(STDOUT_FILENO, &info) == 0 && S_ISREG(info.st_mode) &&
+                     flags >= 0 && !(flags & O_APPEND) && job.base >= 0;
+
+    for(i=0;i<job.numThreads;i++)
+    {
+        workers[i].job = &job;
+        workers[i].index = i;
+        seedKey(&workers[i].stream, seed, i, secure);
+    }
+    //This thread is worker 0
+    for(i=1;i<job.numThreads;i++)
+    {
+        if(pthread_create(&workers[i].thread, NULL, keyThread, &workers[i]) != 0)
+        {
+            fprintf(stderr, "%s error: could not start key thread\n", otpProgramName);
+            exit(1);
+        }
+    }
+    keyThread(&workers[0]);
+    for(i=1;i<job.numThreads;i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if(job.failed)
+    {
+        error("writing key", 1);
+    }
+    //pwrite leaves the file offset alone, move it past the key for whatever writes next
+    if(job.positioned)
+    {
+        lseek(STDOUT_FILENO, job.base + job.len + 1, SEEK_SET);
+    }
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.turn);
+}
+
+/*************************************************
+ * Function: keyThread
+ * Description: Makes and writes every block of the key that belongs to one worker
+ * Params: address of the worker
+ * Returns: NULL
+ * Pre-conditions: the worker's stream is seeded
+ * Post-conditions: the worker's blocks are written, or the job is marked failed
+ * **********************************************/
+void* keyThread(void* arg)
+{
+    struct keyWorker* worker = arg;
+    struct keyJob* job = worker->job;
+    char* block;
+    unsigned char* random;
+    long blockNum, filled, want, draw;
+
+    //+8 for the newline or the bytes mapToAlphabet may write past the end
+    block = malloc(KEY_BLOCK + 8);
+    random = malloc(RANDOM_BLOCK);
+    if(block == NULL || random == NULL)
+    {
+        fprintf(stderr, "%s error: out of memory\n", otpProgramName);
+        exit(1);
+    }
+
+    for(blockNum=worker->index;blockNum<job->numBlocks;blockNum+=job->numThreads)
+    {
+        want = job->len - blockNum * KEY_BLOCK;
+        if(want > KEY_BLOCK)
+        {
+            want = KEY_BLOCK;
+        }
+        filled = 0;
+        //About 5 percent of bytes are rejected, draw a little extra and top the block up if that was not enough
+        while(filled < want)
+        {
+            draw = (want - filled) + (want - filled) / 16 + 16;
+            randomBytes(&worker->stream, random, draw);
+            filled += mapToAlphabet(random, draw, &block[filled], want - filled);
+        }
+
+        //Add a new line at the end
+        if(blockNum == job->numBlocks - 1)
+        {
+            block[want++] = '\n';
+        }
+        if(writeBlock(job, blockNum, block, want) < 0)
+        {
+            break;
+        }
+    }
+
+    free(block);
+    free(random);
+    return NULL;
+}
+
+/*************************************************
+ * Function: writeBlock
+ * Description: Writes one finished block of the key, straight to its offset or once every block before it is out
+ * Params: address of the job, block number, characters, number of characters
+ * Returns: 0 on success, -1 if this or another thread could not write
+ * Pre-conditions: block is complete
+ * Post-conditions: block is written, the thread holding the next block is woken up
+ * **********************************************/
+int writeBlock(struct keyJob* job, long blockNum, const char* block, long len)
+{
+    long charsWritten, done;
+    int result;
+
+    if(job->positioned)
+    {
+        for(done=0;done<len;done+=charsWritten)
+        {
+            charsWritten = pwrite(STDOUT_FILENO, &block[done], len - done, job->base + (off_t)blockNum * KEY_BLOCK + done);
+            if(charsWritten < 0 && errno == EINTR)
+            {
+                charsWritten = 0;
+            }
+            else if(charsWritten <= 0)
+            {
+                __sync_lock_test_and_set(&job->failed, 1);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    while(job->nextBlock != blockNum && !job->failed)
+    {
+        pthread_cond_wait(&job->turn, &job->lock);
+    }
+    result = -1;
+    if(!job->failed)
+    {
+        result = writeAll(STDOUT_FILENO, block, len);
+        if(result < 0)
+        {
+            job->failed = 1;
+        }
+        job->nextBlock++;
+    }
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+    return result;
+}
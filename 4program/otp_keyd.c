@@ -0,0 +1,10 @@
+//Key pool daemon, keeps key characters made ahead of time in a pool file and hands each one out once to local clients
+//keygen -p port length fetches a key from it, everything but the name is in libotp, see otp_keypool.c
+
+#include "otp.h"
+
+int main(int argc, char* argv[])
+{
+    otpProgramName = "otp_keyd";
+    return keyPoolMain(argc, argv);
+}
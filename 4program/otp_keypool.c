@@ -0,0 +1,509 @@
+//Key pool, otp_keyd keeps a ring of key characters filled in the background and hands them out over a local socket
+//The ring lives in a pool file together with how much was made and handed out, so after a restart nothing is handed out twice.
+//keygen -p fetches a key from it instead of generating one
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include "otp.h"
+
+//Pool file used when none is given and its default ring size in megabytes
+#define DEFAULT_POOL_FILE "otp_keyd.pool"
+#define DEFAULT_POOL_MB 64
+#define MAX_POOL_MB 65536
+//The header takes the first page of the pool file, the ring starts right after it
+#define POOL_HEADER_SIZE 4096
+#define POOL_MAGIC "OTPPOOL1"
+//Characters made per step of the filler, also how often it makes its progress durable
+#define POOL_FILL (1024*1024)
+//Clients are served one at a time, one that stops sending or reading for this long is dropped so the next gets its turn
+#define CLIENT_TIMEOUT_SECONDS 5
+
+//Start of the pool file. produced and consumed only ever grow, the ring position is the count modulo capacity.
+//Characters from consumed to produced are made and never handed out
+struct poolHeader
+{
+    char magic[8];
+    uint64_t capacity;
+    uint64_t produced;
+    uint64_t consumed;
+};
+
+//The daemon's pool, the filler thread and the server share it under the lock
+struct keyPool
+{
+    struct poolHeader* header;
+    char* ring;
+    uint64_t capacity;
+    struct keyStream stream;
+    //Everything before released is sent, the filler may only overwrite up to there. Claimed characters sit between
+    //released and consumed while they go out
+    uint64_t released;
+    pthread_mutex_t lock;
+    //Signalled by the filler when there is more to hand out and by the server when there is room to fill
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+};
+
+//Prototypes
+void openPool(struct keyPool*, const char*, long);
+void* fillPool(void*);
+void servePool(struct keyPool*, int);
+int takeKey(struct keyPool*, uint32_t, uint64_t*);
+void releaseKey(struct keyPool*);
+
+/*************************************************
+ * Function: keyPoolMain
+ * Description: Runs otp_keyd, opens or creates the pool file, starts the filler thread and answers key requests from
+ * local clients one at a time. Only listens on the loopback address, key material never leaves the machine
+ * Params: argc and argv of the front-end
+ * Returns: exit status
+ * Pre-conditions: otpProgramName is set
+ * Post-conditions: only returns if accepting fails, exits on bad usage or a bad pool file
+ * **********************************************/
+int keyPoolMain(int argc, char* argv[])
+{
+    int listenSocketFD, establishedConnectionFD, portNumber, opt, secure;
+    long megabytes;
+    const char* poolPath;
+    struct sockaddr_storage serverAddress;
+    struct timespec now;
+    struct keyPool pool;
+    struct timeval timeout;
+    pthread_t filler;
+
+    //Check options, -s fills from getrandom, -f names the pool file and -m sizes the ring of a new one
+    secure = 0;
+    poolPath = DEFAULT_POOL_FILE;
+    megabytes = DEFAULT_POOL_MB;
+    while((opt = getopt(argc, argv, "sf:m:")) != -1)
+    {
+        if(opt == 's')
+        {
+            secure = 1;
+        }
+        else if(opt == 'f')
+        {
+            poolPath = optarg;
+        }
+        else if(opt == 'm')
+        {
+            megabytes = atol(optarg);
+            if(megabytes < 1 || megabytes > MAX_POOL_MB)
+            {
+                fprintf(stderr, "%s error: pool size must be between 1 and %d megabytes\n", otpProgramName, MAX_POOL_MB);
+                exit(1);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "USAGE: %s [-s] [-f poolfile] [-m megabytes] port\n", argv[0]);
+            exit(0);
+        }
+    }
+    if(argc - optind < 1)
+    {
+        fprintf(stderr, "USAGE: %s [-s] [-f poolfile] [-m megabytes] port\n", argv[0]);
+        exit(0);
+    }
+
+    openPool(&pool, poolPath, megabytes);
+    //Seeded like keygen, a restarted daemon gets a new seed
+    clock_gettime(CLOCK_REALTIME, &now);
+    seedKey(&pool.stream, ((uint64_t)now.tv_sec << 32) ^ now.tv_nsec ^ ((uint64_t)getpid() << 16), 0, secure);
+
+    //Local clients only, a socket path is local already
+    fillAddrStruct(&serverAddress, &portNumber, argv[optind], NULL);
+    if(serverAddress.ss_family == AF_INET)
+    {
+        ((struct sockaddr_in*)&serverAddress)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    setSocket(&listenSocketFD, &serverAddress, DEFAULT_BACKLOG, 0);
+
+    if(pthread_create(&filler, NULL, fillPool, &pool) != 0)
+    {
+        fprintf(stderr, "%s error: could not start filler thread\n", otpProgramName);
+        exit(1);
+    }
+
+    //Requests are a copy out of the ring, clients are served one at a time
+    timeout.tv_sec = CLIENT_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    while(1)
+    {
+        establishedConnectionFD = accept(listenSocketFD, NULL, NULL);
+        if(establishedConnectionFD < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+        setsockopt(establishedConnectionFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(establishedConnectionFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        servePool(&pool, establishedConnectionFD);
+        close(establishedConnectionFD);
+    }
+
+    fprintf(stderr, "%s error: accepting: %s\n", otpProgramName, strerror(errno));
+    close(listenSocketFD);
+    return 1;
+}
+
+/*************************************************
+ * Function: openPool
+ * Description: Maps the pool file, creating it with an empty ring if it does not exist. An existing pool keeps its size
+ * and its counters, so what was made before a restart is still handed out and what was handed out never is again.
+ * The file is locked so a second daemon can not hand out the same characters
+ * Params: address of pool, path of the pool file, ring size in megabytes for a new pool
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: pool is mapped and its lock and condition variables are ready, exits on error
+ * **********************************************/
+void openPool(struct keyPool* pool, const char* path, long megabytes)
+{
+    int fd;
+    struct stat info;
+    struct poolHeader* header;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd < 0)
+    {
+        error("opening pool file", 1);
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        fprintf(stderr, "%s error: pool file %s is in use by another daemon\n", otpProgramName, path);
+        exit(1);
+    }
+    if(fstat(fd, &info) < 0)
+    {
+        error("checking pool file", 1);
+    }
+
+    //New pool, size the file, the ring reads as zeroes until it is filled
+    if(info.st_size == 0)
+    {
+        info.st_size = POOL_HEADER_SIZE + (off_t)megabytes * 1024 * 1024;
+        if(ftruncate(fd, info.st_size) < 0)
+        {
+            error("sizing pool file", 1);
+        }
+    }
+    if(info.st_size <= POOL_HEADER_SIZE)
+    {
+        fprintf(stderr, "%s error: %s is not a key pool\n", otpProgramName, path);
+        exit(1);
+    }
+    header = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(header == MAP_FAILED)
+    {
+        error("mapping pool file", 1);
+    }
+    //The lock lasts as long as the descriptor, keep it open
+    if(memcmp(header->magic, POOL_MAGIC, sizeof(header->magic)) != 0)
+    {
+        if(header->magic[0] != '\0')
+        {
+            fprintf(stderr, "%s error: %s is not a key pool\n", otpProgramName, path);
+            exit(1);
+        }
+        header->capacity = info.st_size - POOL_HEADER_SIZE;
+        header->produced = 0;
+        header->consumed = 0;
+        memcpy(header->magic, POOL_MAGIC, sizeof(header->magic));
+        msync(header, POOL_HEADER_SIZE, MS_SYNC);
+    }
+    if(header->capacity != (uint64_t)(info.st_size - POOL_HEADER_SIZE) || header->produced < header->consumed ||
+       header->produced - header->consumed > header->capacity)
+    {
+        fprintf(stderr, "%s error: pool file %s is damaged\n", otpProgramName, path);
+        exit(1);
+    }
+
+    pool->header = header;
+    pool->ring = (char*)header + POOL_HEADER_SIZE;
+    pool->capacity = header->capacity;
+    pool->released = header->consumed;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->filled, NULL);
+    pthread_cond_init(&pool->drained, NULL);
+}
+
+/*************************************************
+ * Function: fillPool
+ * Description: Filler thread, keeps the ring full of key characters. Each step's characters are synced to the pool file
+ * before produced counts them, so a pool file never claims characters it does not hold
+ * Params: address of pool
+ * Returns: never returns
+ * Pre-conditions: openPool has run and the pool's stream is seeded
+ * Post-conditions: exits the process on a random or sync error
+ * **********************************************/
+void* fillPool(void* arg)
+{
+    struct keyPool* pool = arg;
+    unsigned char* random;
+    uint64_t produced, room, position;
+    long want, filled, draw;
+    char* start;
+    uintptr_t pageMask;
+
+    random = malloc(POOL_FILL + POOL_FILL/16 + 16);
+    if(random == NULL)
+    {
+        fprintf(stderr, "%s error: out of memory\n", otpProgramName);
+        exit(1);
+    }
+    pageMask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+
+    while(1)
+    {
+        //Wait for room, only the filler moves produced so it can be read again without the lock below
+        pthread_mutex_lock(&pool->lock);
+        while((room = pool->capacity - (pool->header->produced - pool->released)) == 0)
+        {
+            pthread_cond_wait(&pool->drained, &pool->lock);
+        }
+        produced = pool->header->produced;
+        pthread_mutex_unlock(&pool->lock);
+
+        //Up to one step, stopping at the end of the ring
+        position = produced % pool->capacity;
+        want = POOL_FILL;
+        if((uint64_t)want > room)
+        {
+            want = room;
+        }
+        if((uint64_t)want > pool->capacity - position)
+        {
+            want = pool->capacity - position;
+        }
+        filled = 0;
+        while(filled < want)
+        {
+            draw = (want - filled) + (want - filled) / 16 + 16;
+            randomBytes(&pool->stream, random, draw);
+            filled += mapToAlphabet(random, draw, &pool->ring[position + filled], want - filled);
+        }
+        start = (char*)((uintptr_t)&pool->ring[position] & pageMask);
+        if(msync(start, &pool->ring[position + want] - start, MS_SYNC) < 0)
+        {
+            error("syncing pool file", 1);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->header->produced += want;
+        pthread_cond_broadcast(&pool->filled);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/*************************************************
+ * Function: servePool
+ * Description: Answers key requests on one connection until the client closes it or goes quiet for CLIENT_TIMEOUT_SECONDS.
+ * A request is a key request header with the number of characters as a 4 byte payload, the answer is a key message with
+ * that many characters or an error message
+ * Params: address of pool, established connection file descriptor
+ * Returns: none
+ * Pre-conditions: connection is open
+ * Post-conditions: connection has nothing more to send
+ * **********************************************/
+void servePool(struct keyPool* pool, int establishedConnectionFD)
+{
+    struct otpHeader header;
+    unsigned char countBuffer[4];
+    uint32_t count, left, piece;
+    uint64_t start, first;
+    int result;
+    const char* msg;
+
+    while(recvHeader(establishedConnectionFD, &header) == 0)
+    {
+        if(header.type != OTP_MSG_KEYREQ || header.length != sizeof(countBuffer))
+        {
+            msg = "expected a key request";
+            sendHeader(establishedConnectionFD, OTP_MSG_ERROR, 0, strlen(msg), 0);
+            sendAll(establishedConnectionFD, msg, strlen(msg));
+            return;
+        }
+        if(recvAll(establishedConnectionFD, (char*)countBuffer, sizeof(countBuffer)) < 0)
+        {
+            return;
+        }
+        count = ((uint32_t)countBuffer[0] << 24) | ((uint32_t)countBuffer[1] << 16) | ((uint32_t)countBuffer[2] << 8) | countBuffer[3];
+        if(count > MAX_PAYLOAD)
+        {
+            msg = "key request is too large";
+            sendHeader(establishedConnectionFD, OTP_MSG_ERROR, 0, strlen(msg), 0);
+            sendAll(establishedConnectionFD, msg, strlen(msg));
+            return;
+        }
+        if(sendHeader(establishedConnectionFD, OTP_MSG_KEY, 0, count, 0) < 0)
+        {
+            return;
+        }
+
+        //Claimed and sent in pieces of at most half the ring, the filler makes the next piece while one goes out
+        for(left=count;left>0;left-=piece)
+        {
+            piece = (left < pool->capacity / 2) ? left : pool->capacity / 2;
+            if(takeKey(pool, piece, &start) < 0)
+            {
+                return;
+            }
+            //The characters are ours now, they may wrap around the end of the ring
+            start %= pool->capacity;
+            first = pool->capacity - start;
+            if(first > piece)
+            {
+                first = piece;
+            }
+            result = sendAll(establishedConnectionFD, &pool->ring[start], first);
+            if(result == 0)
+            {
+                result = sendAll(establishedConnectionFD, pool->ring, piece - first);
+            }
+            releaseKey(pool);
+            if(result < 0)
+            {
+                return;
+            }
+        }
+    }
+}
+
+/*************************************************
+ * Function: takeKey
+ * Description: Claims the next count characters of the ring, waiting for the filler if not enough are made yet. consumed
+ * is synced to the pool file before the characters are handed out, after a crash they are skipped rather than reused
+ * Params: address of pool, number of characters, address to store the count they start at
+ * Returns: 0 on success, -1 if the pool file could not be synced
+ * Pre-conditions: count is at most half the capacity
+ * Post-conditions: the characters will not be claimed again, the filler leaves them alone until releaseKey
+ * **********************************************/
+int takeKey(struct keyPool* pool, uint32_t count, uint64_t* start)
+{
+    int result;
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->header->produced - pool->header->consumed < count)
+    {
+        pthread_cond_wait(&pool->filled, &pool->lock);
+    }
+    *start = pool->header->consumed;
+    pool->header->consumed += count;
+    result = msync(pool->header, POOL_HEADER_SIZE, MS_SYNC);
+    pthread_mutex_unlock(&pool->lock);
+
+    if(result < 0)
+    {
+        fprintf(stderr, "%s error: syncing pool file: %s\n", otpProgramName, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: releaseKey
+ * Description: Lets the filler reuse the characters claimed by the last takeKey, called once they are sent or the send failed
+ * Params: address of pool
+ * Returns: none
+ * Pre-conditions: takeKey has run
+ * Post-conditions: filler is woken up if it was waiting for room
+ * **********************************************/
+void releaseKey(struct keyPool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->released = pool->header->consumed;
+    pthread_cond_signal(&pool->drained);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*************************************************
+ * Function: poolKey
+ * Description: keygen -p, fetches a key from otp_keyd on this machine and prints it like a generated one. Asks for at most
+ * MAX_PAYLOAD characters at a time over one connection
+ * Params: port number argument, length of key
+ * Returns: none
+ * Pre-conditions: otpProgramName is set, len is at least 1, keygen checks it
+ * Post-conditions: Has printed a key of length len and a newline character to stdout, exits on any error
+ * **********************************************/
+void poolKey(char* portArg, long len)
+{
+    int socketFD, portNumber;
+    uint32_t count;
+    unsigned char countBuffer[4];
+    char* buffer;
+    char msg[256];
+    struct sockaddr_storage serverAddress;
+    struct otpHeader header;
+
+    buffer = malloc((len < MAX_PAYLOAD) ? len + 1 : MAX_PAYLOAD);
+    if(buffer == NULL)
+    {
+        fprintf(stderr, "%s error: out of memory\n", otpProgramName);
+        exit(1);
+    }
+
+    fillAddrStruct(&serverAddress, &portNumber, portArg, "localhost");
+    setSocket(&socketFD, &serverAddress, 0, 0);
+    if(connect(socketFD, (struct sockaddr*)&serverAddress, addrLength(&serverAddress)) < 0)
+    {
+        error("connecting to key pool", 2);
+    }
+
+    while(len > 0)
+    {
+        count = (len < MAX_PAYLOAD) ? len : MAX_PAYLOAD;
+        countBuffer[0] = count >> 24;
+        countBuffer[1] = count >> 16;
+        countBuffer[2] = count >> 8;
+        countBuffer[3] = count;
+        if(sendHeader(socketFD, OTP_MSG_KEYREQ, 0, sizeof(countBuffer), 0) < 0 || sendAll(socketFD, (char*)countBuffer, sizeof(countBuffer)) < 0 ||
+           recvHeader(socketFD, &header) < 0)
+        {
+            error("requesting key from pool", 1);
+        }
+        if(header.type == OTP_MSG_ERROR && header.length < sizeof(msg) && recvAll(socketFD, msg, header.length) == 0)
+        {
+            fprintf(stderr, "%s error: key pool: %.*s\n", otpProgramName, (int)header.length, msg);
+            exit(1);
+        }
+        if(header.type != OTP_MSG_KEY || header.length != count)
+        {
+            fprintf(stderr, "%s error: bad answer from key pool\n", otpProgramName);
+            exit(1);
+        }
+        if(recvAll(socketFD, buffer, count) < 0)
+        {
+            error("receiving key from pool", 1);
+        }
+        if(writeAll(STDOUT_FILENO, buffer, count) < 0)
+        {
+            error("writing key", 1);
+        }
+        len -= count;
+    }
+
+    close(socketFD);
+    free(buffer);
+    if(writeAll(STDOUT_FILENO, "\n", 1) < 0)
+    {
+        error("writing key", 1);
+    }
+}
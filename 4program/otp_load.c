@@ -0,0 +1,10 @@
+//Open loop load generator for the one time pad daemons, sends requests at a fixed rate and reports the latency distribution
+//Everything but the name is in libotp, see otp_loadgen.c
+
+#include "otp.h"
+
+int main(int argc, char* argv[])
+{
+    otpProgramName = "otp_load";
+    return loadMain(argc, argv);
+}
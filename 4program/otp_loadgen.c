@@ -0,0 +1,602 @@
+//Open loop load generator for otp_load, sends binary protocol requests to a daemon at a fixed rate whether or not earlier
+//ones have been answered, over as many connections as it takes. By default every request opens a connection of its own, so
+//the daemon's accept path and listen backlog are part of what is measured, with -k connections are kept and reused.
+//A request's latency runs from the time it was due to go out, not from when it went out. When the generator falls behind,
+//because every connection is busy, the wait counts too, so a stalled daemon can not hide its stall by slowing the generator
+//down (coordinated omission). Latencies go into a log-linear histogram in the style of HdrHistogram
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "otp.h"
+
+#define DEFAULT_RATE 1000
+#define DEFAULT_SECONDS 10
+#define DEFAULT_SIZE 1024
+#define DEFAULT_CONNECTIONS 256
+#define MAX_CONNECTIONS 65536
+//How long requests still out at the end get to finish before they count as errors
+#define DRAIN_SECONDS 10
+#define MAX_EVENTS 256
+//Histogram buckets, values below HIST_SUB are exact, above that every power of two is split into HIST_SUB/2 steps, so each
+//value is kept to about three significant digits. HIST_RANGES powers of two reach past 2^40 nanoseconds, over 18 minutes
+#define HIST_SUB_BITS 11
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_RANGES 31
+#define HIST_BUCKETS (HIST_SUB + HIST_RANGES * HIST_SUB / 2)
+
+//Latency histogram in nanoseconds
+struct latencyHistogram
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    int64_t max;
+    double sum;
+};
+
+//One connection to the daemon, busy while a request is out on it
+struct loadConnection
+{
+    //Index in the array of connections, it is what goes on the free list
+    int slot;
+    int fd;
+    int busy;
+    //Connected and greeted, a kept connection skips the hello on its next request
+    int greeted;
+    //Set while part of the request is still to go out, epoll reports the socket writable only then
+    int writing;
+    //When the request on it was due, in nanoseconds since the start
+    int64_t due;
+    //Bytes of the request sent and of the reply received, and how many the reply has
+    int sent, received, expected;
+    //First bytes of the reply, the hello and the result header are checked
+    unsigned char reply[2*OTP_HEADER_SIZE];
+};
+
+//Prototypes
+int startRequest(int, struct loadConnection*, struct sockaddr_storage*, int64_t, int);
+int advanceRequest(int, struct loadConnection*, const char*, int);
+void endRequest(int, struct loadConnection*, int, int*, int*);
+void histRecord(struct latencyHistogram*, int64_t);
+int64_t histValue(int);
+int64_t histPercentile(struct latencyHistogram*, double);
+void histWrite(FILE*, struct latencyHistogram*);
+
+/*************************************************
+ * Function: loadMain
+ * Description: Runs otp_load, sends requests at the target rate for the run time, waits for the last ones and prints the
+ * achieved rate, the errors and the latency percentiles. With -H the whole latency distribution is written as an hgrm file
+ * Params: argc and argv of the front-end
+ * Returns: exit status, 1 if any request failed
+ * Pre-conditions: otpProgramName is set
+ * Post-conditions: every connection is closed
+ * **********************************************/
+int loadMain(int argc, char* argv[])
+{
+    char *request, *histPath, *token;
+    int opt, op, size, maxConnections, keep, epollFD, numEvents, numFree, *freeList, i, portNumber, requestLen, failed;
+    long completed, errors, issued, total;
+    double rate, seconds;
+    int64_t interval, now, due, end, lastDone;
+    struct sockaddr_storage serverAddress;
+    struct epoll_event events[MAX_EVENTS];
+    struct loadConnection *conns, *conn;
+    struct latencyHistogram* hist;
+    struct keyStream stream;
+    struct timespec start;
+    unsigned char* random;
+    FILE* histFile;
+
+    //Check options, -r requests per second, -d seconds to run, -s characters per request, -c most connections open at once,
+    //-k keeps connections for later requests, -x decrypts instead of encrypting, -H writes the latency distribution
+    rate = DEFAULT_RATE;
+    seconds = DEFAULT_SECONDS;
+    size = DEFAULT_SIZE;
+    maxConnections = DEFAULT_CONNECTIONS;
+    keep = 0;
+    op = OTP_OP_ENC;
+    histPath = NULL;
+    while((opt = getopt(argc, argv, "r:d:s:c:kxH:")) != -1)
+    {
+        if(opt == 'r' || opt == 'd')
+        {
+            *((opt == 'r') ? &rate : &seconds) = strtod(optarg, &token);
+            if(*token != '\0' || ((opt == 'r') ? rate : seconds) <= 0)
+            {
+                fprintf(stderr, "%s error: -%c needs a positive number\n", otpProgramName, opt);
+                exit(1);
+            }
+        }
+        else if(opt == 's')
+        {
+            size = atoi(optarg);
+            if(size < 1 || size > MAX_PAYLOAD)
+            {
+                fprintf(stderr, "%s error: size must be between 1 and %d\n", otpProgramName, MAX_PAYLOAD);
+                exit(1);
+            }
+        }
+        else if(opt == 'c')
+        {
+            maxConnections = atoi(optarg);
+            if(maxConnections < 1 || maxConnections > MAX_CONNECTIONS)
+            {
+                fprintf(stderr, "%s error: connections must be between 1 and %d\n", otpProgramName, MAX_CONNECTIONS);
+                exit(1);
+            }
+        }
+        else if(opt == 'k')
+        {
+            keep = 1;
+        }
+        else if(opt == 'x')
+        {
+            op = OTP_OP_DEC;
+        }
+        else if(opt == 'H')
+        {
+            histPath = optarg;
+        }
+        else
+        {
+            fprintf(stderr, "USAGE: %s [-r rate] [-d seconds] [-s size] [-c connections] [-k] [-x] [-H histfile] port\n", argv[0]);
+            exit(0);
+        }
+    }
+    if(argc - optind < 1)
+    {
+        fprintf(stderr, "USAGE: %s [-r rate] [-d seconds] [-s size] [-c connections] [-k] [-x] [-H histfile] port\n", argv[0]);
+        exit(0);
+    }
+    fillAddrStruct(&serverAddress, &portNumber, argv[optind], "localhost");
+
+    //Every request is the same hello, text and key, a kept connection starts past the hello
+    requestLen = 3*OTP_HEADER_SIZE + 2*size;
+    request = malloc(requestLen);
+    random = malloc(2*size + 64);
+    conns = calloc(maxConnections, sizeof(struct loadConnection));
+    freeList = malloc(maxConnections * sizeof(int));
+    hist = calloc(1, sizeof(struct latencyHistogram));
+    if(request == NULL || random == NULL || conns == NULL || freeList == NULL || hist == NULL)
+    {
+        fprintf(stderr, "%s error: out of memory\n", otpProgramName);
+        exit(1);
+    }
+    clock_gettime(CLOCK_REALTIME, &start);
+    seedKey(&stream, ((uint64_t)start.tv_sec << 32) ^ start.tv_nsec, 0, 0);
+    for(i=0;i<2*size;i+=mapToAlphabet(random, 2*size + 64, &request[2*OTP_HEADER_SIZE + i], 2*size - i))
+    {
+        randomBytes(&stream, random, 2*size + 64);
+    }
+    //The key goes after its own header, move it there
+    memmove(&request[3*OTP_HEADER_SIZE + size], &request[2*OTP_HEADER_SIZE + size], size);
+    encodeHeader((unsigned char*)request, OTP_MSG_HELLO, op, 0, 0);
+    encodeHeader((unsigned char*)&request[OTP_HEADER_SIZE], OTP_MSG_TEXT, 0, size, 0);
+    encodeHeader((unsigned char*)&request[2*OTP_HEADER_SIZE + size], OTP_MSG_KEY, 0, size, 0);
+    free(random);
+
+    epollFD = epoll_create1(0);
+    if(epollFD < 0)
+    {
+        error("creating epoll instance", 1);
+    }
+    for(i=0;i<maxConnections;i++)
+    {
+        conns[i].slot = i;
+        conns[i].fd = -1;
+        freeList[i] = maxConnections - 1 - i;
+    }
+    numFree = maxConnections;
+
+    printf("%s: %.1f requests/s for %.1f s, %d characters, up to %d connections, %s\n", otpProgramName, rate, seconds, size,
+           maxConnections, keep ? "connections kept" : "a new connection per request");
+    fflush(stdout);
+
+    //Request i is due at i times the interval, whether or not there is a connection free for it then
+    interval = (int64_t)(1e9 / rate);
+    total = (long)(rate * seconds);
+    issued = 0;
+    completed = 0;
+    errors = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    end = (int64_t)((seconds + DRAIN_SECONDS) * 1e9);
+    now = 0;
+    lastDone = 0;
+    while(completed + errors < total && now < end)
+    {
+        //Send everything that is due, as far as there are connections for it. Kept connections that are open go first
+        now = elapsedNanoseconds(&start);
+        while(issued < total && issued * interval <= now && numFree > 0)
+        {
+            conn = &conns[freeList[--numFree]];
+            //Nothing is sent yet, epoll reports the socket writable once it is connected and the event loop takes it from there
+            if(startRequest(epollFD, conn, &serverAddress, issued * interval, requestLen) < 0)
+            {
+                endRequest(epollFD, conn, 0, freeList, &numFree);
+                errors++;
+            }
+            issued++;
+        }
+
+        //Sleep until the next request is due or a connection has news, a request that is late goes right away
+        due = (issued < total && numFree > 0) ? (issued * interval - now) / 1000000 : 100;
+        numEvents = epoll_wait(epollFD, events, MAX_EVENTS, (due < 0) ? 0 : due);
+        if(numEvents < 0 && errno != EINTR)
+        {
+            error("waiting on connections", 1);
+        }
+        for(i=0;i<numEvents;i++)
+        {
+            conn = events[i].data.ptr;
+            //A kept connection the daemon closed while it was idle, the next request on it connects again
+            if(!conn->busy)
+            {
+                epoll_ctl(epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+                close(conn->fd);
+                conn->fd = -1;
+                continue;
+            }
+            failed = (events[i].events & EPOLLERR) ? -1 : advanceRequest(epollFD, conn, request, requestLen);
+            if(failed < 0)
+            {
+                endRequest(epollFD, conn, 0, freeList, &numFree);
+                errors++;
+            }
+            else if(conn->received == conn->expected)
+            {
+                lastDone = elapsedNanoseconds(&start);
+                histRecord(hist, lastDone - conn->due);
+                endRequest(epollFD, conn, keep, freeList, &numFree);
+                completed++;
+            }
+        }
+    }
+    //Whatever is still out ran past the drain time
+    errors = total - completed;
+    for(i=0;i<maxConnections;i++)
+    {
+        if(conns[i].fd >= 0)
+        {
+            close(conns[i].fd);
+        }
+    }
+
+    printf("%s: sent %ld completed %ld errors %ld achieved %.1f requests/s\n", otpProgramName, issued, completed, errors,
+           completed / ((lastDone < seconds * 1e9) ? seconds : lastDone / 1e9));
+    printf("%s: latency ms p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f p99.99 %.3f max %.3f\n", otpProgramName,
+           histPercentile(hist, 0.5) / 1e6, histPercentile(hist, 0.9) / 1e6, histPercentile(hist, 0.99) / 1e6,
+           histPercentile(hist, 0.999) / 1e6, histPercentile(hist, 0.9999) / 1e6, hist->max / 1e6);
+    if(histPath != NULL)
+    {
+        histFile = fopen(histPath, "w");
+        if(histFile == NULL)
+        {
+            fprintf(stderr, "%s error: failed to open %s for writing\n", otpProgramName, histPath);
+            exit(1);
+        }
+        histWrite(histFile, hist);
+        fclose(histFile);
+    }
+    return (errors > 0) ? 1 : 0;
+}
+
+/*************************************************
+ * Function: startRequest
+ * Description: Gets a connection ready for a request, a kept connection that is still open is used as it is, otherwise a
+ * non-blocking connect is started
+ * Params: epoll file descriptor, connection, server address, time the request was due, length of the request with its hello
+ * Returns: 0 on success, -1 if the connection could not be made
+ * Pre-conditions: connection is not busy
+ * Post-conditions: connection is busy and registered with epoll
+ * **********************************************/
+int startRequest(int epollFD, struct loadConnection* conn, struct sockaddr_storage* serverAddress, int64_t due, int requestLen)
+{
+    struct epoll_event event;
+    int one = 1, size;
+
+    size = (requestLen - 3*OTP_HEADER_SIZE) / 2;
+    conn->busy = 1;
+    conn->due = due;
+    conn->received = 0;
+    conn->writing = 1;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = conn;
+    if(conn->fd >= 0)
+    {
+        //Same connection, only the pair goes out and only a result comes back
+        conn->sent = OTP_HEADER_SIZE;
+        conn->expected = OTP_HEADER_SIZE + size;
+        return epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+
+    //Hello, result header and result
+    conn->greeted = 0;
+    conn->sent = 0;
+    conn->expected = 2*OTP_HEADER_SIZE + size;
+    conn->fd = socket(serverAddress->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(conn->fd < 0)
+    {
+        return -1;
+    }
+    if(serverAddress->ss_family == AF_INET)
+    {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    //A full backlog shows up here on a Unix domain socket and as a slow connect over TCP
+    if(connect(conn->fd, (struct sockaddr*)serverAddress, addrLength(serverAddress)) < 0 && errno != EINPROGRESS)
+    {
+        return -1;
+    }
+    return epoll_ctl(epollFD, EPOLL_CTL_ADD, conn->fd, &event);
+}
+
+/*************************************************
+ * Function: advanceRequest
+ * Description: Sends as much of the request and reads as much of the reply as the socket allows. The hello and the result
+ * header are checked, the result itself is only counted
+ * Params: epoll file descriptor, connection, request bytes, length of the request with its hello
+ * Returns: 0 on success, the reply is complete once received equals expected, -1 on a socket error or a bad reply
+ * Pre-conditions: startRequest has run on the connection
+ * Post-conditions: connection has made as much progress as it can without blocking
+ * **********************************************/
+int advanceRequest(int epollFD, struct loadConnection* conn, const char* request, int requestLen)
+{
+    char buffer[RECV_CHUNK];
+    struct otpHeader header;
+    struct epoll_event event;
+    int charsWritten, charsRead, headerStart;
+
+    while(conn->sent < requestLen)
+    {
+        charsWritten = send(conn->fd, &request[conn->sent], requestLen - conn->sent, MSG_NOSIGNAL);
+        if(charsWritten < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            //Still connecting or the socket is full
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)
+            {
+                break;
+            }
+            return -1;
+        }
+        conn->sent += charsWritten;
+    }
+    //All of it is out, a socket left writable would wake us over and over
+    if(conn->writing && conn->sent == requestLen)
+    {
+        conn->writing = 0;
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+
+    headerStart = conn->greeted ? 0 : OTP_HEADER_SIZE;
+    while(conn->received < conn->expected)
+    {
+        charsRead = recv(conn->fd, buffer, sizeof(buffer), 0);
+        if(charsRead < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        //Closed before the whole result came back, the daemon turned us away or sent an error
+        if(charsRead == 0 || conn->received + charsRead > conn->expected)
+        {
+            return -1;
+        }
+        if(conn->received < headerStart + OTP_HEADER_SIZE)
+        {
+            memcpy(&conn->reply[conn->received], buffer,
+                   (charsRead < headerStart + OTP_HEADER_SIZE - conn->received) ? charsRead : headerStart + OTP_HEADER_SIZE - conn->received);
+        }
+        conn->received += charsRead;
+
+        //Check the headers as soon as they are in, a daemon for the other operation or an error ends the request.
+        //Byte 3 of the request is the operation in its hello
+        if(!conn->greeted && conn->received >= OTP_HEADER_SIZE &&
+           (decodeHeader(conn->reply, &header) < 0 || header.type != OTP_MSG_HELLO || header.flags != request[3]))
+        {
+            return -1;
+        }
+        if(conn->received >= headerStart + OTP_HEADER_SIZE &&
+           (decodeHeader(&conn->reply[headerStart], &header) < 0 || header.type != OTP_MSG_RESULT))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: endRequest
+ * Description: Finishes with the request on a connection, a kept connection stays open for the next request and is only
+ * watched for the daemon closing it, otherwise it is closed
+ * Params: epoll file descriptor, connection, nonzero to keep it, free list of connections and its length
+ * Returns: none
+ * Pre-conditions: connection is busy
+ * Post-conditions: connection is on the free list
+ * **********************************************/
+void endRequest(int epollFD, struct loadConnection* conn, int keep, int* freeList, int* numFree)
+{
+    struct epoll_event event;
+
+    conn->busy = 0;
+    if(keep && conn->fd >= 0)
+    {
+        conn->greeted = 1;
+        event.events = EPOLLRDHUP;
+        event.data.ptr = conn;
+        epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+    else if(conn->fd >= 0)
+    {
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    freeList[(*numFree)++] = conn->slot;
+}
+
+/*************************************************
+ * Function: histRecord
+ * Description: Counts a latency in its bucket, values below HIST_SUB have a bucket each, above that a bucket spans 1/1024
+ * to 1/2048 of its value
+ * Params: histogram, latency in nanoseconds
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: count, total, sum and max include the latency
+ * **********************************************/
+void histRecord(struct latencyHistogram* hist, int64_t value)
+{
+    int index, shift;
+
+    if(value < 0)
+    {
+        value = 0;
+    }
+    if(value < HIST_SUB)
+    {
+        index = value;
+    }
+    else
+    {
+        //Shift that leaves HIST_SUB_BITS significant bits, the top one always set
+        shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+        index = HIST_SUB + (shift - 1) * (HIST_SUB / 2) + (int)(value >> shift) - HIST_SUB / 2;
+        if(index >= HIST_BUCKETS)
+        {
+            index = HIST_BUCKETS - 1;
+        }
+    }
+    hist->counts[index]++;
+    hist->total++;
+    hist->sum += value;
+    if(value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+/*************************************************
+ * Function: histValue
+ * Description: Highest latency that lands in a bucket
+ * Params: bucket index
+ * Returns: nanoseconds
+ * Pre-conditions: index is below HIST_BUCKETS
+ * Post-conditions: none
+ * **********************************************/
+int64_t histValue(int index)
+{
+    int shift;
+
+    if(index < HIST_SUB)
+    {
+        return index;
+    }
+    shift = (index - HIST_SUB) / (HIST_SUB / 2) + 1;
+    return ((int64_t)((index - HIST_SUB) % (HIST_SUB / 2) + HIST_SUB / 2 + 1) << shift) - 1;
+}
+
+/*************************************************
+ * Function: histPercentile
+ * Description: Latency at a percentile, the top of the bucket the nearest rank falls in but never past the largest seen
+ * Params: histogram, fraction from 0 to 1
+ * Returns: nanoseconds, 0 for an empty histogram
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int64_t histPercentile(struct latencyHistogram* hist, double fraction)
+{
+    uint64_t rank, seen;
+    int i;
+
+    if(hist->total == 0)
+    {
+        return 0;
+    }
+    rank = (uint64_t)(fraction * hist->total + 0.999999);
+    if(rank < 1)
+    {
+        rank = 1;
+    }
+    seen = 0;
+    for(i=0;i<HIST_BUCKETS;i++)
+    {
+        seen += hist->counts[i];
+        if(seen >= rank)
+        {
+            return (histValue(i) < hist->max) ? histValue(i) : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/*************************************************
+ * Function: histWrite
+ * Description: Writes the latency distribution in milliseconds in the percentile format HdrHistogram's tools read, one row
+ * for every bucket that holds something
+ * Params: open file, histogram
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: file is written but not closed
+ * **********************************************/
+void histWrite(FILE* file, struct latencyHistogram* hist)
+{
+    uint64_t seen;
+    double fraction, mean, deviation;
+    int i, used;
+
+    fprintf(file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    seen = 0;
+    used = 0;
+    for(i=0;i<HIST_BUCKETS && seen<hist->total;i++)
+    {
+        if(hist->counts[i] == 0)
+        {
+            continue;
+        }
+        seen += hist->counts[i];
+        used++;
+        fraction = (double)seen / hist->total;
+        if(seen < hist->total)
+        {
+            fprintf(file, "%12.3f %2.12f %10llu %14.2f\n", histValue(i) / 1e6, fraction, (unsigned long long)seen,
+                    1 / (1 - fraction));
+        }
+        else
+        {
+            fprintf(file, "%12.3f %2.12f %10llu\n", hist->max / 1e6, fraction, (unsigned long long)seen);
+        }
+    }
+    //Spread from the bucket tops, close enough at three significant digits
+    mean = hist->total ? hist->sum / hist->total : 0;
+    deviation = 0;
+    for(i=0;i<HIST_BUCKETS;i++)
+    {
+        deviation += hist->counts[i] * (histValue(i) - mean) * (histValue(i) - mean);
+    }
+    deviation = hist->total ? sqrt(deviation / hist->total) : 0;
+    fprintf(file, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e6, deviation / 1e6);
+    fprintf(file, "#[Max     = %12.3f, Total count    = %12llu]\n", hist->max / 1e6, (unsigned long long)hist->total);
+    fprintf(file, "#[Buckets = %12d, SubBuckets     = %12d]\n", used, HIST_SUB);
+}
@@ -0,0 +1,677 @@
+//Per-operation daemon metrics, kept in a shared mapping so every worker process adds to the same counters
+//The mapping is split into cache line aligned slots, the main thread of each worker and each cipher thread claims one of its
+//own and only ever adds to that, so the hot path never fights another core for a cache line. Anything without a slot of its
+//own adds to its worker's or to the spare slot 0, every add is atomic so a shared slot stays right. Readers sum all slots:
+//the supervisor when asked for a report, and the metrics server when it is scraped over HTTP
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "otp.h"
+
+//Slots in the mapping, a worker that exits gives its slots back for the next one. Once all are taken the rest share slot 0
+#define METRICS_SLOTS 1024
+//Histogram buckets, the upper bounds go up by 4 from a microsecond to about 4 seconds and the last bucket takes the rest
+#define METRICS_BUCKETS 13
+#define METRICS_FIRST_BOUND 1000
+//Most bytes of an HTTP request read before answering, and how long a scraper gets to send them
+#define HTTP_REQUEST_MAX 4096
+#define HTTP_TIMEOUT_SECONDS 2
+
+//Counters for one operation
+struct opMetrics
+{
+    //Requests fully answered and requests that failed after the handshake
+    uint64_t requests;
+    uint64_t errors;
+    //Characters transformed by answered requests
+    uint64_t characters;
+    //Time from handshake to the last byte of the answer, summed over answered requests
+    uint64_t nanoseconds;
+};
+
+//Durations in nanoseconds, counts per bucket and their sum
+struct metricsHistogram
+{
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t sum;
+};
+
+//Everything one thread counts, the owner is the pid of the worker it belongs to, 0 while the slot is free
+struct metricsSlot
+{
+    int owner;
+    //Indexed by OTP_OP_ENC and OTP_OP_DEC
+    struct opMetrics op[OTP_OP_ANY + 1];
+    //Clients turned away at the handshake because they asked for an operation this daemon does not run
+    uint64_t rejected;
+    //Connections accepted, and bytes received from and sent to clients over sockets and shared memory rings
+    uint64_t accepted;
+    uint64_t bytesIn, bytesOut;
+    //Connections open right now, a worker with any open is busy
+    int64_t connections;
+    //Time spent transforming a chunk pair, and time a chunk pair waited for a cipher thread
+    struct metricsHistogram cipher;
+    struct metricsHistogram queueWait;
+} __attribute__((aligned(64)));
+
+struct daemonMetrics
+{
+    struct metricsSlot slot[METRICS_SLOTS];
+};
+
+//Shared with the workers, NULL until metricsInit
+static struct daemonMetrics* metrics = NULL;
+//Slot of the calling thread, and of the worker for its threads that have none of their own. NULL adds to slot 0
+static __thread struct metricsSlot* threadSlot = NULL;
+static struct metricsSlot* workerSlot = NULL;
+//Set in the metrics server, what it sends to scrapers is not client traffic
+static int scraping = 0;
+
+//Prototypes
+struct metricsSlot* claimSlot();
+struct metricsSlot* currentSlot();
+void histogramAdd(struct metricsHistogram*, struct timespec*);
+void metricsSum(struct metricsSlot*, int*);
+void writeHistogram(FILE*, const char*, const char*, struct metricsHistogram*);
+void serveScrape(int, int);
+
+/*************************************************
+ * Function: metricsInit
+ * Description: Maps zeroed counters that stay shared with every process forked afterwards
+ * Params: none
+ * Returns: none
+ * Pre-conditions: called before the workers are forked
+ * Post-conditions: counters are ready, exits on error
+ * **********************************************/
+void metricsInit()
+{
+    metrics = mmap(NULL, sizeof(struct daemonMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(metrics == MAP_FAILED)
+    {
+        error("mapping metrics", 1);
+    }
+    //Never handed out, it is the slot for everything that has none
+    metrics->slot[0].owner = -1;
+}
+
+/*************************************************
+ * Function: metricsWorker
+ * Description: Gives a freshly forked worker a slot, used by its main thread and by any of its threads without their own
+ * Params: none
+ * Returns: none
+ * Pre-conditions: metricsInit has run, called in the worker before it starts serving
+ * Post-conditions: the worker counts into its own slot, or slot 0 if none was free
+ * **********************************************/
+void metricsWorker()
+{
+    threadSlot = claimSlot();
+    workerSlot = threadSlot;
+}
+
+/*************************************************
+ * Function: metricsThread
+ * Description: Gives a long lived thread of a worker a slot of its own, like a cipher thread
+ * Params: none
+ * Returns: none
+ * Pre-conditions: metricsInit has run
+ * Post-conditions: the calling thread counts into its own slot, or shares its worker's if none was free
+ * **********************************************/
+void metricsThread()
+{
+    threadSlot = claimSlot();
+    if(threadSlot == NULL)
+    {
+        threadSlot = workerSlot;
+    }
+}
+
+/*************************************************
+ * Function: metricsWorkerExit
+ * Description: Gives back the slots of a worker that exited, what they counted stays in them and the next owner adds to it.
+ * Its connections were closed with it
+ * Params: pid of the worker
+ * Returns: none
+ * Pre-conditions: the worker has been waited for
+ * Post-conditions: its slots are free
+ * **********************************************/
+void metricsWorkerExit(pid_t pid)
+{
+    int i;
+
+    if(metrics == NULL || pid <= 0)
+    {
+        return;
+    }
+    for(i=1;i<METRICS_SLOTS;i++)
+    {
+        if(__atomic_load_n(&metrics->slot[i].owner, __ATOMIC_ACQUIRE) == pid)
+        {
+            __atomic_store_n(&metrics->slot[i].connections, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&metrics->slot[i].owner, 0, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*************************************************
+ * Function: claimSlot
+ * Description: Takes the first free slot for the calling process
+ * Params: none
+ * Returns: address of the slot, NULL if metrics are off or every slot is taken
+ * Pre-conditions: none
+ * Post-conditions: the slot is owned by this process until metricsWorkerExit
+ * **********************************************/
+struct metricsSlot* claimSlot()
+{
+    int i, expected;
+
+    if(metrics == NULL)
+    {
+        return NULL;
+    }
+    for(i=1;i<METRICS_SLOTS;i++)
+    {
+        expected = 0;
+        if(__atomic_compare_exchange_n(&metrics->slot[i].owner, &expected, (int)getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            return &metrics->slot[i];
+        }
+    }
+    return NULL;
+}
+
+/*************************************************
+ * Function: currentSlot
+ * Description: Finds the slot the calling thread adds to
+ * Params: none
+ * Returns: address of the slot, NULL if metrics are off
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+struct metricsSlot* currentSlot()
+{
+    if(threadSlot != NULL)
+    {
+        return threadSlot;
+    }
+    if(workerSlot != NULL)
+    {
+        return workerSlot;
+    }
+    return (metrics != NULL) ? &metrics->slot[0] : NULL;
+}
+
+/*************************************************
+ * Function: metricsStart
+ * Description: Marks the start of a request for metricsRecord, or of anything else timed here
+ * Params: address of the timestamp to fill
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: timestamp holds the current monotonic time
+ * **********************************************/
+void metricsStart(struct timespec* started)
+{
+    clock_gettime(CLOCK_MONOTONIC, started);
+}
+
+/*************************************************
+ * Function: metricsRecord
+ * Description: Adds a finished request to the counters of its operation
+ * Params: OTP_OP_ENC or OTP_OP_DEC, characters transformed or -1 if the request failed, timestamp from metricsStart
+ * Returns: none
+ * Pre-conditions: none, does nothing before metricsInit
+ * Post-conditions: counters are updated atomically, other workers may be adding at the same time
+ * **********************************************/
+void metricsRecord(int op, long characters, struct timespec* started)
+{
+    struct metricsSlot* slot;
+    struct timespec now;
+    int64_t elapsed;
+
+    slot = currentSlot();
+    if(slot == NULL || op < OTP_OP_ENC || op > OTP_OP_DEC)
+    {
+        return;
+    }
+    if(characters < 0)
+    {
+        __atomic_fetch_add(&slot->op[op].errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (int64_t)(now.tv_sec - started->tv_sec) * 1000000000 + (now.tv_nsec - started->tv_nsec);
+    __atomic_fetch_add(&slot->op[op].requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->op[op].characters, (uint64_t)characters, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->op[op].nanoseconds, (uint64_t)elapsed, __ATOMIC_RELAXED);
+}
+
+/*************************************************
+ * Function: metricsReject
+ * Description: Counts a client turned away at the handshake
+ * Params: none
+ * Returns: none
+ * Pre-conditions: none, does nothing before metricsInit
+ * Post-conditions: rejected count is one higher
+ * **********************************************/
+void metricsReject()
+{
+    struct metricsSlot* slot = currentSlot();
+
+    if(slot != NULL)
+    {
+        __atomic_fetch_add(&slot->rejected, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*************************************************
+ * Function: metricsAccept
+ * Description: Counts a connection accepted from the listening socket, whether or not it gets past the handshake
+ * Params: none
+ * Returns: none
+ * Pre-conditions: none, does nothing before metricsInit
+ * Post-conditions: accepted count is one higher
+ * **********************************************/
+void metricsAccept()
+{
+    struct metricsSlot* slot = currentSlot();
+
+    if(slot != NULL)
+    {
+        __atomic_fetch_add(&slot->accepted, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*************************************************
+ * Function: metricsConnection
+ * Description: Opens or closes a connection in the count of connections being served
+ * Params: 1 when a connection starts being served, -1 when it is closed
+ * Returns: none
+ * Pre-conditions: none, does nothing before metricsInit
+ * Post-conditions: open connection count is updated
+ * **********************************************/
+void metricsConnection(int change)
+{
+    struct metricsSlot* slot = currentSlot();
+
+    if(slot != NULL)
+    {
+        __atomic_fetch_add(&slot->connections, change, __ATOMIC_RELAXED);
+    }
+}
+
+/*************************************************
+ * Function: metricsBytes
+ * Description: Counts bytes received from or sent to a client. Called from the socket helpers the clients share, where it
+ * costs a branch since they never map any metrics
+ * Params: bytes received, bytes sent
+ * Returns: none
+ * Pre-conditions: none, does nothing before metricsInit
+ * Post-conditions: byte counts are updated
+ * **********************************************/
+void metricsBytes(long received, long sent)
+{
+    struct metricsSlot* slot;
+
+    if(metrics == NULL || scraping)
+    {
+        return;
+    }
+    slot = currentSlot();
+    if(received > 0)
+    {
+        __atomic_fetch_add(&slot->bytesIn, (uint64_t)received, __ATOMIC_RELAXED);
+    }
+    if(sent > 0)
+    {
+        __atomic_fetch_add(&slot->bytesOut, (uint64_t)sent, __ATOMIC_RELAXED);
+    }
+}
+
+/*************************************************
+ * Function: metricsCipher
+ * Description: Adds the time one chunk pair took to transform to its histogram
+ * Params: timestamp from metricsStart taken just before the transform
+ * Returns: none
+ * Pre-conditions: none, does nothing before metricsInit
+ * Post-conditions: histogram is updated
+ * **********************************************/
+void metricsCipher(struct timespec* started)
+{
+    if(metrics != NULL)
+    {
+        histogramAdd(&currentSlot()->cipher, started);
+    }
+}
+
+/*************************************************
+ * Function: metricsQueueWait
+ * Description: Adds the time a chunk pair waited in a cipher thread's queue to its histogram
+ * Params: timestamp from metricsStart taken when the pair was queued
+ * Returns: none
+ * Pre-conditions: none, does nothing before metricsInit
+ * Post-conditions: histogram is updated
+ * **********************************************/
+void metricsQueueWait(struct timespec* queued)
+{
+    if(metrics != NULL)
+    {
+        histogramAdd(&currentSlot()->queueWait, queued);
+    }
+}
+
+/*************************************************
+ * Function: histogramAdd
+ * Description: Adds the time since a timestamp to a histogram
+ * Params: histogram, monotonic timestamp
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: the bucket the time falls in and the sum are updated atomically
+ * **********************************************/
+void histogramAdd(struct metricsHistogram* hist, struct timespec* started)
+{
+    struct timespec now;
+    int64_t elapsed, bound;
+    int bucket;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (int64_t)(now.tv_sec - started->tv_sec) * 1000000000 + (now.tv_nsec - started->tv_nsec);
+    bound = METRICS_FIRST_BOUND;
+    for(bucket=0;bucket<METRICS_BUCKETS-1 && elapsed>bound;bucket++)
+    {
+        bound *= 4;
+    }
+    __atomic_fetch_add(&hist->counts[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, (uint64_t)elapsed, __ATOMIC_RELAXED);
+}
+
+/*************************************************
+ * Function: metricsSum
+ * Description: Adds up every slot, counters read while workers add to them are each exact but not all from the same instant
+ * Params: slot to fill with the totals, address to store how many workers have a connection open
+ * Returns: none
+ * Pre-conditions: metricsInit has run
+ * Post-conditions: total holds the sums
+ * **********************************************/
+void metricsSum(struct metricsSlot* total, int* busyWorkers)
+{
+    struct metricsSlot* slot;
+    int i, j, op;
+
+    memset(total, '\0', sizeof(*total));
+    *busyWorkers = 0;
+    for(i=0;i<METRICS_SLOTS;i++)
+    {
+        slot = &metrics->slot[i];
+        for(op=OTP_OP_ENC;op<=OTP_OP_DEC;op++)
+        {
+            total->op[op].requests += __atomic_load_n(&slot->op[op].requests, __ATOMIC_RELAXED);
+            total->op[op].errors += __atomic_load_n(&slot->op[op].errors, __ATOMIC_RELAXED);
+            total->op[op].characters += __atomic_load_n(&slot->op[op].characters, __ATOMIC_RELAXED);
+            total->op[op].nanoseconds += __atomic_load_n(&slot->op[op].nanoseconds, __ATOMIC_RELAXED);
+        }
+        total->rejected += __atomic_load_n(&slot->rejected, __ATOMIC_RELAXED);
+        total->accepted += __atomic_load_n(&slot->accepted, __ATOMIC_RELAXED);
+        total->bytesIn += __atomic_load_n(&slot->bytesIn, __ATOMIC_RELAXED);
+        total->bytesOut += __atomic_load_n(&slot->bytesOut, __ATOMIC_RELAXED);
+        total->connections += __atomic_load_n(&slot->connections, __ATOMIC_RELAXED);
+        if(i > 0 && __atomic_load_n(&slot->connections, __ATOMIC_RELAXED) > 0)
+        {
+            (*busyWorkers)++;
+        }
+        for(j=0;j<METRICS_BUCKETS;j++)
+        {
+            total->cipher.counts[j] += __atomic_load_n(&slot->cipher.counts[j], __ATOMIC_RELAXED);
+            total->queueWait.counts[j] += __atomic_load_n(&slot->queueWait.counts[j], __ATOMIC_RELAXED);
+        }
+        total->cipher.sum += __atomic_load_n(&slot->cipher.sum, __ATOMIC_RELAXED);
+        total->queueWait.sum += __atomic_load_n(&slot->queueWait.sum, __ATOMIC_RELAXED);
+    }
+    //A connection closed on another slot than it was opened on can make a slot go below zero, never the total
+    if(total->connections < 0)
+    {
+        total->connections = 0;
+    }
+}
+
+/*************************************************
+ * Function: metricsReport
+ * Description: Prints one line per operation the daemon runs plus the rejected handshakes
+ * Params: stream to print to, operations the daemon runs
+ * Returns: none
+ * Pre-conditions: metricsInit has run
+ * Post-conditions: report is printed and flushed
+ * **********************************************/
+void metricsReport(FILE* out, int ops)
+{
+    int op, busyWorkers;
+    struct metricsSlot total;
+    struct opMetrics* m;
+
+    if(metrics == NULL)
+    {
+        return;
+    }
+    metricsSum(&total, &busyWorkers);
+    for(op=OTP_OP_ENC;op<=OTP_OP_DEC;op++)
+    {
+        if(!(ops & op))
+        {
+            continue;
+        }
+        m = &total.op[op];
+        fprintf(out, "%s metrics: %s requests %llu errors %llu characters %llu seconds %.6f\n", otpProgramName,
+                (op == OTP_OP_ENC) ? "enc" : "dec", (unsigned long long)m->requests, (unsigned long long)m->errors,
+                (unsigned long long)m->characters, m->nanoseconds / 1e9);
+    }
+    fprintf(out, "%s metrics: rejected %llu\n", otpProgramName, (unsigned long long)total.rejected);
+    fflush(out);
+}
+
+/*************************************************
+ * Function: metricsWrite
+ * Description: Writes every metric in the Prometheus text format, counters per operation carry an op label
+ * Params: stream to write to, operations the daemon runs
+ * Returns: none
+ * Pre-conditions: metricsInit has run
+ * Post-conditions: stream is written but not flushed
+ * **********************************************/
+void metricsWrite(FILE* out, int ops)
+{
+    int op, busyWorkers;
+    struct metricsSlot total;
+
+    metricsSum(&total, &busyWorkers);
+    fprintf(out, "# HELP otp_requests_total Requests fully answered.\n# TYPE otp_requests_total counter\n");
+    for(op=OTP_OP_ENC;op<=OTP_OP_DEC;op++)
+    {
+        if(ops & op)
+        {
+            fprintf(out, "otp_requests_total{op=\"%s\"} %llu\n", (op == OTP_OP_ENC) ? "enc" : "dec",
+                    (unsigned long long)total.op[op].requests);
+        }
+    }
+    fprintf(out, "# HELP otp_request_errors_total Requests that failed after the handshake.\n"
+                 "# TYPE otp_request_errors_total counter\n");
+    for(op=OTP_OP_ENC;op<=OTP_OP_DEC;op++)
+    {
+        if(ops & op)
+        {
+            fprintf(out, "otp_request_errors_total{op=\"%s\"} %llu\n", (op == OTP_OP_ENC) ? "enc" : "dec",
+                    (unsigned long long)total.op[op].errors);
+        }
+    }
+    fprintf(out, "# HELP otp_characters_total Characters transformed by answered requests.\n"
+                 "# TYPE otp_characters_total counter\n");
+    for(op=OTP_OP_ENC;op<=OTP_OP_DEC;op++)
+    {
+        if(ops & op)
+        {
+            fprintf(out, "otp_characters_total{op=\"%s\"} %llu\n", (op == OTP_OP_ENC) ? "enc" : "dec",
+                    (unsigned long long)total.op[op].characters);
+        }
+    }
+    fprintf(out, "# HELP otp_request_seconds_total Time from handshake to the end of the answer, summed over answered requests.\n"
+                 "# TYPE otp_request_seconds_total counter\n");
+    for(op=OTP_OP_ENC;op<=OTP_OP_DEC;op++)
+    {
+        if(ops & op)
+        {
+            fprintf(out, "otp_request_seconds_total{op=\"%s\"} %.9f\n", (op == OTP_OP_ENC) ? "enc" : "dec",
+                    total.op[op].nanoseconds / 1e9);
+        }
+    }
+    fprintf(out, "# HELP otp_connections_accepted_total Connections accepted.\n# TYPE otp_connections_accepted_total counter\n"
+                 "otp_connections_accepted_total %llu\n", (unsigned long long)total.accepted);
+    fprintf(out, "# HELP otp_handshake_rejections_total Clients turned away at the handshake.\n"
+                 "# TYPE otp_handshake_rejections_total counter\notp_handshake_rejections_total %llu\n",
+            (unsigned long long)total.rejected);
+    fprintf(out, "# HELP otp_received_bytes_total Bytes received from clients.\n# TYPE otp_received_bytes_total counter\n"
+                 "otp_received_bytes_total %llu\n", (unsigned long long)total.bytesIn);
+    fprintf(out, "# HELP otp_sent_bytes_total Bytes sent to clients.\n# TYPE otp_sent_bytes_total counter\n"
+                 "otp_sent_bytes_total %llu\n", (unsigned long long)total.bytesOut);
+    fprintf(out, "# HELP otp_open_connections Connections being served.\n# TYPE otp_open_connections gauge\n"
+                 "otp_open_connections %lld\n", (long long)total.connections);
+    fprintf(out, "# HELP otp_active_workers Workers serving at least one connection.\n# TYPE otp_active_workers gauge\n"
+                 "otp_active_workers %d\n", busyWorkers);
+    writeHistogram(out, "otp_cipher_seconds", "Time to transform one chunk pair or legacy message.", &total.cipher);
+    writeHistogram(out, "otp_queue_wait_seconds", "Time a chunk pair waited for a cipher thread.", &total.queueWait);
+}
+
+/*************************************************
+ * Function: writeHistogram
+ * Description: Writes a histogram in the Prometheus text format, the buckets are cumulative and in seconds
+ * Params: stream, metric name, help text, histogram in nanoseconds
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: stream is written
+ * **********************************************/
+void writeHistogram(FILE* out, const char* name, const char* help, struct metricsHistogram* hist)
+{
+    uint64_t count;
+    double bound;
+    int i;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    count = 0;
+    bound = METRICS_FIRST_BOUND / 1e9;
+    for(i=0;i<METRICS_BUCKETS-1;i++)
+    {
+        count += hist->counts[i];
+        fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, bound, (unsigned long long)count);
+        bound *= 4;
+    }
+    count += hist->counts[METRICS_BUCKETS-1];
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name, (unsigned long long)count, name,
+            hist->sum / 1e9, name, (unsigned long long)count);
+}
+
+/*************************************************
+ * Function: metricsServe
+ * Description: Metrics server loop, answers one HTTP request per connection with the metrics in the Prometheus text format.
+ * Runs in a process of its own so a slow scraper never holds up a worker
+ * Params: listening socket for the metrics port, operations the daemon runs
+ * Returns: none, loops forever
+ * Pre-conditions: metricsInit has run, socket is bound and listening
+ * Post-conditions: none
+ * **********************************************/
+void metricsServe(int listenSocketFD, int ops)
+{
+    int establishedConnectionFD;
+    struct timeval timeout;
+
+    scraping = 1;
+    timeout.tv_sec = HTTP_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    while(1)
+    {
+        establishedConnectionFD = accept(listenSocketFD, NULL, NULL);
+        if(establishedConnectionFD < 0)
+        {
+            if(errno != EINTR)
+            {
+                fprintf(stderr, "%s error: on metrics accept\n", otpProgramName);
+            }
+            continue;
+        }
+        //A scraper that connects and says nothing is dropped instead of holding up the next one
+        setsockopt(establishedConnectionFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(establishedConnectionFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serveScrape(establishedConnectionFD, ops);
+        close(establishedConnectionFD);
+    }
+}
+
+/*************************************************
+ * Function: serveScrape
+ * Description: Reads an HTTP request up to the end of its headers and answers it, GET of / or /metrics gets the metrics
+ * and anything else a 404. The connection is closed after the answer
+ * Params: connected socket, operations the daemon runs
+ * Returns: none
+ * Pre-conditions: metricsInit has run
+ * Post-conditions: answer is sent, socket is left open for the caller to close
+ * **********************************************/
+void serveScrape(int socketFD, int ops)
+{
+    char request[HTTP_REQUEST_MAX + 1], header[256], *body = NULL, *path;
+    int got, charsRead, headerLen;
+    size_t bodyLen = 0;
+    FILE* out;
+
+    got = 0;
+    while(got < HTTP_REQUEST_MAX)
+    {
+        charsRead = recv(socketFD, &request[got], HTTP_REQUEST_MAX - got, 0);
+        if(charsRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(charsRead <= 0)
+        {
+            return;
+        }
+        got += charsRead;
+        request[got] = '\0';
+        if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+        {
+            break;
+        }
+    }
+
+    //Only the request line matters, anything after the path is ignored
+    path = NULL;
+    if(strncmp(request, "GET ", 4) == 0)
+    {
+        path = &request[4];
+        path[strcspn(path, " ?\r\n")] = '\0';
+    }
+    if(path == NULL || (strcmp(path, "/") != 0 && strcmp(path, "/metrics") != 0))
+    {
+        headerLen = snprintf(header, sizeof(header), "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+                             "Content-Length: 10\r\nConnection: close\r\n\r\nnot found\n");
+        sendAll(socketFD, header, headerLen);
+        return;
+    }
+
+    out = open_memstream(&body, &bodyLen);
+    if(out == NULL)
+    {
+        return;
+    }
+    metricsWrite(out, ops);
+    fclose(out);
+    headerLen = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\nConnection: close\r\n\r\n", bodyLen);
+    if(sendAll(socketFD, header, headerLen) == 0)
+    {
+        sendAll(socketFD, body, bodyLen);
+    }
+    free(body);
+}
@@ -0,0 +1,191 @@
+//Socket setup and error reporting shared by the clients and daemons
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "otp.h"
+
+//Set by each front-end, this default only shows up if one forgets
+const char* otpProgramName = "otp";
+
+/*************************************************
+ * Function: fillAddrStruct
+ * Description: Sets up the server address struct and fills other information like the port number. A port argument with a
+ * slash in it is the path of a Unix domain socket instead, for clients on the same host
+ * Params: address of the address struct, address of portnumber integer, port number or socket path argument,
+ * host to connect to or NULL for a daemon that accepts on any address
+ * Returns: none
+ * Pre-conditions: proper addresses and arguments are passed in
+ * Post-conditions: server address struct is filled and port number is given, 0 for a socket path. Exit if errors.
+ * **********************************************/
+void fillAddrStruct(struct sockaddr_storage* address, int* portNumber, char* portArg, const char* hostName)
+{
+    struct hostent* serverHostInfo;
+    struct sockaddr_in* serverAddress = (struct sockaddr_in*)address;
+    struct sockaddr_un* socketPath = (struct sockaddr_un*)address;
+
+    //Clear out address struct
+    memset((char*)address, '\0', sizeof(*address));
+
+    //Unix domain socket, the path is the whole address
+    if(strchr(portArg, '/') != NULL)
+    {
+        if(strlen(portArg) >= sizeof(socketPath->sun_path))
+        {
+            fprintf(stderr, "%s error: socket path %s is too long\n", otpProgramName, portArg);
+            exit(1);
+        }
+        socketPath->sun_family = AF_UNIX;
+        strcpy(socketPath->sun_path, portArg);
+        *portNumber = 0;
+        return;
+    }
+
+    //Obtain port number from command line
+    *portNumber = atoi(portArg);
+
+    //Create network capable socket
+    serverAddress->sin_family = AF_INET;
+    //Store port number and convert from LSB to MSB form
+    serverAddress->sin_port = htons(*portNumber);
+
+    //Daemon, allow any address for connection
+    if(hostName == NULL)
+    {
+        serverAddress->sin_addr.s_addr = INADDR_ANY;
+        return;
+    }
+
+    //Client, convert the machine name into a special form of address
+    serverHostInfo = gethostbyname(hostName);
+    if(serverHostInfo == NULL)
+    {
+        fprintf(stderr, "%s error: no such host\n", otpProgramName);
+        exit(0);
+    }
+    //Copy in the address
+    memcpy((char*)&serverAddress->sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length);
+}
+
+/*************************************************
+ * Function: addrLength
+ * Description: Gets the size of the address filled in by fillAddrStruct, for bind and connect
+ * Params: address of the address struct
+ * Returns: size of the address for its family
+ * Pre-conditions: address was filled by fillAddrStruct
+ * Post-conditions: none
+ * **********************************************/
+socklen_t addrLength(const struct sockaddr_storage* address)
+{
+    return (address->ss_family == AF_UNIX) ? sizeof(struct sockaddr_un) : sizeof(struct sockaddr_in);
+}
+
+/*************************************************
+ * Function: setSocket
+ * Description: sets up a socket for communication, a listening socket is also bound and put in listening mode. A socket path
+ * left behind by a daemon that is gone is taken over, one that a daemon still answers on is an error. A TCP listening socket
+ * can be bound again right after a restart. With reusePort any number of sockets bind the same TCP port and the kernel spreads
+ * new connections across the ones listening, so each worker can accept on its own socket without sharing a queue
+ * Params: address of socket file descriptor var, address of server address struct, listen backlog or 0 for a client socket,
+ * nonzero to set SO_REUSEPORT. A reusePort socket with a backlog of 0 is only bound, it holds the port without taking any
+ * of its connections
+ * Returns: none
+ * Pre-conditions: correct arguments passed in, reusePort only for a TCP port
+ * Post-conditions: socket file descriptor is set and exits on error
+ * **********************************************/
+void setSocket(int* socketFD, struct sockaddr_storage* serverAddress, int backlog, int reusePort)
+{
+    int one = 1, probeFD;
+
+    //Fill socket file descriptor
+    *socketFD = socket(serverAddress->ss_family, SOCK_STREAM, 0);
+    if(*socketFD < 0)
+    {
+        error("opening socket", 1);
+    }
+    //Headers and payloads go out in separate writes, without this the second waits for the peer's delayed ack.
+    //Accepted sockets inherit it from the listening socket
+    if(serverAddress->ss_family == AF_INET)
+    {
+        setsockopt(*socketFD, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    //A client connects later, nothing more to do
+    if(backlog == 0 && !reusePort)
+    {
+        return;
+    }
+    //Connections of an earlier daemon still in TIME_WAIT do not keep the port
+    if(serverAddress->ss_family == AF_INET)
+    {
+        setsockopt(*socketFD, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if(reusePort && setsockopt(*socketFD, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        error("setting SO_REUSEPORT", 1);
+    }
+    if(bind(*socketFD, (struct sockaddr *)serverAddress, addrLength(serverAddress)) < 0)
+    {
+        //A socket path nobody is listening on any more is stale, take it over
+        if(serverAddress->ss_family != AF_UNIX || errno != EADDRINUSE)
+        {
+            error("on binding", 1);
+        }
+        probeFD = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(probeFD < 0 || connect(probeFD, (struct sockaddr *)serverAddress, addrLength(serverAddress)) == 0 || errno != ECONNREFUSED ||
+           unlink(((struct sockaddr_un*)serverAddress)->sun_path) < 0 || bind(*socketFD, (struct sockaddr *)serverAddress, addrLength(serverAddress)) < 0)
+        {
+            error("on binding", 1);
+        }
+        close(probeFD);
+    }
+
+    //Listen for connections, the kernel caps the backlog at net.core.somaxconn
+    if(backlog > 0 && listen(*socketFD, backlog) < 0)
+    {
+        error("on listening", 1);
+    }
+}
+
+/*************************************************
+ * Function: error
+ * Description: prints specified error message after the program name and the reason from errno, then exits with specified code
+ * Params: error message, exit code
+ * Returns: none
+ * Pre-conditions: valid exit code given
+ * Post-conditions: exits process and prints error message to stderr
+ * **********************************************/
+void error(const char *msg, int n)
+{
+    fprintf(stderr, "%s error: ", otpProgramName);
+    perror(msg);
+    exit(n);
+}
+
+/*************************************************
+ * Function: setNonBlocking
+ * Description: Puts a file descriptor into non-blocking mode
+ * Params: file descriptor
+ * Returns: none
+ * Pre-conditions: file descriptor is open
+ * Post-conditions: O_NONBLOCK is set on the file descriptor, exits on error
+ * **********************************************/
+void setNonBlocking(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        error("setting non-blocking mode", 1);
+    }
+}
+
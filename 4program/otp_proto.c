@@ -0,0 +1,422 @@
+//Binary protocol framing and buffered socket I/O shared by the clients and daemons
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "otp.h"
+
+/*************************************************
+ * Function: encodeHeader
+ * Description: Packs a binary protocol header, multi-byte fields go out in network byte order
+ * Params: buffer of OTP_HEADER_SIZE bytes, message type, flags, payload length, request id
+ * Returns: none
+ * Pre-conditions: buffer is large enough
+ * Post-conditions: buffer holds the header ready to send
+ * **********************************************/
+void encodeHeader(unsigned char* buffer, int type, int flags, uint32_t length, uint32_t id)
+{
+    buffer[0] = OTP_MAGIC;
+    buffer[1] = OTP_VERSION;
+    buffer[2] = type;
+    buffer[3] = flags;
+    buffer[4] = length >> 24;
+    buffer[5] = length >> 16;
+    buffer[6] = length >> 8;
+    buffer[7] = length;
+    buffer[8] = id >> 24;
+    buffer[9] = id >> 16;
+    buffer[10] = id >> 8;
+    buffer[11] = id;
+}
+
+/*************************************************
+ * Function: decodeHeader
+ * Description: Unpacks a binary protocol header and checks the magic byte and version
+ * Params: buffer of OTP_HEADER_SIZE bytes, address of header struct
+ * Returns: 0 if the header is valid, -1 otherwise
+ * Pre-conditions: buffer holds a whole header
+ * Post-conditions: header struct is filled in host byte order
+ * **********************************************/
+int decodeHeader(const unsigned char* buffer, struct otpHeader* header)
+{
+    header->magic = buffer[0];
+    header->version = buffer[1];
+    header->type = buffer[2];
+    header->flags = buffer[3];
+    header->length = ((uint32_t)buffer[4] << 24) | ((uint32_t)buffer[5] << 16) | ((uint32_t)buffer[6] << 8) | buffer[7];
+    header->id = ((uint32_t)buffer[8] << 24) | ((uint32_t)buffer[9] << 16) | ((uint32_t)buffer[10] << 8) | buffer[11];
+
+    if(header->magic != OTP_MAGIC || header->version != OTP_VERSION)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: sendHeader
+ * Description: Encodes and sends a binary protocol header
+ * Params: socket file descriptor, message type, flags, payload length, request id
+ * Returns: 0 on success, -1 on a socket error
+ * Pre-conditions: socket is connected
+ * Post-conditions: header has been sent
+ * **********************************************/
+int sendHeader(int socketFD, int type, int flags, uint32_t length, uint32_t id)
+{
+    unsigned char buffer[OTP_HEADER_SIZE];
+
+    encodeHeader(buffer, type, flags, length, id);
+    return sendAll(socketFD, (char*)buffer, OTP_HEADER_SIZE);
+}
+
+/*************************************************
+ * Function: recvHeader
+ * Description: Receives and decodes a binary protocol header
+ * Params: socket file descriptor, address of header struct
+ * Returns: 0 on success, -1 on a socket error, early close or a bad header
+ * Pre-conditions: socket is connected
+ * Post-conditions: header struct is filled
+ * **********************************************/
+int recvHeader(int socketFD, struct otpHeader* header)
+{
+    unsigned char buffer[OTP_HEADER_SIZE];
+
+    if(recvAll(socketFD, (char*)buffer, OTP_HEADER_SIZE) < 0)
+    {
+        return -1;
+    }
+    return decodeHeader(buffer, header);
+}
+
+/*************************************************
+ * Function: recvHeaderFDs
+ * Description: recvHeader for a Unix domain socket, keeps any file descriptors passed along with the header
+ * Params: socket file descriptor, address of header struct, array of MAX_PASSED_FDS descriptors, address of their count
+ * Returns: 0 on success, -1 on a socket error, early close or a bad header
+ * Pre-conditions: socket is connected, count starts at 0
+ * Post-conditions: header struct is filled, passed descriptors are in the array and belong to the caller
+ * **********************************************/
+int recvHeaderFDs(int socketFD, struct otpHeader* header, int* fds, int* numFDs)
+{
+    unsigned char buffer[OTP_HEADER_SIZE];
+    int charsRead, got;
+
+    //The kernel ends a read at a message carrying descriptors, so a header may take more than one
+    for(got=0;got<OTP_HEADER_SIZE;got+=charsRead)
+    {
+        charsRead = recvFDs(socketFD, (char*)&buffer[got], OTP_HEADER_SIZE - got, MSG_WAITALL, fds, numFDs);
+        if(charsRead < 0 && errno == EINTR)
+        {
+            charsRead = 0;
+            continue;
+        }
+        if(charsRead <= 0)
+        {
+            return -1;
+        }
+    }
+    return decodeHeader(buffer, header);
+}
+
+/*************************************************
+ * Function: sendFDs
+ * Description: Sends bytes with file descriptors attached as SCM_RIGHTS, the receiver gets its own copies of the descriptors
+ * Params: Unix domain socket file descriptor, data, number of bytes, array of file descriptors, number of descriptors
+ * Returns: number of bytes sent, -1 on error with errno set like send
+ * Pre-conditions: socket is connected, no more than MAX_PASSED_FDS descriptors
+ * Post-conditions: descriptors went with the first byte sent, if any was
+ * **********************************************/
+int sendFDs(int socketFD, const char* data, int len, const int* fds, int numFDs)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    int charsWritten;
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    } control;
+
+    memset(&msg, '\0', sizeof(msg));
+    memset(&control, '\0', sizeof(control));
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = CMSG_SPACE(numFDs * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(numFDs * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, numFDs * sizeof(int));
+    charsWritten = sendmsg(socketFD, &msg, MSG_NOSIGNAL);
+    metricsBytes(0, charsWritten);
+    return charsWritten;
+}
+
+/*************************************************
+ * Function: recvFDs
+ * Description: recv that also takes file descriptors passed with SCM_RIGHTS. They are added to the caller's array,
+ * any that do not fit are closed right away
+ * Params: socket file descriptor, destination, number of bytes, recv flags, array of MAX_PASSED_FDS descriptors,
+ * address of the number already in it
+ * Returns: number of bytes received like recv
+ * Pre-conditions: socket is connected
+ * Post-conditions: passed descriptors are in the array, close on exec, and belong to the caller
+ * **********************************************/
+int recvFDs(int socketFD, char* dest, int len, int flags, int* fds, int* numFDs)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    int charsRead, count, passed, i;
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    } control;
+
+    memset(&msg, '\0', sizeof(msg));
+    iov.iov_base = dest;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    charsRead = recvmsg(socketFD, &msg, flags | MSG_CMSG_CLOEXEC);
+    if(charsRead < 0)
+    {
+        return -1;
+    }
+    metricsBytes(charsRead, 0);
+
+    for(cmsg=CMSG_FIRSTHDR(&msg);cmsg!=NULL;cmsg=CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(i=0;i<count;i++)
+        {
+            memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if(*numFDs < MAX_PASSED_FDS)
+            {
+                fds[(*numFDs)++] = passed;
+            }
+            else
+            {
+                close(passed);
+            }
+        }
+    }
+    return charsRead;
+}
+
+/*************************************************
+ * Function: sendAll
+ * Description: Sends len bytes, calling send again after short writes
+ * Params: socket file descriptor, data, number of bytes
+ * Returns: 0 on success, -1 on a socket error
+ * Pre-conditions: socket is connected
+ * Post-conditions: all bytes have been handed to the kernel
+ * **********************************************/
+int sendAll(int socketFD, const char* data, int len)
+{
+    int charsWritten;
+
+    while(len > 0)
+    {
+        charsWritten = send(socketFD, data, len, MSG_NOSIGNAL);
+        if(charsWritten < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        metricsBytes(0, charsWritten);
+        data += charsWritten;
+        len -= charsWritten;
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: recvAll
+ * Description: Receives exactly len bytes straight into the destination
+ * Params: socket file descriptor, destination buffer, number of bytes
+ * Returns: 0 on success, -1 on a socket error or if the peer closed early
+ * Pre-conditions: destination holds at least len bytes
+ * Post-conditions: destination is filled
+ * **********************************************/
+int recvAll(int socketFD, char* dest, int len)
+{
+    int charsRead;
+
+    while(len > 0)
+    {
+        charsRead = recv(socketFD, dest, len, MSG_WAITALL);
+        if(charsRead < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if(charsRead == 0)
+        {
+            return -1;
+        }
+        metricsBytes(charsRead, 0);
+        dest += charsRead;
+        len -= charsRead;
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: recvUntil
+ * Description: Buffered receive, copies bytes up to the terminator into dest. Reads from the socket in large chunks and
+ * only searches the bytes that just arrived, anything read past the terminator stays in the buffer for the next call
+ * Params: address of receive buffer, address of heap destination buffer, address of its size, terminator character
+ * Returns: number of bytes copied, not counting the terminator, or -1 on a socket error or a message over MAX_PAYLOAD
+ * Pre-conditions: receive buffer was set up with the socket file descriptor and start and end of 0, dest is NULL or from malloc
+ * Post-conditions: terminator is consumed, a closed connection ends the message early, dest has room for one more byte
+ * **********************************************/
+int recvUntil(struct recvBuffer* rb, char** dest, int* destSize, char terminator)
+{
+    int copied, avail, charsRead, newSize;
+    char *marker, *newBuffer;
+
+    copied = 0;
+    while(1)
+    {
+        //Only search the bytes we have not looked at yet
+        avail = rb->end - rb->start;
+        marker = memchr(&rb->data[rb->start], terminator, avail);
+        if(marker != NULL)
+        {
+            avail = marker - &rb->data[rb->start];
+        }
+        if(copied + avail > MAX_PAYLOAD)
+        {
+            return -1;
+        }
+
+        //Grow dest, keeping a spare byte so the caller can terminate it
+        if(*dest == NULL || copied + avail + 1 > *destSize)
+        {
+            newSize = *destSize ? *destSize : RECV_CHUNK;
+            while(newSize < copied + avail + 1)
+            {
+                newSize *= 2;
+            }
+            newBuffer = realloc(*dest, newSize);
+            if(newBuffer == NULL)
+            {
+                return -1;
+            }
+            *dest = newBuffer;
+            *destSize = newSize;
+        }
+        memcpy(&(*dest)[copied], &rb->data[rb->start], avail);
+        copied += avail;
+
+        if(marker != NULL)
+        {
+            //Skip past the terminator
+            rb->start += avail + 1;
+            return copied;
+        }
+
+        //Buffer used up, get the next chunk
+        rb->start = 0;
+        rb->end = 0;
+        charsRead = recv(rb->fd, rb->data, sizeof(rb->data), 0);
+        if(charsRead < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        //Connection closed, whatever arrived is the whole message
+        if(charsRead == 0)
+        {
+            return copied;
+        }
+        metricsBytes(charsRead, 0);
+        rb->end = charsRead;
+    }
+}
+
+
+/*************************************************
+ * Function: legacyIdentifier
+ * Description: Gives the identifier bit a client and daemon trade in the legacy handshake for an operation
+ * Params: OTP_OP_ENC or OTP_OP_DEC
+ * Returns: '0' for encryption, '1' for decryption
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+char legacyIdentifier(int op)
+{
+    return (op == OTP_OP_ENC) ? '0' : '1';
+}
+
+/*************************************************
+ * Function: legacyOp
+ * Description: Reverse of legacyIdentifier, gives the operation a legacy client asked for with its identifier bit
+ * Params: identifier bit received
+ * Returns: OTP_OP_ENC for '0', OTP_OP_DEC for '1', 0 for anything else
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int legacyOp(char identifier)
+{
+    if(identifier == '0')
+    {
+        return OTP_OP_ENC;
+    }
+    if(identifier == '1')
+    {
+        return OTP_OP_DEC;
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: daemonName
+ * Description: Gives the name of the daemon that runs an operation, for error messages
+ * Params: OTP_OP_ENC or OTP_OP_DEC
+ * Returns: daemon program name
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+const char* daemonName(int op)
+{
+    return (op == OTP_OP_ENC) ? "otp_enc_d" : "otp_dec_d";
+}
+
+/*************************************************
+ * Function: otherOp
+ * Description: Gives the opposite operation
+ * Params: OTP_OP_ENC or OTP_OP_DEC
+ * Returns: OTP_OP_DEC for OTP_OP_ENC and the other way around
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int otherOp(int op)
+{
+    return (op == OTP_OP_ENC) ? OTP_OP_DEC : OTP_OP_ENC;
+}
@@ -0,0 +1,223 @@
+//Shared memory ring between a client and a daemon on the same machine, set up over a Unix domain socket connection
+//The client fills slots with chunk pairs and the daemon writes each result back over its pair, the slot states are the
+//only thing the two sides touch at the same time. A side that finds nothing to do spins a little, then sleeps on a futex,
+//and the other side only makes a system call to wake it when it said it was going to sleep
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "otp.h"
+
+//Checks of a slot before going to sleep on it, a busy peer usually finishes a slot within that
+#define RING_SPINS 1024
+//How long one sleep lasts before the socket is checked for a peer that went away without closing the ring
+#define RING_CHECK_MS 100
+
+//Spins ringWait makes, none on a single processor where the peer can not run while we spin. -1 until the first wait
+static int ringSpins = -1;
+
+//Prototypes
+int futexWait(uint32_t*, uint32_t, int);
+void futexWake(uint32_t*);
+int peerGone(int);
+
+/*************************************************
+ * Function: ringCreate
+ * Description: Creates an anonymous shared memory file the size of a ring and maps it. The file is sealed at that size so
+ * the daemon can map it without the client being able to shrink it under the daemon's feet
+ * Params: address to store the file descriptor, it is what gets passed to the daemon
+ * Returns: address of the zeroed ring, every slot free, NULL on error
+ * Pre-conditions: none
+ * Post-conditions: on success the descriptor is open and the ring mapped
+ * **********************************************/
+struct otpRing* ringCreate(int* ringFD)
+{
+    struct otpRing* ring;
+
+    *ringFD = memfd_create("otp_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(*ringFD < 0)
+    {
+        return NULL;
+    }
+    if(ftruncate(*ringFD, sizeof(struct otpRing)) < 0 ||
+       fcntl(*ringFD, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        close(*ringFD);
+        return NULL;
+    }
+    ring = mmap(NULL, sizeof(struct otpRing), PROT_READ | PROT_WRITE, MAP_SHARED, *ringFD, 0);
+    if(ring == MAP_FAILED)
+    {
+        close(*ringFD);
+        return NULL;
+    }
+    return ring;
+}
+
+/*************************************************
+ * Function: ringMap
+ * Description: Maps a ring a client passed, after checking it is a file of the right size that can not shrink
+ * Params: file descriptor from the client
+ * Returns: address of the ring, NULL if the descriptor is not a usable ring
+ * Pre-conditions: none
+ * Post-conditions: descriptor is untouched, the caller closes it
+ * **********************************************/
+struct otpRing* ringMap(int ringFD)
+{
+    struct stat info;
+    struct otpRing* ring;
+    int seals;
+
+    seals = fcntl(ringFD, F_GET_SEALS);
+    if(fstat(ringFD, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size != sizeof(struct otpRing) || seals < 0 ||
+       !(seals & F_SEAL_SHRINK))
+    {
+        return NULL;
+    }
+    ring = mmap(NULL, sizeof(struct otpRing), PROT_READ | PROT_WRITE, MAP_SHARED, ringFD, 0);
+    return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+/*************************************************
+ * Function: ringUnmap
+ * Description: Unmaps a ring, the memory goes away once both sides have unmapped it
+ * Params: address of the ring
+ * Returns: none
+ * Pre-conditions: ring came from ringCreate or ringMap
+ * Post-conditions: ring must not be used again
+ * **********************************************/
+void ringUnmap(struct otpRing* ring)
+{
+    munmap(ring, sizeof(struct otpRing));
+}
+
+/*************************************************
+ * Function: ringWait
+ * Description: Waits for the other side to move a slot out of a state. Spins first, then says it is waiting and sleeps
+ * on the slot's state. Every so often the socket is checked so a peer that died does not leave us waiting forever
+ * Params: slot state, state to wait out, this side's waiting flag in the ring, socket connected to the peer
+ * Returns: the new state, -1 if the peer is gone
+ * Pre-conditions: only the other side moves the slot out of this state
+ * Post-conditions: waiting flag is clear
+ * **********************************************/
+int ringWait(uint32_t* state, uint32_t from, uint32_t* waiting, int socketFD)
+{
+    uint32_t now;
+    int i;
+
+    //Every thread works out the same count, it does not matter which one stores it
+    if(ringSpins < 0)
+    {
+        ringSpins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? RING_SPINS : 0;
+    }
+    for(i=0;i<ringSpins;i++)
+    {
+        now = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+        if(now != from)
+        {
+            return now;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    while(1)
+    {
+        //The flag has to be visible before the state is read again, then a post either is seen here or sees the flag
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        now = __atomic_load_n(state, __ATOMIC_SEQ_CST);
+        if(now != from)
+        {
+            break;
+        }
+        if(futexWait(state, from, RING_CHECK_MS) < 0 && peerGone(socketFD))
+        {
+            __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return now;
+}
+
+/*************************************************
+ * Function: ringPost
+ * Description: Moves a slot to a new state, everything written to the slot before is visible to the other side once it
+ * sees the state. The other side is only woken with a system call if its waiting flag is set
+ * Params: slot state, new state, the other side's waiting flag in the ring
+ * Returns: none
+ * Pre-conditions: this side owns the slot in its current state
+ * Post-conditions: the slot belongs to the other side
+ * **********************************************/
+void ringPost(uint32_t* state, uint32_t to, uint32_t* waiting)
+{
+    __atomic_store_n(state, to, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+    {
+        futexWake(state);
+    }
+}
+
+/*************************************************
+ * Function: futexWait
+ * Description: Sleeps while a word in shared memory holds a value, the mapping is shared between processes so this is a
+ * shared futex
+ * Params: address of the word, value to sleep on, most milliseconds to sleep
+ * Returns: 0 if woken or the word had changed already, -1 on timeout
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int futexWait(uint32_t* word, uint32_t value, int timeoutMs)
+{
+    struct timespec timeout;
+
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+    if(syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0) < 0 && errno == ETIMEDOUT)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: futexWake
+ * Description: Wakes the side sleeping on a word in shared memory, there is never more than one
+ * Params: address of the word
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+void futexWake(uint32_t* word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*************************************************
+ * Function: peerGone
+ * Description: Checks the socket a ring was set up over, neither side sends anything on it once the ring is in use so
+ * anything readable means the peer closed it or sent something it should not have
+ * Params: socket file descriptor
+ * Returns: nonzero if the ring should be given up
+ * Pre-conditions: none
+ * Post-conditions: nothing is read from the socket
+ * **********************************************/
+int peerGone(int socketFD)
+{
+    struct pollfd pfd;
+
+    pfd.fd = socketFD;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
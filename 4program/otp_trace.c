@@ -0,0 +1,335 @@
+//Request tracing for the daemons, each thread records the spans it runs, handshake, receive, cipher and send, into a ring of
+//its own. A span is two reads of the time stamp counter and a store into the ring, no lock and no system call. SIGUSR2 makes
+//every worker write the latest spans of all its threads to a file in the Chrome trace event format, chrome://tracing and
+//Perfetto open it. With tracing off a span costs two calls that return right away
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "otp.h"
+
+//Spans each thread keeps, the oldest are overwritten once its ring is full
+#define TRACE_EVENTS 65536
+
+//One span, times are in time stamp counter ticks
+struct traceEvent
+{
+    uint64_t start, end;
+    long size;
+    int event;
+};
+
+//Spans of one thread, rings of all threads of a process are chained for the dump
+struct traceRing
+{
+    struct traceRing* next;
+    pid_t tid;
+    //Spans recorded so far, the newest is at (count - 1) % TRACE_EVENTS
+    uint64_t count;
+    struct traceEvent events[TRACE_EVENTS];
+};
+
+//Names of the spans in the trace, indexed by TRACE_HANDSHAKE and the rest
+static const char* traceNames[] = {"handshake", "accept", "receive", "cipher", "send"};
+
+//Nonzero once traceInit has run, checked first by every call
+static int traceEnabled = 0;
+//Where the dumps go, each worker writes prefix.pid.json
+static const char* tracePrefix;
+//Counter and monotonic clock read together when tracing started, ticks are turned into microseconds against them
+static uint64_t traceTicks0;
+static struct timespec traceClock0;
+//Set by SIGUSR2, the worker dumps when it next calls traceCheck
+static volatile sig_atomic_t dumpRequested = 0;
+//Ring of the calling thread, NULL until it records its first span
+static __thread struct traceRing* threadRing = NULL;
+//Every ring of a live thread in this process
+static struct traceRing* allRings = NULL;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+//Frees the ring of a thread when it exits, made once by the first thread that records a span
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+//Prototypes
+uint64_t readTicks();
+struct traceRing* newRing();
+void makeRingKey();
+void freeRing(void*);
+void requestDump(int);
+void traceDump();
+
+/*************************************************
+ * Function: traceInit
+ * Description: Turns tracing on for this process and every worker forked afterwards, the supervisor ignores SIGUSR2 so
+ * sending it to every process of the daemon is fine
+ * Params: path prefix of the dump files
+ * Returns: none
+ * Pre-conditions: called in the supervisor before the workers are forked
+ * Post-conditions: spans are recorded from now on
+ * **********************************************/
+void traceInit(const char* prefix)
+{
+    tracePrefix = prefix;
+    clock_gettime(CLOCK_MONOTONIC, &traceClock0);
+    traceTicks0 = readTicks();
+    traceEnabled = 1;
+    signal(SIGUSR2, SIG_IGN);
+}
+
+/*************************************************
+ * Function: traceWorker
+ * Description: Lets a freshly forked worker dump its spans on SIGUSR2. No SA_RESTART, the signal wakes a worker waiting on
+ * accept or epoll so it dumps even when idle
+ * Params: none
+ * Returns: none
+ * Pre-conditions: called in the worker before it starts serving
+ * Post-conditions: SIGUSR2 asks for a dump, nothing changes with tracing off
+ * **********************************************/
+void traceWorker()
+{
+    struct sigaction dumpAction;
+
+    if(!traceEnabled)
+    {
+        return;
+    }
+    memset(&dumpAction, '\0', sizeof(dumpAction));
+    dumpAction.sa_handler = requestDump;
+    sigemptyset(&dumpAction.sa_mask);
+    sigaction(SIGUSR2, &dumpAction, NULL);
+}
+
+/*************************************************
+ * Function: traceStart
+ * Description: Starts a span
+ * Params: none
+ * Returns: counter value to pass to traceEnd, 0 with tracing off
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+uint64_t traceStart()
+{
+    return traceEnabled ? readTicks() : 0;
+}
+
+/*************************************************
+ * Function: traceEnd
+ * Description: Ends a span and records it in the calling thread's ring, the first span of a thread allocates its ring
+ * Params: TRACE_HANDSHAKE, TRACE_ACCEPT, TRACE_RECEIVE, TRACE_CIPHER or TRACE_SEND, value from traceStart, bytes or
+ * characters the span handled
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: span is in the ring unless tracing is off or there was no memory for a ring
+ * **********************************************/
+void traceEnd(int event, uint64_t start, long size)
+{
+    struct traceEvent* e;
+    uint64_t count;
+
+    if(start == 0)
+    {
+        return;
+    }
+    if(threadRing == NULL)
+    {
+        threadRing = newRing();
+        if(threadRing == NULL)
+        {
+            return;
+        }
+    }
+    count = threadRing->count;
+    e = &threadRing->events[count % TRACE_EVENTS];
+    e->start = start;
+    e->end = readTicks();
+    e->size = size;
+    e->event = event;
+    //The dump reads the count first, the span has to be in place by then
+    __atomic_store_n(&threadRing->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/*************************************************
+ * Function: traceCheck
+ * Description: Dumps the spans if SIGUSR2 asked for it, called from the worker loops between requests
+ * Params: none
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: dump is written if one was asked for
+ * **********************************************/
+void traceCheck()
+{
+    if(dumpRequested)
+    {
+        dumpRequested = 0;
+        traceDump();
+    }
+}
+
+/*************************************************
+ * Function: readTicks
+ * Description: Reads the time stamp counter, nanoseconds of the monotonic clock where there is none
+ * Params: none
+ * Returns: ticks
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+uint64_t readTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/*************************************************
+ * Function: newRing
+ * Description: Allocates a ring for the calling thread and chains it with the others of the process. Threads come and go,
+ * a ring thread lives as long as its client, so the ring is freed again when its thread exits
+ * Params: none
+ * Returns: address of the ring, NULL if out of memory
+ * Pre-conditions: none
+ * Post-conditions: ring is empty and will be in the next dump while its thread lives
+ * **********************************************/
+struct traceRing* newRing()
+{
+    struct traceRing* ring;
+
+    pthread_once(&ringKeyOnce, makeRingKey);
+    ring = calloc(1, sizeof(struct traceRing));
+    if(ring == NULL)
+    {
+        fprintf(stderr, "%s error: out of memory for trace ring\n", otpProgramName);
+        return NULL;
+    }
+    ring->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&ringsLock);
+    ring->next = allRings;
+    allRings = ring;
+    pthread_mutex_unlock(&ringsLock);
+    pthread_setspecific(ringKey, ring);
+    return ring;
+}
+
+/*************************************************
+ * Function: makeRingKey
+ * Description: Makes the thread key whose destructor frees a thread's ring
+ * Params: none
+ * Returns: none
+ * Pre-conditions: called once through pthread_once
+ * Post-conditions: ringKey is ready
+ * **********************************************/
+void makeRingKey()
+{
+    pthread_key_create(&ringKey, freeRing);
+}
+
+/*************************************************
+ * Function: freeRing
+ * Description: Thread key destructor, takes an exiting thread's ring out of the chain and frees it. Its spans are lost,
+ * a dump only has the threads still running
+ * Params: ring of the exiting thread
+ * Returns: none
+ * Pre-conditions: called by pthread when a thread that recorded a span exits
+ * Post-conditions: ring is freed and no dump can reach it
+ * **********************************************/
+void freeRing(void* ring)
+{
+    struct traceRing** link;
+
+    pthread_mutex_lock(&ringsLock);
+    for(link=&allRings;*link!=NULL;link=&(*link)->next)
+    {
+        if(*link == ring)
+        {
+            *link = (*link)->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ringsLock);
+    free(ring);
+    threadRing = NULL;
+}
+
+/*************************************************
+ * Function: requestDump
+ * Description: SIGUSR2 handler, asks the worker to dump once it is back in its loop
+ * Params: signal number
+ * Returns: none
+ * Pre-conditions: installed by traceWorker
+ * Post-conditions: dumpRequested is set
+ * **********************************************/
+void requestDump(int sig)
+{
+    (void)sig;
+    dumpRequested = 1;
+}
+
+/*************************************************
+ * Function: traceDump
+ * Description: Writes the spans of every thread of the process to prefix.pid.json as Chrome trace events, times in
+ * microseconds of the monotonic clock so the files of all workers line up. Threads keep recording while it runs, one that
+ * fills its whole ring meanwhile can overwrite spans before they are written
+ * Params: none
+ * Returns: none
+ * Pre-conditions: traceInit has run
+ * Post-conditions: file holds the latest TRACE_EVENTS spans of each thread, an earlier dump of this worker is replaced
+ * **********************************************/
+void traceDump()
+{
+    char path[4096];
+    struct traceRing* ring;
+    struct traceEvent* e;
+    struct timespec now;
+    uint64_t ticks, count, i;
+    double ticksPerMicrosecond, start0;
+    int first;
+    FILE* out;
+
+    //Ticks per microsecond over everything since traceInit
+    ticks = readTicks();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ticksPerMicrosecond = (ticks - traceTicks0) /
+                          ((now.tv_sec - traceClock0.tv_sec) * 1e6 + (now.tv_nsec - traceClock0.tv_nsec) / 1e3);
+    start0 = traceClock0.tv_sec * 1e6 + traceClock0.tv_nsec / 1e3;
+
+    snprintf(path, sizeof(path), "%s.%d.json", tracePrefix, (int)getpid());
+    out = fopen(path, "w");
+    if(out == NULL)
+    {
+        fprintf(stderr, "%s error: failed to open %s for writing\n", otpProgramName, path);
+        return;
+    }
+    fprintf(out, "{\"traceEvents\":[\n");
+    first = 1;
+    pthread_mutex_lock(&ringsLock);
+    for(ring=allRings;ring!=NULL;ring=ring->next)
+    {
+        count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        for(i=(count > TRACE_EVENTS) ? count - TRACE_EVENTS : 0;i<count;i++)
+        {
+            e = &ring->events[i % TRACE_EVENTS];
+            fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"otp\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"size\":%ld}}", first ? "" : ",\n", traceNames[e->event],
+                    start0 + (int64_t)(e->start - traceTicks0) / ticksPerMicrosecond,
+                    (e->end - e->start) / ticksPerMicrosecond, (int)getpid(), (int)ring->tid, e->size);
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&ringsLock);
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(out);
+}
@@ -0,0 +1,322 @@
+//Checks that otp_keyd hands out every key character at most once, also across a restart, against daemons started in child
+//processes. Fetches two keys with keygen -p: they have to be different slices of the pool and the pool file's consumed
+//counter has to cover both. Then restarts the daemon on the same pool file: the counter has to still be there and a third
+//key has to be a slice neither of the first two had. Prints PASS or what went wrong.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "otp.h"
+
+//Characters per fetch and how many of them two keys may have in common before they count as the same slice, by chance
+//27^WINDOW is far out of reach
+#define KEY_LEN 5000
+#define WINDOW 32
+#define NUM_KEYS 3
+//How long to wait for the daemon to start listening, in tries 10ms apart
+#define CONNECT_TRIES 500
+
+//Start of the pool file as otp_keypool.c lays it out, only consumed is looked at
+struct poolHeader
+{
+    char magic[8];
+    uint64_t capacity;
+    uint64_t produced;
+    uint64_t consumed;
+};
+
+//Prototypes
+int startDaemon(char*, char*);
+void stopDaemon(int);
+int waitForDaemon(struct sockaddr_storage*);
+int fetchKey(char*, const char*, char*);
+long readConsumed(const char*);
+int sharesSlice(const char*, const char*);
+void pickPort(char*, int);
+
+int main()
+{
+    char dir[] = "/tmp/pool_testXXXXXX", poolPath[64], keyPath[64], port[16];
+    char keys[NUM_KEYS][KEY_LEN];
+    int daemonPid, portNumber, failures, i, j;
+    long consumed;
+    struct sockaddr_storage serverAddress;
+
+    otpProgramName = "pool_test";
+    if(mkdtemp(dir) == NULL)
+    {
+        fprintf(stderr, "pool_test error: could not make a directory in /tmp\n");
+        exit(1);
+    }
+    snprintf(poolPath, sizeof(poolPath), "%s/pool", dir);
+    snprintf(keyPath, sizeof(keyPath), "%s/key", dir);
+
+    daemonPid = -1;
+    failures = 0;
+    for(i=0;i<NUM_KEYS && failures == 0;i++)
+    {
+        //The last key comes from a new daemon on the same pool file
+        if(i == 0 || i == NUM_KEYS - 1)
+        {
+            if(i > 0)
+            {
+                stopDaemon(daemonPid);
+                consumed = readConsumed(poolPath);
+                if(consumed != (long)i*KEY_LEN)
+                {
+                    fprintf(stderr, "pool_test: consumed is %ld after the daemon stopped, expected %d\n", consumed, i*KEY_LEN);
+                    failures++;
+                }
+            }
+            pickPort(port, sizeof(port));
+            fillAddrStruct(&serverAddress, &portNumber, port, "localhost");
+            daemonPid = startDaemon(poolPath, port);
+            if(waitForDaemon(&serverAddress) < 0)
+            {
+                fprintf(stderr, "pool_test: daemon did not listen on port %s\n", port);
+                failures++;
+                break;
+            }
+            consumed = readConsumed(poolPath);
+            if(consumed != (long)i*KEY_LEN)
+            {
+                fprintf(stderr, "pool_test: consumed is %ld once the daemon started, expected %d\n", consumed, i*KEY_LEN);
+                failures++;
+            }
+        }
+
+        if(fetchKey(port, keyPath, keys[i]) < 0)
+        {
+            fprintf(stderr, "pool_test: keygen -p fetch %d failed\n", i + 1);
+            failures++;
+            break;
+        }
+        consumed = readConsumed(poolPath);
+        if(consumed != (long)(i + 1)*KEY_LEN)
+        {
+            fprintf(stderr, "pool_test: consumed is %ld after fetch %d, expected %d\n", consumed, i + 1, (i + 1)*KEY_LEN);
+            failures++;
+        }
+        for(j=0;j<i;j++)
+        {
+            if(sharesSlice(keys[i], keys[j]))
+            {
+                fprintf(stderr, "pool_test: fetch %d handed out key characters fetch %d already had\n", i + 1, j + 1);
+                failures++;
+            }
+        }
+    }
+
+    stopDaemon(daemonPid);
+    unlink(poolPath);
+    unlink(keyPath);
+    rmdir(dir);
+
+    if(failures > 0)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
+
+/*************************************************
+ * Function: startDaemon
+ * Description: Forks an otp_keyd with a 1 MB ring in a process group of its own
+ * Params: pool file path, port to listen on
+ * Returns: pid of the daemon, which is also its process group
+ * Pre-conditions: nothing else listens on the port and no other daemon has the pool file
+ * Post-conditions: daemon is starting, stopDaemon ends it
+ * **********************************************/
+int startDaemon(char* poolPath, char* port)
+{
+    char* daemonArgs[] = {"otp_keyd", "-f", poolPath, "-m", "1", port, NULL};
+    int pid;
+
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "pool_test error: fork failed\n");
+        exit(1);
+    }
+    else if(pid == 0)
+    {
+        setpgid(0, 0);
+        otpProgramName = "otp_keyd";
+        optind = 1;
+        exit(keyPoolMain(6, daemonArgs));
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+/*************************************************
+ * Function: stopDaemon
+ * Description: Kills a daemon started by startDaemon and waits for it, so its lock on the pool file is gone
+ * Params: pid of the daemon, -1 if none was started
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: daemon has exited
+ * **********************************************/
+void stopDaemon(int pid)
+{
+    if(pid > 0)
+    {
+        kill(-pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/*************************************************
+ * Function: waitForDaemon
+ * Description: Waits until the daemon takes connections, so the first fetch does not find nothing listening
+ * Params: address of the daemon
+ * Returns: 0 once a connection was made, -1 if the daemon never listened
+ * Pre-conditions: address is filled
+ * Post-conditions: the test connection is closed again without a request, which the daemon takes as a client leaving
+ * **********************************************/
+int waitForDaemon(struct sockaddr_storage* serverAddress)
+{
+    int socketFD, tries, connected;
+
+    for(tries=0;tries<CONNECT_TRIES;tries++)
+    {
+        socketFD = socket(AF_INET, SOCK_STREAM, 0);
+        if(socketFD < 0)
+        {
+            return -1;
+        }
+        connected = (connect(socketFD, (struct sockaddr*)serverAddress, addrLength(serverAddress)) == 0);
+        close(socketFD);
+        if(connected)
+        {
+            return 0;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+/*************************************************
+ * Function: fetchKey
+ * Description: Runs keygen -p in a child process with its output going to a file and reads the key back
+ * Params: port of the daemon, path of the output file, buffer for KEY_LEN characters
+ * Returns: 0 if a key of KEY_LEN characters and a newline came back, -1 otherwise
+ * Pre-conditions: daemon is listening
+ * Post-conditions: key holds the fetched characters
+ * **********************************************/
+int fetchKey(char* port, const char* keyPath, char* key)
+{
+    char buffer[KEY_LEN + 2];
+    int pid, status, fd, len;
+
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "pool_test error: fork failed\n");
+        exit(1);
+    }
+    else if(pid == 0)
+    {
+        fd = open(keyPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+        {
+            exit(1);
+        }
+        otpProgramName = "keygen";
+        poolKey(port, KEY_LEN);
+        exit(0);
+    }
+    if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return -1;
+    }
+
+    fd = open(keyPath, O_RDONLY);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    len = read(fd, buffer, sizeof(buffer));
+    close(fd);
+    if(len != KEY_LEN + 1 || buffer[KEY_LEN] != '\n')
+    {
+        return -1;
+    }
+    memcpy(key, buffer, KEY_LEN);
+    return 0;
+}
+
+/*************************************************
+ * Function: readConsumed
+ * Description: Reads the count of characters handed out from the pool file's header
+ * Params: pool file path
+ * Returns: consumed counter, -1 if the header could not be read
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+long readConsumed(const char* poolPath)
+{
+    struct poolHeader header;
+    int fd, len;
+
+    fd = open(poolPath, O_RDONLY);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    len = pread(fd, &header, sizeof(header), 0);
+    close(fd);
+    return (len == sizeof(header)) ? (long)header.consumed : -1;
+}
+
+/*************************************************
+ * Function: sharesSlice
+ * Description: Checks if two keys came from overlapping parts of the pool. Both are runs of the ring, so if they overlap by
+ * WINDOW characters or more, one of them starts inside the other
+ * Params: two keys of KEY_LEN characters
+ * Returns: 1 if the start of either key is found in the other, 0 otherwise
+ * Pre-conditions: none
+ * Post-conditions: none
+ * **********************************************/
+int sharesSlice(const char* a, const char* b)
+{
+    return memmem(a, KEY_LEN, b, WINDOW) != NULL || memmem(b, KEY_LEN, a, WINDOW) != NULL;
+}
+
+/*************************************************
+ * Function: pickPort
+ * Description: Picks a port nothing listens on by binding to port 0 and reading back the one the kernel chose
+ * Params: port string buffer, buffer size
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: buffer holds the port number as a string, exits if no socket could be bound
+ * **********************************************/
+void pickPort(char* port, int size)
+{
+    int socketFD;
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+
+    memset(&address, '\0', sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if(socketFD < 0 || bind(socketFD, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+       getsockname(socketFD, (struct sockaddr*)&address, &addressSize) < 0)
+    {
+        fprintf(stderr, "pool_test error: could not find a free port\n");
+        exit(1);
+    }
+    snprintf(port, size, "%d", ntohs(address.sin_port));
+    close(socketFD);
+}
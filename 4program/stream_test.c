@@ -0,0 +1,326 @@
+//Checks the binary protocol against daemons started in child processes, blocking, event loop and event loop with cipher threads
+//Opens one connection and sends several requests at once under ids picked out of order, their chunk pairs interleaved and
+//more pairs than the event loop lets the cipher threads hold, before reading anything. Every result has to come back under
+//its own id, in order within its request, as cipherBuffer would encrypt it. Prints PASS or what went wrong.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "otp.h"
+
+//Requests in flight on the one connection and the ids they go under, not in order and not starting at 0
+#define NUM_JOBS 8
+static const uint32_t jobIds[NUM_JOBS] = {42, 7, 1000, 3, 19, 0, 255, 64};
+//Chunk pairs per request and characters per chunk, NUM_JOBS * CHUNKS pairs is more than the 16 a connection may have
+//with the cipher threads, and small enough that every result fits in the socket buffers while we are still sending
+#define CHUNKS 3
+#define CHUNK_LEN 1000
+//How long to wait for the daemon to start listening, in tries 10ms apart, and for a result
+#define CONNECT_TRIES 500
+#define RESULT_TIMEOUT_SECONDS 10
+
+//Daemon modes checked, the port and worker count are added to each
+static char* modeArgs[][3] = {{NULL}, {"-e", NULL}, {"-t", "2", NULL}};
+static const char* modeNames[] = {"blocking", "event loop", "cipher threads"};
+#define NUM_MODES 3
+
+//One request, its text and key and what has come back so far
+struct testJob
+{
+    char text[CHUNKS*CHUNK_LEN], key[CHUNKS*CHUNK_LEN], expected[CHUNKS*CHUNK_LEN], result[CHUNKS*CHUNK_LEN];
+    int received, done;
+};
+
+//Prototypes
+int startDaemon(char**, char*);
+int connectDaemon(struct sockaddr_storage*);
+int sendJobs(int, struct testJob*);
+int readResults(int, struct testJob*, const char*);
+void fillRandom(char*, int);
+void pickPort(char*, int);
+
+int main()
+{
+    char port[16];
+    int mode, daemonPid, socketFD, portNumber, failures, i;
+    struct sockaddr_storage serverAddress;
+    struct testJob* jobs;
+
+    otpProgramName = "stream_test";
+    srand(time(NULL));
+    jobs = malloc(NUM_JOBS * sizeof(struct testJob));
+    if(jobs == NULL)
+    {
+        fprintf(stderr, "stream_test error: out of memory\n");
+        exit(1);
+    }
+
+    failures = 0;
+    for(mode=0;mode<NUM_MODES;mode++)
+    {
+        for(i=0;i<NUM_JOBS;i++)
+        {
+            fillRandom(jobs[i].text, sizeof(jobs[i].text));
+            fillRandom(jobs[i].key, sizeof(jobs[i].key));
+            cipherBuffer(jobs[i].text, jobs[i].key, jobs[i].expected, sizeof(jobs[i].text), CIPHER_ENCRYPT);
+            jobs[i].received = 0;
+            jobs[i].done = 0;
+        }
+
+        pickPort(port, sizeof(port));
+        fillAddrStruct(&serverAddress, &portNumber, port, "localhost");
+        daemonPid = startDaemon(modeArgs[mode], port);
+        socketFD = connectDaemon(&serverAddress);
+        if(socketFD < 0)
+        {
+            fprintf(stderr, "stream_test: %s daemon did not answer a hello on port %s\n", modeNames[mode], port);
+            failures++;
+        }
+        else
+        {
+            if(sendJobs(socketFD, jobs) < 0)
+            {
+                fprintf(stderr, "stream_test: %s daemon, sending the requests failed\n", modeNames[mode]);
+                failures++;
+            }
+            else
+            {
+                failures += readResults(socketFD, jobs, modeNames[mode]);
+            }
+            close(socketFD);
+        }
+
+        //Supervisor and workers share the process group
+        kill(-daemonPid, SIGTERM);
+        waitpid(daemonPid, NULL, 0);
+    }
+    free(jobs);
+
+    if(failures > 0)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
+
+/*************************************************
+ * Function: startDaemon
+ * Description: Forks an encryption daemon with one worker in a process group of its own
+ * Params: NULL terminated options for the mode, port to listen on
+ * Returns: pid of the daemon, which is also its process group
+ * Pre-conditions: nothing else listens on the port
+ * Post-conditions: daemon is starting, the caller kills the process group when done
+ * **********************************************/
+int startDaemon(char** options, char* port)
+{
+    char* daemonArgs[8];
+    int pid, argc;
+
+    argc = 0;
+    daemonArgs[argc++] = "otp_enc_d";
+    while(*options != NULL)
+    {
+        daemonArgs[argc++] = *options++;
+    }
+    daemonArgs[argc++] = port;
+    daemonArgs[argc++] = "1";
+    daemonArgs[argc] = NULL;
+
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "stream_test error: fork failed\n");
+        exit(1);
+    }
+    else if(pid == 0)
+    {
+        setpgid(0, 0);
+        otpProgramName = "otp_enc_d";
+        exit(daemonMain(argc, daemonArgs, OTP_OP_ENC));
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+/*************************************************
+ * Function: connectDaemon
+ * Description: Connects to the daemon and exchanges binary protocol hellos, retrying while it starts
+ * Params: address of the daemon
+ * Returns: connected socket file descriptor, -1 if the daemon never answered with an encryption hello
+ * Pre-conditions: address is filled
+ * Post-conditions: socket is ready for requests, a receive gives up after RESULT_TIMEOUT_SECONDS
+ * **********************************************/
+int connectDaemon(struct sockaddr_storage* serverAddress)
+{
+    int socketFD, tries;
+    struct otpHeader header;
+    struct timeval timeout;
+
+    for(tries=0;tries<CONNECT_TRIES;tries++)
+    {
+        socketFD = socket(AF_INET, SOCK_STREAM, 0);
+        if(socketFD < 0)
+        {
+            return -1;
+        }
+        if(connect(socketFD, (struct sockaddr*)serverAddress, addrLength(serverAddress)) == 0)
+        {
+            //A daemon that stops answering fails the test instead of hanging it
+            timeout.tv_sec = RESULT_TIMEOUT_SECONDS;
+            timeout.tv_usec = 0;
+            setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            if(sendHeader(socketFD, OTP_MSG_HELLO, OTP_OP_ENC, 0, 0) == 0 && recvHeader(socketFD, &header) == 0 &&
+               header.type == OTP_MSG_HELLO && header.flags == OTP_OP_ENC)
+            {
+                return socketFD;
+            }
+            close(socketFD);
+            return -1;
+        }
+        close(socketFD);
+        usleep(10000);
+    }
+    return -1;
+}
+
+/*************************************************
+ * Function: sendJobs
+ * Description: Sends the chunk pairs of every request round robin, the first chunk of each request, then the second and so
+ * on, so pairs of different requests follow each other on the connection. Nothing is read until all are sent
+ * Params: connected socket file descriptor, requests
+ * Returns: 0 if everything was sent, -1 otherwise
+ * Pre-conditions: hellos have been exchanged
+ * Post-conditions: every pair is on its way
+ * **********************************************/
+int sendJobs(int socketFD, struct testJob* jobs)
+{
+    int chunk, i, flags;
+
+    for(chunk=0;chunk<CHUNKS;chunk++)
+    {
+        flags = (chunk < CHUNKS - 1) ? OTP_FLAG_MORE : 0;
+        for(i=0;i<NUM_JOBS;i++)
+        {
+            if(sendHeader(socketFD, OTP_MSG_TEXT, flags, CHUNK_LEN, jobIds[i]) < 0 ||
+               sendAll(socketFD, &jobs[i].text[chunk*CHUNK_LEN], CHUNK_LEN) < 0 ||
+               sendHeader(socketFD, OTP_MSG_KEY, flags, CHUNK_LEN, jobIds[i]) < 0 ||
+               sendAll(socketFD, &jobs[i].key[chunk*CHUNK_LEN], CHUNK_LEN) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: readResults
+ * Description: Reads result messages until every request has its last one, each is appended to the request its id names
+ * Params: connected socket file descriptor, requests, name of the daemon mode for the messages
+ * Returns: number of problems found, an unknown id, an error message, a result past the end of its request, a cut off
+ * connection or a result that does not match
+ * Pre-conditions: every request was sent
+ * Post-conditions: the results of each request are in its result buffer
+ * **********************************************/
+int readResults(int socketFD, struct testJob* jobs, const char* mode)
+{
+    struct otpHeader header;
+    int numDone, i;
+
+    numDone = 0;
+    while(numDone < NUM_JOBS)
+    {
+        if(recvHeader(socketFD, &header) < 0)
+        {
+            fprintf(stderr, "stream_test: %s daemon, connection ended with %d of %d requests answered\n", mode, numDone, NUM_JOBS);
+            return 1;
+        }
+        for(i=0;i<NUM_JOBS && jobIds[i] != header.id;i++);
+        if(header.type != OTP_MSG_RESULT || i == NUM_JOBS || jobs[i].done ||
+           jobs[i].received + header.length > sizeof(jobs[i].result))
+        {
+            fprintf(stderr, "stream_test: %s daemon sent message type %d of %u characters under id %u, not a result of an open request\n",
+                    mode, header.type, header.length, header.id);
+            return 1;
+        }
+        if(recvAll(socketFD, &jobs[i].result[jobs[i].received], header.length) < 0)
+        {
+            fprintf(stderr, "stream_test: %s daemon, result of id %u was cut off\n", mode, header.id);
+            return 1;
+        }
+        jobs[i].received += header.length;
+        if(!(header.flags & OTP_FLAG_MORE))
+        {
+            jobs[i].done = 1;
+            numDone++;
+        }
+    }
+
+    for(i=0;i<NUM_JOBS;i++)
+    {
+        if(jobs[i].received != sizeof(jobs[i].result) || memcmp(jobs[i].result, jobs[i].expected, sizeof(jobs[i].result)) != 0)
+        {
+            fprintf(stderr, "stream_test: %s daemon, id %u got %d characters back that do not match its cipher text\n",
+                    mode, jobIds[i], jobs[i].received);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*************************************************
+ * Function: fillRandom
+ * Description: Fills a buffer with random characters from the 27 character alphabet
+ * Params: buffer, number of characters
+ * Returns: none
+ * Pre-conditions: buffer holds at least len characters
+ * Post-conditions: buffer is filled
+ * **********************************************/
+void fillRandom(char* buffer, int len)
+{
+    int i;
+    char alphabetASCII[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+    for(i=0;i<len;i++)
+    {
+        buffer[i] = alphabetASCII[rand()%27];
+    }
+}
+
+/*************************************************
+ * Function: pickPort
+ * Description: Picks a port nothing listens on by binding to port 0 and reading back the one the kernel chose
+ * Params: port string buffer, buffer size
+ * Returns: none
+ * Pre-conditions: none
+ * Post-conditions: buffer holds the port number as a string, exits if no socket could be bound
+ * **********************************************/
+void pickPort(char* port, int size)
+{
+    int socketFD;
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+
+    memset(&address, '\0', sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if(socketFD < 0 || bind(socketFD, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+       getsockname(socketFD, (struct sockaddr*)&address, &addressSize) < 0)
+    {
+        fprintf(stderr, "stream_test error: could not find a free port\n");
+        exit(1);
+    }
+    snprintf(port, size, "%d", ntohs(address.sin_port));
+    close(socketFD);
+}